@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Helpers to place the calling thread on CPUs and NUMA nodes and to change
+// its scheduling policy
+// All helpers apply to the calling thread only and throw a std::runtime_error
+// on failure
+namespace DNS {
+// Parses a CPU list such as "0,2,4-7" (same format as taskset -c)
+std::vector<int> parseCpuList(const std::string &list);
+
+// Pins the calling thread to a single CPU
+void pinThread(int cpu);
+
+// Lets the calling thread run on every online CPU except the given ones
+// Does nothing if that would leave no CPU to run on
+void avoidCpus(const std::vector<int> &cpus);
+
+// Makes the kernel allocate the calling thread's memory on the NUMA node it
+// runs on, regardless of the process-wide policy (e.g. numactl --interleave)
+// Combined with pinThread(), everything a worker allocates (and first touches)
+// afterwards is local to its CPU.
+void useLocalMemory();
+
+// Switches the calling thread to SCHED_FIFO with the given priority (1-99)
+void setRealtime(int priority);
+} // namespace DNS
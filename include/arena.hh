@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+namespace DNS {
+namespace Default {
+// Large enough to hold a parsed query and its reply without growing
+static const size_t ARENA_BLOCK_SIZE = 16 * 1024;
+} // namespace Default
+
+// The Arena is a bump-pointer allocator owned by a single worker
+// Allocations are never freed individually. Instead, the worker calls reset()
+// once a request (or a batch of requests) is done, which rewinds the arena to
+// its first block. Blocks are kept across resets, so once the arena has grown
+// to the working set size, serving requests no longer touches malloc/free.
+// Note: The arena is NOT thread-safe
+class Arena {
+public:
+  explicit Arena(size_t blockSize = Default::ARENA_BLOCK_SIZE);
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Returns size bytes aligned to align (which must be a power of 2)
+  void *allocate(size_t size, size_t align) {
+    auto ptr = align_up(m_ptr, align);
+    if (ptr + size > m_end || ptr < m_ptr) {
+      return grow(size, align);
+    }
+    m_ptr = ptr + size;
+    return ptr;
+  }
+
+  // Releases every allocation at once
+  // All objects allocated from the arena must be destroyed before a reset
+  void reset();
+
+  // Bytes handed out since the last reset
+  size_t used() const;
+  // Bytes reserved from the system across all blocks
+  size_t capacity() const { return m_capacity; }
+
+private:
+  struct Block {
+    Block *m_next;
+    size_t m_size;
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  static char *align_up(char *ptr, size_t align) {
+    auto addr = reinterpret_cast<uintptr_t>(ptr);
+    return reinterpret_cast<char *>((addr + align - 1) & ~(align - 1));
+  }
+
+  void *grow(size_t size, size_t align);
+  void enter(Block *block);
+
+  size_t m_blockSize;
+  size_t m_capacity = 0;
+  // Bytes used in the blocks preceding m_current
+  size_t m_retired = 0;
+  Block *m_head = nullptr;
+  Block *m_current = nullptr;
+  char *m_ptr = nullptr;
+  char *m_end = nullptr;
+}; // class Arena
+
+// ArenaAllocator is a standard allocator that draws memory from an Arena
+// A default constructed allocator (no arena) falls back to the global heap,
+// which keeps arena-aware containers usable outside of a worker, e.g. in the
+// client or in tests
+// Note: Containers keep the allocator they were constructed with. Copying a
+// container copies its allocator, so a copy of an arena-backed message lives
+// in the same arena.
+template <typename T> class ArenaAllocator {
+public:
+  using value_type = T;
+
+  ArenaAllocator() noexcept : m_arena(nullptr) {}
+  ArenaAllocator(Arena *arena) noexcept : m_arena(arena) {}
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) noexcept
+      : m_arena(other.m_arena) {}
+
+  T *allocate(size_t n) {
+    if (m_arena == nullptr) {
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T *>(m_arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, size_t) noexcept {
+    // Arena memory is released in bulk by Arena::reset()
+    if (m_arena == nullptr) {
+      ::operator delete(ptr);
+    }
+  }
+
+  Arena *m_arena;
+}; // class ArenaAllocator
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.m_arena == b.m_arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.m_arena != b.m_arena;
+}
+} // namespace DNS
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stats.hh>
+#include <vector>
+#include <wire.hh>
+
+namespace DNS {
+namespace Default {
+// Memory the forwarding cache takes across all workers, index included
+static const size_t CACHE_BYTES = 64 * 1024 * 1024;
+// Independently locked parts of the cache (a power of 2)
+static const size_t CACHE_SHARDS = 16;
+// Upper bound on the time a response is cached, whatever its TTLs
+static const uint32_t CACHE_MAX_TTL = 24 * 60 * 60;
+// Responses served with less than this percentage of their TTL left are
+// refreshed ahead of their expiry (0 disables refreshing)
+static const uint32_t CACHE_PREFETCH_PERCENT = 10;
+// Time expired responses are kept to be served stale, and the TTL they are
+// served with (c.f. RFC8767, which suggests 1 to 3 days and 30s)
+static const uint32_t CACHE_STALE_SECONDS = 24 * 60 * 60;
+static const uint32_t CACHE_STALE_TTL = 30;
+} // namespace Default
+
+// AnswerCache holds the responses of upstream servers, keyed by question
+// A response is cached for the smallest TTL of its records (or for the SOA
+// MINIMUM of a negative answer, c.f. RFC2308), and the TTLs of a cached
+// response are counted down as it ages.
+//
+// The cache takes a fixed amount of memory, split into shards. A shard is:
+// - an index of 64-byte buckets of 8 slots. A slot packs a tag of the key's
+//   hash, the offset of the entry and an access frequency into 64 bits, so a
+//   lookup reads a single cache line of the index.
+// - an arena holding the entries back to back (header, key, records and the
+//   offsets of their TTLs), split into a small and a main FIFO log.
+// Eviction follows S3-FIFO (Yang et al., "FIFO queues are all you need for
+// cache eviction", SOSP'23): new entries go to the small log. Once they reach
+// its tail, those accessed since are moved to the main log and the others are
+// evicted, leaving their hash in a ghost table, so that they go straight to
+// the main log if they come back. Entries at the tail of the main log are
+// re-inserted while they were accessed (decrementing their frequency), and
+// evicted otherwise.
+//
+// A hit on an entry close to its expiry (c.f. Default::CACHE_PREFETCH_PERCENT)
+// asks the caller to refresh it from upstream while the cached response is
+// still served. A flag in the entry's slot, set with a CAS, makes sure that a
+// single worker does, until the refreshed response replaces the entry.
+//
+// Expired entries are kept for a while (until evicted), for lookupStale() to
+// answer clients when upstreams fail to (c.f. RFC8767).
+//
+// Reads take no lock: every shard has a sequence counter that writers bump
+// around their changes, and readers copy the entry out and retry if the
+// counter moved (a seqlock). Writers, that is upstream replies, serialize on
+// the shard's mutex.
+class AnswerCache {
+public:
+  explicit AnswerCache(
+          size_t bytes = Default::CACHE_BYTES,
+          uint32_t prefetchPercent = Default::CACHE_PREFETCH_PERCENT,
+          uint32_t staleSeconds = Default::CACHE_STALE_SECONDS);
+  ~AnswerCache();
+  AnswerCache(const AnswerCache &) = delete;
+  AnswerCache &operator=(const AnswerCache &) = delete;
+
+  // Caches an upstream response to a single question, accounting the
+  // entries it evicts into the worker's stats
+  // Responses that are truncated, failed or carry no TTL are ignored.
+  // Returns whether the response was cached.
+  bool insert(const unsigned char *response, size_t len, uint64_t nowMs,
+              WorkerStats &stats);
+
+  // Completes a response started with builder.begin(query) from the cache,
+  // accounting the hit or miss into the worker's stats
+  // Returns false if the question is not cached (or expired). On a hit,
+  // prefetch (if given) is set when the caller is the one to refresh the entry.
+  bool lookup(const MessageView &query, ResponseBuilder &builder,
+              uint64_t nowMs, WorkerStats &stats, bool *prefetch = nullptr);
+  // Same as lookup(), for the responses that expired less than the stale
+  // window ago as well, which are served with Default::CACHE_STALE_TTL
+  // Counts the stale answers (and no hits or misses).
+  bool lookupStale(const MessageView &query, ResponseBuilder &builder,
+                   uint64_t nowMs, WorkerStats &stats);
+
+  // Entries in the index (including expired ones not evicted yet)
+  size_t size() const;
+  // Bytes the cache was given
+  size_t capacity() const { return m_capacity; }
+
+private:
+  struct EntryHeader;
+  struct alignas(64) Bucket {
+    std::atomic<uint64_t> m_slots[8];
+  };
+  // A FIFO log: a circular region of the shard's arena
+  struct Log {
+    uint64_t m_begin;
+    uint64_t m_end;
+    uint64_t m_head;
+    uint64_t m_tail;
+    uint64_t m_used;
+  };
+  struct Shard {
+    std::atomic<uint64_t> m_sequence{0};
+    std::mutex m_mutex;
+    Bucket *m_buckets = nullptr;
+    uint64_t m_bucketMask = 0;
+    std::unique_ptr<unsigned char[]> m_arena;
+    uint64_t m_arenaSize = 0;
+    Log m_small;
+    Log m_main;
+    // Hashes of the entries recently evicted from the small log
+    std::vector<uint32_t> m_ghost;
+  };
+
+  Shard &shard(uint64_t hash) {
+    return m_shards[hash & (Default::CACHE_SHARDS - 1)];
+  }
+  std::atomic<uint64_t> *findSlot(Shard &shard, uint64_t hash,
+                                  uint64_t offset);
+  void addSlot(Shard &shard, uint64_t hash, uint64_t offset, int frequency,
+               WorkerStats &stats);
+  // Appends an entry to a log, evicting from its tail if allowed
+  // Returns the offset of the entry, or -1 if it does not fit
+  int64_t append(Shard &shard, Log &log, const unsigned char *entry,
+                 uint32_t size, bool evict, uint64_t nowMs,
+                 WorkerStats &stats);
+  void evictOldest(Shard &shard, Log &log, uint64_t nowMs,
+                   WorkerStats &stats);
+  // Copies the entry of the question (expired or not) into entry
+  // Returns its slot, whose value is returned as well, or nullptr
+  std::atomic<uint64_t> *read(const MessageView &query, unsigned char *entry,
+                              uint64_t &value);
+  // Completes a response from a copy of an entry
+  void respond(const unsigned char *entry, ResponseBuilder &builder,
+               uint64_t nowMs, bool stale);
+
+  size_t m_capacity;
+  uint32_t m_prefetchPercent;
+  uint64_t m_staleMs;
+  Shard m_shards[Default::CACHE_SHARDS];
+}; // class AnswerCache
+} // namespace DNS
@@ -1,8 +1,24 @@
+#pragma once
+
 #include <arpa/inet.h>
+#include <atomic>
+#include <cache.hh>
+#include <forwarder.hh>
+#include <handlers.hh>
+#include <mutex>
+#include <memory>
 #include <netinet/in.h>
+#include <querylog.hh>
+#include <rrl.hh>
+#include <stats.hh>
 #include <string>
+#include <tcp.hh>
+#include <tls.hh>
 #include <unordered_map>
 #include <vector>
+#include <views.hh>
+#include <wire.hh>
+#include <zone.hh>
 
 namespace DNS {
 namespace Default {
@@ -12,23 +28,121 @@ static const uint32_t BACKLOG = 5;
 static const uint16_t BUFFER_SIZE = 1024;
 } // namespace Default
 
+// Config holds the tunables of a daemon
+// The defaults preserve the behavior of a plain spoofing daemon
+struct Config {
+  // Response rate limiting (disabled by default)
+  RateLimiter::Options m_rrl;
+  // Per-stage latency histograms (disabled by default)
+  bool m_stageTiming = false;
+  // CPUs to pin one worker each to (default: a single, unpinned worker)
+  std::vector<int> m_cpus;
+  // SCHED_FIFO priority of the workers (default: 0, regular scheduling)
+  int m_realtimePriority = 0;
+  // Microseconds a blocking worker spins on its empty socket before going to
+  // sleep (default: 0, sleep right away)
+  uint32_t m_busyPollUs = 0;
+  // Kernel receive timestamps, which feed the "queue" latency histogram
+  bool m_rxTimestamps = false;
+  // Queries that waited longer than this in the socket queue are dropped
+  // unanswered (default: 0, never). Implies m_rxTimestamps.
+  uint32_t m_maxQueueDelayMs = 0;
+  // Socket buffer sizes in bytes (default: 0, the kernel default)
+  uint32_t m_rcvbuf = 0;
+  uint32_t m_sndbuf = 0;
+  // Binary query log (default: none)
+  QueryLog::Options m_queryLog;
+  // Split-horizon views (default: none, every client gets the same answers)
+  std::vector<ViewConfig> m_views;
+  // SOA of the zone the daemon is authoritative for, as
+  // "ZONE MNAME RNAME SERIAL REFRESH RETRY EXPIRE MINIMUM" (default: none,
+  // every name is answered whatever its type)
+  std::string m_soa;
+  // Upstream servers, as "ADDRESS[:PORT]", to forward the names missing from
+  // the views (and outside the zone) to instead of spoofing them (default:
+  // none)
+  std::vector<std::string> m_upstreams;
+  // Sockets every worker opens to each upstream server
+  int m_upstreamSockets = Default::UPSTREAM_SOCKETS;
+  // Retransmission schedule of forwarded queries
+  Resolver::Options m_upstreamRetries;
+  // Memory the cache of upstream responses takes across all workers
+  size_t m_cacheBytes = Default::CACHE_BYTES;
+  // Cached responses served with less than this percentage of their TTL left
+  // are refreshed from upstream (0: never)
+  uint32_t m_prefetchPercent = Default::CACHE_PREFETCH_PERCENT;
+  // Seconds expired responses can be served stale for (0: never), and
+  // milliseconds a client waits for upstreams before it is (0: only once
+  // they failed)
+  uint32_t m_staleSeconds = Default::CACHE_STALE_SECONDS;
+  uint32_t m_staleDeadlineMs = Default::STALE_DEADLINE_MS;
+  // Queries over TCP, on the same port as UDP
+  bool m_tcp = true;
+  // PEM certificate chain and private key to serve DNS over TLS with
+  // (default: none, no DNS over TLS)
+  std::string m_tlsCertificate;
+  std::string m_tlsKey;
+  uint16_t m_tlsPort = Default::TLS_PORT;
+  // Print every Nth query of each worker, and its reply, to stderr
+  // (default: 0, none), dig-style or as JSON lines
+  uint32_t m_debugSample = 0;
+  bool m_debugJson = false;
+};
+
 class Daemon {
 public:
   // Accepts a list of records (formatted as A Record/IP address) and returns an
   // instance of a daemon
-  Daemon(std::string spoof);
+  Daemon(std::string spoof, Config config = Config());
 
   // Blocking call to run the daemon and bind to port 53 (DNS Spec)
+  // The calling thread becomes a worker with a socket of its own
   void run(bool block);
 
-  // Hint to stop the daemon
-  // In the current implementation, the daemon will continue running until the
-  // next request comes in
-  void stop() { m_complete = true; }
+  // Blocking call to run the workers described by the config, each on its
+  // own thread, until all of them are done
+  void serve();
+
+  // Stops the daemon
+  // Workers blocked on their socket are woken up and return from run()
+  void stop();
+
+  // Appends the answers to a query to a reply started with builder.begin(),
+  // exactly as the workers do (before rate limiting and sending), from the
+  // view of the client (default: the default view)
+  // Returns false, leaving the reply untouched, if the query is to be
+  // forwarded upstream instead.
+  // Used by in-process benchmarks such as dnsd-replay.
+  bool answer(const MessageView &query, ResponseBuilder &builder,
+              const sockaddr *client = nullptr) const;
+
+  // Returns a snapshot of the counters summed across all workers
+  // Safe to call from any thread while the daemon is running
+  Stats stats() const;
   ~Daemon();
 
 private:
+  // Allocates the stats of a new worker and publishes them to stats readers
+  WorkerStats &addWorker();
+
+  // Tracks the sockets stop() has to wake up
+  void addSocket(int sockFD);
+  void removeSocket(int sockFD);
+
   struct in_addr m_spoofIP;
-  bool m_complete = false;
+  Config m_config;
+  std::atomic<bool> m_complete{false};
+  // Owned by the daemon, so that stats outlive the workers
+  std::atomic<WorkerStats *> m_workers[Default::MAX_WORKERS] = {};
+  std::atomic<int> m_workerCount{0};
+  std::mutex m_socketsMutex;
+  std::vector<int> m_sockets;
+  std::unique_ptr<QueryLog> m_queryLog;
+  std::unique_ptr<Views> m_views;
+  std::unique_ptr<Zone> m_zone;
+  std::vector<sockaddr_in> m_upstreams;
+  std::unique_ptr<AnswerCache> m_cache;
+  // Shared by the workers, so that sessions resume on any of them
+  std::unique_ptr<TlsContext> m_tls;
 }; // class Daemon
 } // namespace DNS
\ No newline at end of file
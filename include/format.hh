@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <message.hh>
+
+namespace DNS {
+namespace Default {
+// Size of the buffer a thread's formatters share, enough for any message
+// that fits a UDP datagram
+static const size_t FORMAT_BUFFER_SIZE = 16 * 1024;
+} // namespace Default
+
+// Formatter writes messages in presentation format, the way dig prints them,
+// or as JSON objects, into a fixed buffer
+// Nothing is allocated and nothing is flushed: numbers, addresses and names
+// are written in place, and the caller decides what to do with the text
+// (e.g. a single write() to stderr). Output that doesn't fit is cut short
+// and marked with "...", which overflowed() tells.
+// Messages are formatted either parsed (Message) or straight from the wire,
+// which also covers the authority and additional sections and follows the
+// compression pointers in names within the records' data.
+// Note: A formatter is NOT thread-safe.
+class Formatter {
+public:
+  enum class Style { DIG, JSON };
+
+  // Formats into the caller's buffer
+  Formatter(char *buf, size_t len, Style style = Style::DIG);
+  // Formats into the buffer of the calling thread, which every formatter
+  // constructed this way on the thread shares
+  explicit Formatter(Style style = Style::DIG);
+
+  Formatter &format(const Message &msg);
+  Formatter &format(const Message::Header &hdr);
+  Formatter &format(const Message::Question &q);
+  Formatter &format(const Message::ResourceRecord &rr);
+  // Formats the message from its wire format
+  // Malformed parts are reported where they start, and end the message.
+  Formatter &format(const unsigned char *wire, size_t len);
+  // Appends text as is
+  Formatter &append(const char *text);
+
+  const char *data() const { return m_buf; }
+  size_t size() const { return m_size; }
+  bool overflowed() const { return m_overflowed; }
+  void clear() {
+    m_size = 0;
+    m_overflowed = false;
+  }
+
+private:
+  // Section headings and their JSON keys
+  enum class Section { QUESTION = 0, ANSWER, AUTHORITY, ADDITIONAL };
+
+  void header(const Message::Header &hdr);
+  void beginSection(Section section);
+  void endSection();
+  void beginQuestion();
+  void endQuestion(uint16_t qtype, uint16_t qclass);
+  void beginRecord();
+  void recordFields(uint32_t ttl, uint16_t type, uint16_t cls);
+  void endRecord();
+
+  // Writes the name of Labels
+  void name(const Labels &labels);
+  // Writes the name at data, following compression pointers into msg (if
+  // given). Returns the bytes the name takes at data, or 0 (writing
+  // nothing) if it is malformed.
+  size_t name(const unsigned char *data, size_t len,
+              const unsigned char *msg, size_t msgLen);
+  // Writes the record data, in the generic format (c.f. RFC3597) unless the
+  // type has a presentation format of its own and the data parses
+  void rdata(uint16_t type, const unsigned char *data, size_t len,
+             const unsigned char *msg, size_t msgLen);
+  bool typedRdata(uint16_t type, const unsigned char *data, size_t len,
+                  const unsigned char *msg, size_t msgLen);
+
+  void type(uint16_t type);
+  void cls(uint16_t cls);
+  // Writes a character of a label or of a character-string, escaped the way
+  // presentation format (and then JSON) wants it
+  void escaped(unsigned char c, bool label);
+  // Writes text, escaped for JSON strings
+  void text(char c);
+  void put(char c);
+  void put(const char *s);
+  void put(const char *s, size_t len);
+  void number(uint64_t value);
+  void separator();
+  // Reports where the wire format stopped making sense
+  void malformed(size_t offset);
+
+  char *m_buf;
+  size_t m_capacity;
+  size_t m_size = 0;
+  bool m_overflowed = false;
+  Style m_style;
+  // Whether the next JSON element of an array or object is the first
+  bool m_first = true;
+}; // class Formatter
+} // namespace DNS
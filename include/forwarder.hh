@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cache.hh>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <resolver.hh>
+#include <rrl.hh>
+#include <stats.hh>
+#include <string>
+#include <timer.hh>
+#include <unordered_map>
+#include <vector>
+#include <wire.hh>
+
+namespace DNS {
+namespace Default {
+// Sockets every worker opens to each upstream server
+static const int UPSTREAM_SOCKETS = 4;
+static const uint16_t UPSTREAM_PORT = 53;
+// Time a client waits for an upstream reply before getting a stale answer,
+// if one is cached (c.f. the client response timer of RFC8767)
+static const uint32_t STALE_DEADLINE_MS = 1800;
+} // namespace Default
+
+// Parses an upstream server given as "ADDRESS[:PORT]"
+// Throws a std::runtime_error if the address is invalid
+sockaddr_in parseUpstream(const std::string &upstream);
+
+// Forwarder relays the queries a worker can't answer to upstream servers
+// It owns a small pool of Resolvers, that is of connected non-blocking UDP
+// sockets, each bound by the kernel to a random ephemeral port. Queries go to
+// the upstreams in turn and to a random socket of the upstream, with a random
+// ID, so that an off-path attacker has to guess both to spoof a reply.
+// Replies are cached, then relayed to the client from the worker's socket
+// with the client's ID and question. Queries that fail are answered with
+// SERVFAIL. Prefetches only refresh the cache.
+// Queries for a question already in flight upstream (from any client, or a
+// prefetch) don't go upstream again: they wait for the same reply, and each
+// client gets it under its own ID.
+// Clients still waiting once the stale deadline passed, or when the query
+// failed, are answered from the expired entry in the cache if there is one,
+// while the query goes on to refresh it.
+// Replies to UDP clients are accounted by the worker's rate limiter, as the
+// worker's own replies are, and dropped or slipped (truncated) the same way.
+// Replies to clients of a stream transport (TCP) go to the stream sink instead.
+// The forwarder never blocks: the worker polls fds() along with its own
+// socket and calls process() when any of them is readable. Retransmissions
+// are due on a timer of the worker's wheel.
+// Note: A forwarder is NOT thread-safe. Every worker owns one.
+class Forwarder {
+public:
+  // Sends a reply on the stream a query came from
+  using StreamSink = std::function<void(
+          uint64_t stream, const unsigned char *response, size_t len)>;
+
+  // A staleDeadlineMs of 0 only serves stale answers once queries fail
+  // Replies to UDP clients aren't rate limited without an rrl.
+  Forwarder(const std::vector<sockaddr_in> &upstreams, int socketsPerUpstream,
+            Resolver::Options options, uint32_t staleDeadlineMs,
+            AnswerCache &cache, WorkerStats &stats, TimerWheel &timers,
+            int sockFD, RateLimiter *rrl = nullptr);
+
+  // Sends a query with a single question upstream
+  // Replies go to the client's address, or to the stream sink if the query
+  // came from a stream.
+  void forward(const MessageView &query, const sockaddr_in &client,
+               uint64_t stream = 0);
+  // Sends the question of a query answered from the cache upstream, to
+  // refresh the cached response before it expires
+  void prefetch(const MessageView &query);
+
+  // Relays the replies that arrived and handles retransmissions
+  // Returns the number of queries that completed.
+  int process(uint64_t nowMs);
+
+  // Upstream sockets, to poll for replies
+  std::vector<int> fds() const;
+  void setStreamSink(StreamSink sink) { m_streamSink = std::move(sink); }
+  // Questions in flight upstream
+  size_t inflight() const { return m_pending.size(); }
+
+private:
+  // What a relayed reply needs from the client's query
+  struct Client {
+    sockaddr_in m_address;
+    // 0 for UDP
+    uint64_t m_stream;
+    Message::Header m_hdr;
+    std::string m_question;
+  };
+  // A question in flight
+  struct Pending {
+    // Clients waiting for the reply (none for a prefetch)
+    std::vector<Client> m_clients;
+    // Due once the clients waited for the stale deadline
+    std::unique_ptr<Timer> m_deadline;
+  };
+
+  static std::string questionKey(const MessageView &query);
+  // Sends the question upstream, for the clients in m_pending
+  // Throws if the socket has every query ID in flight, in which case nothing
+  // waits for a reply.
+  void resolve(const std::string &key);
+  // Picks the socket of the next upstream in turn
+  Resolver &nextResolver();
+  void complete(const std::string &key, Resolver::Result result);
+  // Answers the clients of the question that can be from stale entries
+  void deadline(const std::string &key);
+  // Answers a client whose query failed from a stale entry, or with SERVFAIL
+  void fail(const Client &client);
+  // Returns false if the cache holds no (stale) answer for the client
+  bool serveStale(const Client &client);
+  // Arms the timer for the next retransmission, if any
+  void rearm();
+  void send(const Client &client, const unsigned char *response, size_t len);
+
+  std::vector<std::unique_ptr<Resolver>> m_resolvers;
+  // The sockets of m_resolvers, in the same order
+  std::vector<pollfd> m_pollFDs;
+  // By question in flight
+  std::unordered_map<std::string, Pending> m_pending;
+  uint32_t m_staleDeadlineMs;
+  int m_socketsPerUpstream;
+  size_t m_nextUpstream = 0;
+  Random m_random;
+  AnswerCache &m_cache;
+  WorkerStats &m_stats;
+  TimerWheel &m_timers;
+  Timer m_retransmit;
+  int m_sockFD;
+  RateLimiter *m_rrl;
+  StreamSink m_streamSink;
+  uint64_t m_nowMs = 0;
+  std::vector<unsigned char> m_buf;
+  ResponseBuilder m_builder;
+}; // class Forwarder
+} // namespace DNS
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <wire.hh>
+#include <zone.hh>
+
+namespace DNS {
+namespace Default {
+// TTL of the records the daemon answers with
+static const uint32_t ANSWER_TTL = 180;
+// Preference of the synthesized MX records
+static const uint16_t MX_PREFERENCE = 10;
+} // namespace Default
+
+// What the handler of a question's type answers from
+struct QuestionContext {
+  // Index of the question in the query (and the response)
+  int m_question;
+  // Address of the name in the client's view, or the view's spoofed address
+  // Only the apex of the zone may have none.
+  const in_addr *m_address;
+  // The zone the daemon is authoritative for, if any, and whether the name
+  // is its apex
+  const Zone *m_zone;
+  bool m_apex;
+}; // struct QuestionContext
+
+// TypeHandler<QTYPE> appends the records answering a question of type QTYPE
+// answer() returns false if they don't fit (the builder set TC).
+// Names only have an IPv4 address, and authoritative daemons only publish
+// the records they have data for. Spoofing daemons also make every name its
+// own mail exchanger, so that mail leads to the address as well.
+// The primary template is the default for the types without a handler of
+// their own (AAAA, CNAME, TXT and PTR among them): no records, that is
+// NODATA. AAAA in particular doesn't publish the IPv4-mapped address
+// (::ffff:a.b.c.d), which only has a meaning inside a dual-stack host.
+template <uint16_t QTYPE> struct TypeHandler {
+  static bool answer(const QuestionContext &, ResponseBuilder &) {
+    return true;
+  }
+};
+
+template <> struct TypeHandler<Type::A> {
+  static const uint16_t QTYPE = Type::A;
+  static bool answer(const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    if (question.m_address == nullptr) {
+      return true;
+    }
+    return builder.add(ResponseBuilder::Section::ANSWER, question.m_question,
+                       Type::A, CLASS_IN, Default::ANSWER_TTL,
+                       &question.m_address->s_addr, 4);
+  }
+};
+
+// The name is its own mail exchanger, whose address is the spoofed one
+template <> struct TypeHandler<Type::MX> {
+  static const uint16_t QTYPE = Type::MX;
+  static bool answer(const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    if (question.m_zone != nullptr) {
+      return true;
+    }
+    auto pointer = 0xc000 | builder.nameOffset(question.m_question);
+    unsigned char rdata[4] = {
+        Default::MX_PREFERENCE >> 8, Default::MX_PREFERENCE & 0xff,
+        static_cast<unsigned char>(pointer >> 8),
+        static_cast<unsigned char>(pointer & 0xff)};
+    return builder.add(ResponseBuilder::Section::ANSWER, question.m_question,
+                       Type::MX, CLASS_IN, Default::ANSWER_TTL, rdata,
+                       sizeof(rdata));
+  }
+};
+
+// The primary name server of the SOA serves the apex
+template <> struct TypeHandler<Type::NS> {
+  static const uint16_t QTYPE = Type::NS;
+  static bool answer(const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    if (!question.m_apex) {
+      return true;
+    }
+    const auto &primary = question.m_zone->primary();
+    return builder.add(ResponseBuilder::Section::ANSWER, question.m_question,
+                       Type::NS, CLASS_IN, Default::ANSWER_TTL,
+                       primary.data(), static_cast<uint16_t>(primary.size()));
+  }
+};
+
+template <> struct TypeHandler<Type::SOA> {
+  static const uint16_t QTYPE = Type::SOA;
+  static bool answer(const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    if (!question.m_apex) {
+      return true;
+    }
+    const auto &soa = question.m_zone->soaRecord();
+    return builder.addRaw(ResponseBuilder::Section::ANSWER, soa.data(),
+                          soa.size(), 1);
+  }
+};
+
+// The address only (c.f. RFC8482)
+template <> struct TypeHandler<Type::ANY> : TypeHandler<Type::A> {
+  static const uint16_t QTYPE = Type::ANY;
+};
+
+// HandlerTable dispatches a question to the first of its handlers that
+// serves its type, or to the default one
+// The table is resolved at compile time: every handler is called directly
+// and inlined, and the dispatch compiles down to compares of the type, with
+// no indirect calls.
+template <typename... Handlers> struct HandlerTable;
+
+template <> struct HandlerTable<> {
+  static bool answer(uint16_t, const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    return TypeHandler<0>::answer(question, builder);
+  }
+};
+
+template <typename Handler, typename... Rest>
+struct HandlerTable<Handler, Rest...> {
+  static bool answer(uint16_t qtype, const QuestionContext &question,
+                     ResponseBuilder &builder) {
+    if (qtype == Handler::QTYPE) {
+      return Handler::answer(question, builder);
+    }
+    return HandlerTable<Rest...>::answer(qtype, question, builder);
+  }
+};
+
+// The types the daemon answers with records of their own
+using Handlers =
+        HandlerTable<TypeHandler<Type::A>, TypeHandler<Type::MX>,
+                     TypeHandler<Type::NS>, TypeHandler<Type::SOA>,
+                     TypeHandler<Type::ANY>>;
+} // namespace DNS
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace DNS {
+// Housekeeper runs periodic maintenance (stats, logging, reloads) and serves
+// side channels (metrics) on a single thread of its own, away from the
+// workers
+// The thread is never pinned to a worker CPU, so housekeeping can't preempt
+// a worker or pollute its caches.
+class Housekeeper {
+public:
+  using Task = std::function<void()>;
+
+  // Accepts the CPUs the workers are pinned to (if any)
+  explicit Housekeeper(std::vector<int> workerCpus = std::vector<int>());
+  ~Housekeeper();
+  Housekeeper(const Housekeeper &) = delete;
+  Housekeeper &operator=(const Housekeeper &) = delete;
+
+  // Runs the task every interval, starting one interval after start()
+  // Tasks must be registered before start()
+  void every(std::chrono::milliseconds interval, Task task);
+
+  // Runs the task whenever the file descriptor is readable
+  // Tasks must be registered before start(), and must not block
+  void watch(int fd, Task task);
+
+  void start();
+  // Stops the thread after the task in progress (if any) completes
+  void stop();
+
+private:
+  struct Periodic {
+    std::chrono::milliseconds m_interval;
+    std::chrono::steady_clock::time_point m_due;
+    Task m_task;
+  };
+
+  struct Watch {
+    int m_fd;
+    Task m_task;
+  };
+
+  void loop();
+
+  std::vector<int> m_workerCpus;
+  std::vector<Periodic> m_tasks;
+  std::vector<Watch> m_watches;
+  // Wakes the thread up when stopping
+  int m_wakeFD;
+  std::atomic<bool> m_stopped{false};
+  std::thread m_thread;
+}; // class Housekeeper
+} // namespace DNS
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace DNS {
+// Stages of serving a request, timed individually
+// QUEUE is the time a datagram waited in the socket before being received. It
+// is measured from kernel timestamps rather than by the StageTimer.
+// RRL is the response rate limiter's check of the reply.
+// Note: Append new stages before COUNT and give them a name in latency.cc
+enum class Stage : int {
+  QUEUE = 0,
+  RECV,
+  PARSE,
+  LOOKUP,
+  BUILD,
+  SERIALIZE,
+  SEND,
+  RRL,
+  COUNT
+};
+
+// Returns a stable, printable name for the stage
+const char *stageName(Stage stage);
+
+// Reads CLOCK_MONOTONIC in nanoseconds
+inline uint64_t monotonicNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Clock reads raw timestamps as cheaply as the platform allows
+// On x86 with an invariant TSC, a timestamp is a single rdtsc. Elsewhere it
+// falls back to CLOCK_MONOTONIC. Ticks are converted to nanoseconds only when
+// the histograms are read.
+class Clock {
+public:
+  static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (s_tsc) {
+      return __rdtsc();
+    }
+#endif
+    return monotonicNs();
+  }
+
+  // Nanoseconds per tick, calibrated once per process
+  static double nsPerTick();
+
+  // Picks the tick source and calibrates it. Called implicitly by the first
+  // StageTimer, which keeps the calibration off the request path.
+  static void init();
+
+private:
+  static bool s_tsc;
+}; // class Clock
+
+// Histogram is a log-linear (HDR-style) histogram of tick counts
+// Values below 2^SUB_BITS are counted exactly. Above that, every power of 2
+// is split into 2^(SUB_BITS-1) linear sub-buckets, which bounds the relative
+// error to ~6% over the whole range with a few hundred buckets.
+// Each instance has a single writer; readers merge it with relaxed loads.
+class Histogram {
+public:
+  static const int SUB_BITS = 5;
+  static const int MAX_BITS = 40;
+  static const int BUCKETS = (MAX_BITS - SUB_BITS + 2) << (SUB_BITS - 1);
+
+  // Records a value (single writer)
+  void record(uint64_t value) {
+    auto &bucket = m_buckets[index(value)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+  }
+
+  static int index(uint64_t value) {
+    if (value >= (uint64_t(1) << MAX_BITS)) {
+      value = (uint64_t(1) << MAX_BITS) - 1;
+    }
+    if (value < (uint64_t(1) << SUB_BITS)) {
+      return static_cast<int>(value);
+    }
+    int exponent = (63 - __builtin_clzll(value)) - (SUB_BITS - 1);
+    return (exponent << (SUB_BITS - 1)) + static_cast<int>(value >> exponent);
+  }
+
+  // Smallest value counted in the bucket
+  static uint64_t lowerBound(int index) {
+    if (index < (1 << SUB_BITS)) {
+      return index;
+    }
+    int exponent = (index >> (SUB_BITS - 1)) - 1;
+    uint64_t mantissa = index - (exponent << (SUB_BITS - 1));
+    return mantissa << exponent;
+  }
+
+  std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+}; // class Histogram
+
+// LatencySummary is a plain, mergeable copy of a Histogram
+struct LatencySummary {
+  void merge(const Histogram &histogram);
+  uint64_t count() const;
+  // Returns the value (in nanoseconds) at the given quantile in [0, 1]
+  double percentileNs(double quantile) const;
+
+  uint64_t m_buckets[Histogram::BUCKETS] = {};
+}; // struct LatencySummary
+
+// StageTimer times the stages of the request a worker is serving
+// Every lap() charges the ticks elapsed since the previous lap to a stage, so
+// a stage spread over several code sections is accounted once per request.
+// commit() records the per-stage totals of the request into the histograms.
+// A disabled timer costs one predictable branch per lap.
+class StageTimer {
+public:
+  StageTimer(bool enabled, Histogram *histograms);
+
+  bool enabled() const { return m_enabled; }
+
+  // Starts timing a request
+  void start() {
+    if (m_enabled) {
+      m_last = Clock::ticks();
+    }
+  }
+
+  // Charges the time elapsed since the last lap to the stage
+  void lap(Stage stage) {
+    if (m_enabled) {
+      auto now = Clock::ticks();
+      m_pending[static_cast<int>(stage)] += now - m_last;
+      m_last = now;
+    }
+  }
+
+  // Records the stages of the current request
+  void commit() {
+    if (m_enabled) {
+      for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+        if (m_pending[i] != 0) {
+          m_histograms[i].record(m_pending[i]);
+          m_pending[i] = 0;
+        }
+      }
+    }
+  }
+
+private:
+  bool m_enabled;
+  Histogram *m_histograms;
+  uint64_t m_last = 0;
+  uint64_t m_pending[static_cast<int>(Stage::COUNT)] = {};
+}; // class StageTimer
+} // namespace DNS
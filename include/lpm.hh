@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace DNS {
+// Prefix is an IPv4 or IPv6 network in network byte order
+struct Prefix {
+  // 4 (IPv4) or 16 (IPv6)
+  int m_bytes;
+  uint8_t m_address[16];
+  int m_length;
+};
+
+// Parses "10.0.0.0/8", "2001:db8::/32" or a bare address (a host prefix)
+// Throws a std::runtime_error if the prefix is invalid
+Prefix parsePrefix(const std::string &prefix);
+
+// LpmTable maps addresses to the value of their longest matching prefix
+// It is a multibit trie with controlled prefix expansion (DIR-16-8-8...): the
+// first 16 bits of the address index a flat root table, and every further
+// byte indexes a 256-entry chunk. An entry either holds a value or points to
+// the chunk of the next byte, so an IPv4 lookup reads at most 3 entries
+// (typically 1) and never branches on prefix lengths.
+// The table is built once and is read-only afterwards, so any number of
+// threads can look up concurrently.
+class LpmTable {
+public:
+  // Value of addresses no prefix matches
+  static const uint32_t NONE = 0;
+
+  // Maps every prefix to its value, for addresses of the given size (4 or
+  // 16 bytes). Values must be non-zero and below 2^31.
+  LpmTable(int bytes, std::vector<std::pair<Prefix, uint32_t>> prefixes);
+
+  uint32_t lookup(const uint8_t *address) const {
+    auto entry = m_entries[address[0] << 8 | address[1]];
+    for (int i = 2; (entry & CHILD) != 0; i++) {
+      entry = m_entries[(entry & ~CHILD) + address[i]];
+    }
+    return entry;
+  }
+
+  // Entries in use, a measure of the memory the table takes
+  size_t size() const { return m_entries.size(); }
+
+private:
+  static const uint32_t CHILD = uint32_t(1) << 31;
+  static const int ROOT_SIZE = 1 << 16;
+  static const int CHUNK_SIZE = 1 << 8;
+
+  void insert(const Prefix &prefix, uint32_t value);
+
+  int m_bytes;
+  std::vector<uint32_t> m_entries;
+}; // class LpmTable
+} // namespace DNS
@@ -1,7 +1,13 @@
+#pragma once
+
+#include <arena.hh>
 #include <arpa/inet.h>
+#include <memory>
 #include <ostream>
 #include <sstream>
 #include <stdexcept>
+#include <streambuf>
+#include <string>
 #include <vector>
 
 namespace DNS {
@@ -10,14 +16,34 @@ namespace Default {
 static const int MAX_LABEL_LENGTH = 63;
 static const int MAX_DOMAIN_NAME_SIZE = 255;
 static const int HDR_SIZE = 12;
+static const int MAX_UDP_SIZE = 512;
 } // namespace Default
 
+// Domain names are stored as a vector of labels
+// Both the labels and the vector are allocator-aware, so that a worker can
+// parse and build messages entirely within its Arena
+using String =
+        std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+using Labels = std::vector<String, ArenaAllocator<String>>;
+
+// Converts plain labels into Labels allocated from the given arena
+// (default: the global heap)
+Labels toLabels(const std::vector<std::string> &labels,
+                Arena *arena = nullptr);
+
+// Compares Labels against plain labels
+bool operator==(const Labels &lhs, const std::vector<std::string> &rhs);
+bool operator==(const std::vector<std::string> &lhs, const Labels &rhs);
+
 // The Message describes a classic DNS message according to RFC1035
 // The Message minimally contains
 // - a header field laid out in the big endian order
 // - a vector of Questions (The Question Section)
 // - a vector of Answers (The Answer Section)
-// Note: The message serialization does NOT support message compression
+// Note: The message serialization does NOT support message compression, but
+// parsing follows compression pointers in record names
+// Note: Every constructor accepts an optional Arena. Without one, the message
+// allocates from the global heap.
 class Message {
 public:
   struct Header {
@@ -56,12 +82,14 @@ public:
   public:
     // Construct an empty question
     // NOTE: Using the default constructor requires explicitly updating m_size
-    Question() : m_qtype(0), m_qclass(0), m_size(0) {}
+    explicit Question(Arena *arena = nullptr)
+        : m_qname(arena), m_qtype(0), m_qclass(0), m_size(0) {}
 
     // Builds a question by parsing the buffer at the given offset
-    Question(unsigned char *buf, uint16_t offset, uint16_t msgLength);
+    Question(unsigned char *buf, uint16_t offset, uint16_t msgLength,
+             Arena *arena = nullptr);
     uint16_t Size() { return m_size; }
-    std::vector<std::string> m_qname;
+    Labels m_qname;
     uint16_t m_qtype;
     uint16_t m_qclass;
     uint16_t m_size;
@@ -71,14 +99,15 @@ public:
   public:
     // Construct an empty resource record
     // NOTE: Using the default constructor requires explicitly updating m_size
-    ResourceRecord()
-        : m_type(0), m_class(0), m_ttl(0), m_rdLength(0), m_rdata(nullptr),
-          m_size(0) {}
+    explicit ResourceRecord(Arena *arena = nullptr)
+        : m_name(arena), m_type(0), m_class(0), m_ttl(0), m_rdLength(0),
+          m_rdata(nullptr), m_size(0) {}
 
     // Builds a resource record by parsing the buffer at the given offset
-    ResourceRecord(unsigned char *buf, uint16_t offset, uint16_t msgLength);
+    ResourceRecord(unsigned char *buf, uint16_t offset, uint16_t msgLength,
+                   Arena *arena = nullptr);
     uint16_t Size() { return m_size; }
-    std::vector<std::string> m_name;
+    Labels m_name;
     uint16_t m_type;
     uint16_t m_class;
     uint32_t m_ttl;
@@ -87,11 +116,51 @@ public:
     uint16_t m_size;
   };
 
-  Message() : m_hdr({0}) {}
-  Message(unsigned char *data, int len);
+  explicit Message(Arena *arena = nullptr)
+      : m_hdr({0}), m_questions(arena), m_answers(arena) {}
+  Message(unsigned char *data, int len, Arena *arena = nullptr);
   Header m_hdr;
-  std::vector<Question> m_questions;
-  std::vector<ResourceRecord> m_answers;
+  std::vector<Question, ArenaAllocator<Question>> m_questions;
+  std::vector<ResourceRecord, ArenaAllocator<ResourceRecord>> m_answers;
+};
+
+// Reply is a parsed message that owns a copy of the buffer it was parsed from
+// The records of a parsed message point into that buffer (m_rdata), so a
+// Reply stays valid after the receive buffer is reused.
+class Reply : public Message {
+public:
+  Reply(const unsigned char *data, int len);
+
+  // The message as received, e.g. to relay it verbatim
+  const unsigned char *data() const { return m_wire.get(); }
+  int size() const { return m_length; }
+
+private:
+  std::unique_ptr<unsigned char[]> m_wire;
+  int m_length;
+};
+
+// OutputBuffer is a stream buffer over caller-owned memory
+// Serializing a message through it (instead of a std::ostringstream) avoids
+// any heap allocation for the wire format. Writes past the end of the buffer
+// fail the stream, which callers detect through overflowed().
+class OutputBuffer : public std::streambuf {
+public:
+  OutputBuffer(unsigned char *buf, size_t len) {
+    auto begin = reinterpret_cast<char *>(buf);
+    setp(begin, begin + len);
+  }
+  size_t size() const { return pptr() - pbase(); }
+  bool overflowed() const { return m_overflowed; }
+
+protected:
+  int_type overflow(int_type) override {
+    m_overflowed = true;
+    return traits_type::eof();
+  }
+
+private:
+  bool m_overflowed = false;
 };
 
 // Stream operators for serializing and pretty-printing packet data
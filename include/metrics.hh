@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <netinet/in.h>
+#include <ostream>
+#include <stats.hh>
+
+namespace DNS {
+namespace Default {
+// Scrapes are only accepted on the loopback interface by default
+static const uint32_t METRICS_ADDRESS = INADDR_LOOPBACK;
+// Time a scraper gets to send its request and read the response, in all
+static const int METRICS_TIMEOUT_MS = 1000;
+// Requests larger than this are refused
+static const int METRICS_MAX_REQUEST = 4096;
+} // namespace Default
+
+// Writes the snapshot in the Prometheus text exposition format (0.0.4)
+// Counters are exported as dnsd_<name>_total, and the latency of every stage
+// that recorded samples as the dnsd_latency_seconds histogram, with
+// power-of-two buckets from 128ns to ~1s.
+void writePrometheus(std::ostream &os, const Stats &stats);
+
+// MetricsServer answers Prometheus scrapes over HTTP/1.1
+// It serves GET /metrics, one request per connection, from whichever thread
+// calls serve() (the housekeeper, which watches fd()). Every scrape takes a
+// fresh Stats snapshot, which only reads the worker counters: no lock is
+// taken and no worker cache line is written.
+class MetricsServer {
+public:
+  using Source = std::function<Stats()>;
+
+  // Listens on the given port (0 picks a free one)
+  MetricsServer(uint16_t port, Source source,
+                uint32_t address = Default::METRICS_ADDRESS);
+  ~MetricsServer();
+  MetricsServer(const MetricsServer &) = delete;
+  MetricsServer &operator=(const MetricsServer &) = delete;
+
+  // Listening socket, readable when a scraper connects
+  int fd() const { return m_sockFD; }
+  uint16_t port() const { return m_port; }
+
+  // Accepts and answers every pending connection
+  void serve();
+
+private:
+  void respond(int clientFD, std::chrono::steady_clock::time_point deadline);
+
+  int m_sockFD;
+  uint16_t m_port;
+  Source m_source;
+}; // class MetricsServer
+} // namespace DNS
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace DNS {
+// Capture holds the UDP payloads sent to a port, read from a pcap file
+// Payloads are kept back to back in a single buffer.
+struct Capture {
+  struct Payload {
+    size_t m_offset;
+    int m_length;
+  };
+
+  std::vector<unsigned char> m_data;
+  std::vector<Payload> m_payloads;
+  // Packets that carry no query, by reason
+  std::map<std::string, uint64_t> m_skipped;
+}; // struct Capture
+
+// Reads the UDP payloads sent to the port from a pcap (not pcapng) file, in
+// either byte order and timestamp precision
+// Frames may be Ethernet (VLAN tagged or not), Linux cooked, BSD loopback or
+// raw IP, carrying IPv4 or IPv6. Throws a std::runtime_error if the file
+// can't be read or isn't a pcap file.
+Capture loadCapture(const std::string &path, uint16_t port);
+} // namespace DNS
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace DNS {
+// PipelineStage is the base of the stages of a Pipeline
+// A stage hides the hooks it implements, and inherits the empty defaults of
+// the others, which the compiler drops.
+struct PipelineStage {
+  // Handles the request. Returns false to end it there, skipping the stages
+  // that follow.
+  template <typename Request> bool process(Request &) { return true; }
+  // Called on every stage once the request ended, whichever stage ended it
+  template <typename Request> void complete(Request &) {}
+};
+
+// Pipeline runs a request through stages composed at compile time
+// Stages are held by value and called directly, so every call can be
+// inlined: a pipeline costs what its stages do, with no virtual calls and
+// no allocations per request. Policy steps (access control, rate limiting,
+// logging, rewriting) are stages, and a pipeline that doesn't list a stage
+// has no trace of it in its code.
+template <typename... Stages> class Pipeline {
+public:
+  explicit Pipeline(Stages... stages) : m_stages(std::move(stages)...) {}
+
+  template <typename Request> void run(Request &request) {
+    process(request, std::integral_constant<size_t, 0>());
+    complete(request, std::integral_constant<size_t, 0>());
+  }
+
+private:
+  static const size_t COUNT = sizeof...(Stages);
+
+  template <typename Request, size_t I>
+  void process(Request &request, std::integral_constant<size_t, I>) {
+    if (std::get<I>(m_stages).process(request)) {
+      process(request, std::integral_constant<size_t, I + 1>());
+    }
+  }
+  template <typename Request>
+  void process(Request &, std::integral_constant<size_t, COUNT>) {}
+
+  template <typename Request, size_t I>
+  void complete(Request &request, std::integral_constant<size_t, I>) {
+    std::get<I>(m_stages).complete(request);
+    complete(request, std::integral_constant<size_t, I + 1>());
+  }
+  template <typename Request>
+  void complete(Request &, std::integral_constant<size_t, COUNT>) {}
+
+  std::tuple<Stages...> m_stages;
+}; // class Pipeline
+
+// Deduces the type of the pipeline from its stages
+template <typename... Stages>
+Pipeline<Stages...> makePipeline(Stages... stages) {
+  return Pipeline<Stages...>(std::move(stages)...);
+}
+} // namespace DNS
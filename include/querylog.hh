@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <message.hh>
+#include <ring.hh>
+#include <stats.hh>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+namespace DNS {
+namespace Default {
+// Records every worker can queue up before the writer drains them
+static const size_t QUERY_LOG_RING_SIZE = 4096;
+// Size of a log file before it is rotated, and rotated files kept
+static const uint64_t QUERY_LOG_FILE_SIZE = 64 << 20;
+static const int QUERY_LOG_FILES = 4;
+} // namespace Default
+
+// QueryLogRecord describes a single query in the binary query log
+// Records are fixed-size and written to the log files as they are laid out
+// in memory (host byte order), behind a QueryLogHeader.
+struct QueryLogRecord {
+  // Flags
+  static const uint8_t DROPPED = 1;
+  static const uint8_t TRUNCATED = 2;
+  // Relayed to an upstream server, whose response is not logged
+  static const uint8_t FORWARDED = 4;
+  // Received over TCP
+  static const uint8_t TCP = 8;
+  // Received over TLS
+  static const uint8_t TLS = 16;
+
+  // Time the query was received (CLOCK_REALTIME)
+  uint64_t m_timeNs;
+  // Time from receiving the query to sending its response
+  uint32_t m_latencyNs;
+  uint16_t m_qtype;
+  uint16_t m_port;
+  // AF_INET or AF_INET6, with the address in network order
+  uint8_t m_family;
+  uint8_t m_rcode;
+  uint8_t m_flags;
+  uint8_t m_nameLength;
+  uint8_t m_address[16];
+  // QNAME in wire format
+  uint8_t m_name[Default::MAX_DOMAIN_NAME_SIZE];
+}; // struct QueryLogRecord
+
+// Leads every log file
+struct QueryLogHeader {
+  static const uint64_t MAGIC = 0x31474f4c44534e44; // "DNSDLOG1"
+
+  uint64_t m_magic;
+  uint32_t m_recordSize;
+  uint32_t m_reserved;
+}; // struct QueryLogHeader
+
+// QueryLog is a binary, per-query audit trail
+// Workers never touch a file: each one pushes records into its own SPSC ring,
+// and a single writer thread drains the rings into a memory mapped file.
+// Once a file is full it is rotated (path -> path.1 -> path.2 ...), keeping
+// the given number of files. A worker whose ring is full drops the record
+// and counts it rather than waiting for the writer.
+// Note: A file that was not closed cleanly ends with zeroed records
+class QueryLog {
+public:
+  struct Options {
+    // Path of the current log file (default: empty, no query log)
+    std::string m_path;
+    uint64_t m_fileSize = Default::QUERY_LOG_FILE_SIZE;
+    int m_files = Default::QUERY_LOG_FILES;
+    size_t m_ringSize = Default::QUERY_LOG_RING_SIZE;
+  };
+
+  // A worker's handle on the log
+  class Writer {
+  public:
+    // Queues a record. Returns false if it was dropped.
+    bool log(const QueryLogRecord &record) {
+      if (m_ring.push(record)) {
+        return true;
+      }
+      m_stats.add(Counter::QUERY_LOG_DROPPED);
+      return false;
+    }
+
+  private:
+    friend class QueryLog;
+    Writer(size_t ringSize, WorkerStats &stats)
+        : m_ring(ringSize), m_stats(stats) {}
+
+    SpscRing<QueryLogRecord> m_ring;
+    WorkerStats &m_stats;
+  }; // class Writer
+
+  // Opens the log and starts the writer thread, which stays off the given
+  // worker CPUs
+  explicit QueryLog(Options options, std::vector<int> workerCpus = {});
+  ~QueryLog();
+  QueryLog(const QueryLog &) = delete;
+  QueryLog &operator=(const QueryLog &) = delete;
+
+  // Registers a worker. Called by the worker, which then owns the writer.
+  Writer &addWriter(WorkerStats &stats);
+
+  // Drains the rings, then stops the writer thread and closes the file
+  void stop();
+
+  // Reads back the records of a log file
+  static std::vector<QueryLogRecord> read(const std::string &path);
+
+private:
+  void writeLoop();
+  bool drain();
+  void open();
+  void close();
+  void rotate();
+
+  Options m_options;
+  std::vector<int> m_workerCpus;
+  std::atomic<Writer *> m_writers[Default::MAX_WORKERS] = {};
+  std::atomic<int> m_writerCount{0};
+  std::atomic<bool> m_stopping{false};
+  std::thread m_thread;
+
+  // Current file, only touched by the writer thread
+  int m_fd = -1;
+  unsigned char *m_map = nullptr;
+  uint64_t m_size = 0;
+}; // class QueryLog
+} // namespace DNS
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <message.hh>
+#include <netinet/in.h>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace DNS {
+namespace Default {
+// Retransmission schedule of the resolver: the timeout doubles on every
+// attempt, up to the maximum
+static const int RESOLVER_ATTEMPTS = 5;
+static const int RESOLVER_INITIAL_TIMEOUT_MS = 250;
+static const int RESOLVER_MAX_TIMEOUT_MS = 2000;
+} // namespace Default
+
+// Random generates query IDs (xorshift128+, seeded from the kernel)
+// Query IDs only need to be unpredictable to off-path attackers, which this
+// provides at a few cycles per ID without the global state of rand()
+class Random {
+public:
+  Random();
+  uint64_t next() {
+    auto s1 = m_state[0];
+    auto s0 = m_state[1];
+    m_state[0] = s0;
+    s1 ^= s1 << 23;
+    m_state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+    return m_state[1] + s0;
+  }
+
+private:
+  uint64_t m_state[2];
+}; // class Random
+
+// Resolver is an asynchronous, pipelined DNS client over UDP
+// A resolver owns a single socket to one server and keeps any number of
+// queries in flight on it. Replies are matched to queries by ID and question
+// and from the server's address only; queries that go unanswered are
+// retransmitted with exponential backoff until they run out of attempts.
+// The resolver does not start threads: completions are delivered from poll(),
+// which the owning thread calls (or integrates into its event loop by
+// polling fd() and calling poll(0) when it is readable).
+// Note: A resolver is NOT thread-safe. Use one resolver (socket) per thread.
+class Resolver {
+public:
+  struct Result {
+    // 0 on success, otherwise an errno value (ETIMEDOUT once the query ran
+    // out of attempts)
+    int m_error;
+    std::unique_ptr<Reply> m_reply;
+  };
+  using Callback = std::function<void(Result)>;
+
+  struct Options {
+    int m_attempts = Default::RESOLVER_ATTEMPTS;
+    int m_initialTimeoutMs = Default::RESOLVER_INITIAL_TIMEOUT_MS;
+    int m_maxTimeoutMs = Default::RESOLVER_MAX_TIMEOUT_MS;
+  };
+
+  explicit Resolver(sockaddr_in server);
+  Resolver(sockaddr_in server, Options options);
+  ~Resolver();
+  Resolver(const Resolver &) = delete;
+  Resolver &operator=(const Resolver &) = delete;
+
+  // Sends a query and calls back once it completes
+  // Throws if the question can't be serialized or all IDs are in flight
+  void resolve(const std::vector<std::string> &domainLabels, uint16_t qtype,
+               uint16_t qclass, Callback callback);
+
+  // Sends a query for a question given in wire format (QNAME, QTYPE and
+  // QCLASS, e.g. copied from a client's query) and calls back once it
+  // completes. Throws if all IDs are in flight.
+  void resolve(const unsigned char *question, size_t len, Callback callback);
+
+  // Sends a query and returns a future of its reply
+  // The future fails with a std::runtime_error if the query times out
+  std::future<std::unique_ptr<Reply>>
+  resolve(const std::vector<std::string> &domainLabels, uint16_t qtype,
+          uint16_t qclass);
+
+  // Processes replies and retransmissions, waiting up to timeoutMs for
+  // something to happen. Returns the number of completed queries.
+  int poll(int timeoutMs);
+
+  // Milliseconds until the next retransmission or expiry is due, or -1 if no
+  // query is in flight. Event loops that poll fd() themselves should not
+  // sleep longer than this.
+  int nextTimeoutMs() const;
+
+  // Polls until no query is in flight
+  void drain();
+
+  size_t inflight() const { return m_pending.size(); }
+  int fd() const { return m_sockFD; }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Pending {
+    std::string m_query;
+    int m_attempt;
+    Clock::time_point m_deadline;
+    Callback m_callback;
+  };
+
+  struct Timeout {
+    Clock::time_point m_deadline;
+    uint16_t m_id;
+    bool operator>(const Timeout &other) const {
+      return m_deadline > other.m_deadline;
+    }
+  };
+
+  void send(const Pending &pending);
+  void receive(const unsigned char *buf, int len, int &completed);
+  void expire(int &completed);
+  std::chrono::milliseconds timeout(int attempt) const;
+
+  sockaddr_in m_server;
+  Options m_options;
+  int m_sockFD;
+  Random m_random;
+  std::unordered_map<uint16_t, Pending> m_pending;
+  // Deadlines of the pending queries, ordered by expiry
+  // Entries whose query completed (or was retransmitted since) are skipped
+  std::priority_queue<Timeout, std::vector<Timeout>, std::greater<Timeout>>
+          m_timeouts;
+}; // class Resolver
+} // namespace DNS
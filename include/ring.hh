@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+namespace DNS {
+// SpscRing is a bounded, lock-free queue between one producer thread and one
+// consumer thread
+// The producer only writes the tail and the consumer only writes the head,
+// each on its own cache line. Both sides keep a private copy of the other's
+// index and only reload it when the ring looks full (or empty), so the shared
+// lines are rarely touched while the ring is neither.
+// Note: The capacity must be a power of two
+template <typename T> class SpscRing {
+public:
+  explicit SpscRing(size_t capacity)
+      : m_slots(new T[capacity]), m_mask(capacity - 1) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+      std::stringstream message;
+      message << "Ring capacity: " << capacity << " - Not a power of two";
+      throw std::runtime_error(message.str());
+    }
+  }
+  SpscRing(const SpscRing &) = delete;
+  SpscRing &operator=(const SpscRing &) = delete;
+
+  // Producer side. Returns false, without blocking, if the ring is full.
+  bool push(const T &value) {
+    auto tail = m_producer.m_index.load(std::memory_order_relaxed);
+    if (tail - m_producer.m_cached > m_mask) {
+      m_producer.m_cached = m_consumer.m_index.load(std::memory_order_acquire);
+      if (tail - m_producer.m_cached > m_mask) {
+        return false;
+      }
+    }
+    m_slots[tail & m_mask] = value;
+    m_producer.m_index.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Returns the oldest entry, or nullptr if the ring is empty.
+  // The entry stays valid until pop().
+  const T *front() {
+    auto head = m_consumer.m_index.load(std::memory_order_relaxed);
+    if (head == m_consumer.m_cached) {
+      m_consumer.m_cached = m_producer.m_index.load(std::memory_order_acquire);
+      if (head == m_consumer.m_cached) {
+        return nullptr;
+      }
+    }
+    return &m_slots[head & m_mask];
+  }
+
+  // Consumer side. Releases the entry returned by front().
+  void pop() {
+    m_consumer.m_index.store(
+            m_consumer.m_index.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+  }
+
+  size_t capacity() const { return m_mask + 1; }
+
+private:
+  // Padded rather than aligned, so that rings can live on the heap without
+  // an aligned operator new
+  struct Side {
+    std::atomic<size_t> m_index{0};
+    // Last seen index of the other side
+    size_t m_cached = 0;
+    char m_pad[64 - 2 * sizeof(size_t)];
+  };
+
+  std::unique_ptr<T[]> m_slots;
+  size_t m_mask;
+  char m_pad[64];
+  Side m_producer;
+  Side m_consumer;
+}; // class SpscRing
+} // namespace DNS
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <message.hh>
+#include <sys/socket.h>
+#include <vector>
+
+namespace DNS {
+namespace Default {
+// Response rate limiting is disabled unless a rate is configured
+static const uint32_t RRL_RATE = 0;
+// Answer every 2nd dropped response with TC=1 (BIND/Knot default)
+static const uint32_t RRL_SLIP = 2;
+static const int RRL_IPV4_PREFIX = 24;
+static const int RRL_IPV6_PREFIX = 56;
+// Number of buckets per worker (rounded up to a power of 2)
+static const uint32_t RRL_TABLE_SIZE = 64 * 1024;
+// Buckets probed before the stalest one is recycled
+static const int RRL_PROBES = 4;
+} // namespace Default
+
+// RateLimiter implements Response Rate Limiting in the style of BIND/Knot
+// Responses are accounted in token buckets keyed by the client network prefix
+// and the class of the response. A client that exceeds its rate gets its
+// responses dropped, except for every Nth one ("slip") which is answered with
+// a truncated reply so that a legitimate client can retry over TCP.
+// The buckets live in a fixed-size open-addressed table owned by a single
+// worker: no locks, no allocation after construction, and a check costs a
+// hash, a short probe and a handful of arithmetic operations.
+// Note: The rate limiter is NOT thread-safe. Every worker owns one.
+class RateLimiter {
+public:
+  // Classes of responses, accounted separately for the same prefix
+  enum class Class : uint8_t { ANSWER = 0, NODATA, NXDOMAIN, ERROR };
+
+  // Outcome of a check
+  enum class Action { PASS, DROP, SLIP };
+
+  struct Options {
+    // Responses per second allowed per prefix and class (0 disables RRL)
+    uint32_t m_rate = Default::RRL_RATE;
+    // Responses a quiet prefix can burst before being limited
+    // (0 = one second worth of responses)
+    uint32_t m_burst = 0;
+    // Every m_slip-th dropped response is slipped (0 = never, 1 = always)
+    uint32_t m_slip = Default::RRL_SLIP;
+    int m_ipv4Prefix = Default::RRL_IPV4_PREFIX;
+    int m_ipv6Prefix = Default::RRL_IPV6_PREFIX;
+    uint32_t m_tableSize = Default::RRL_TABLE_SIZE;
+  };
+
+  explicit RateLimiter(const Options &options);
+
+  bool enabled() const { return m_options.m_rate != 0; }
+
+  // Classifies a response by its header
+  static Class classify(const Message::Header &hdr);
+
+  // Accounts a response of the given class to the client at time nowMs
+  // (milliseconds on a monotonic clock)
+  Action check(const sockaddr *client, Class cls, uint64_t nowMs);
+
+private:
+  struct Bucket {
+    // 0 marks an empty bucket
+    uint64_t m_key;
+    // Milliseconds of the last refill, relative to the first check
+    uint32_t m_stamp;
+    // Available tokens in 1/1000th of a response
+    int32_t m_tokens;
+    uint32_t m_dropped;
+    uint32_t m_pad;
+  };
+  static_assert(sizeof(Bucket) == 24, "Bucket must stay compact");
+
+  uint64_t key(const sockaddr *client, Class cls) const;
+
+  Options m_options;
+  uint64_t m_ipv4Mask;
+  uint64_t m_ipv6Mask;
+  int64_t m_capacity;
+  uint64_t m_epoch = 0;
+  int m_shift;
+  std::vector<Bucket> m_buckets;
+}; // class RateLimiter
+} // namespace DNS
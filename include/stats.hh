@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <latency.hh>
+#include <new>
+#include <ostream>
+
+namespace DNS {
+namespace Default {
+// Upper bound on the number of workers a daemon can account for
+static const int MAX_WORKERS = 64;
+} // namespace Default
+
+// Counters maintained by every worker
+// Note: Append new counters before COUNT and give them a name in stats.cc
+enum class Counter : int {
+  QUERIES = 0,
+  RESPONSES,
+  PARSE_ERRORS,
+  SEND_ERRORS,
+  RRL_DROPPED,
+  RRL_SLIPPED,
+  BUSY_POLL_HITS,
+  BUSY_POLL_SLEEPS,
+  BUSY_POLL_SPIN_US,
+  STALE_DROPPED,
+  // Datagrams the kernel dropped because the worker's socket buffer was full
+  KERNEL_DROPS,
+  // Query log records dropped because the worker's ring was full
+  QUERY_LOG_DROPPED,
+  // Queries relayed to an upstream server, and those answered from the cache
+  // of upstream responses instead
+  FORWARDED,
+  CACHE_HITS,
+  // Forwarded queries answered with SERVFAIL as no upstream replied
+  UPSTREAM_ERRORS,
+  // Lookups the cache of upstream responses missed, and entries it evicted
+  // to make room for new ones (expired entries are not counted)
+  CACHE_MISSES,
+  CACHE_EVICTIONS,
+  // Cached responses refreshed from upstream ahead of their expiry
+  PREFETCHES,
+  // Forwarded queries that joined an identical query in flight upstream
+  // instead of sending their own, that is upstream queries saved
+  COALESCED,
+  // Forwarded queries answered from expired cache entries, as upstreams
+  // failed or were too slow to reply (c.f. RFC8767)
+  STALE_ANSWERS,
+  // Connections accepted on the TCP port
+  TCP_CONNECTIONS,
+  // TLS handshakes completed on the DNS over TLS port, those of them that
+  // resumed a session from a ticket, and those that failed
+  TLS_HANDSHAKES,
+  TLS_RESUMED,
+  TLS_HANDSHAKE_ERRORS,
+  COUNT
+};
+
+// Returns a stable, printable name for the counter
+const char *counterName(Counter counter);
+
+// WorkerStats holds the counters and latency histograms of a single worker
+// Each instance is written by exactly one worker thread and read by any
+// number of stats readers. Updates are relaxed load/store pairs (no locked
+// instructions), and every instance owns its cache lines, so a reader never
+// slows down a worker.
+struct alignas(64) WorkerStats {
+  // Keeps heap allocated instances on their own cache lines
+  static void *operator new(size_t size) {
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, alignof(WorkerStats), size) != 0) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+  static void operator delete(void *ptr) { free(ptr); }
+
+  void add(Counter counter, uint64_t n = 1) {
+    auto &value = m_counters[static_cast<int>(counter)];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+  }
+  // Overwrites a counter that mirrors a value maintained elsewhere
+  void set(Counter counter, uint64_t value) {
+    m_counters[static_cast<int>(counter)].store(value,
+                                                std::memory_order_relaxed);
+  }
+  uint64_t get(Counter counter) const {
+    return m_counters[static_cast<int>(counter)].load(
+            std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> m_counters[static_cast<int>(Counter::COUNT)] = {};
+  // Per-stage latency, only recorded when stage timing is enabled
+  Histogram m_latency[static_cast<int>(Stage::COUNT)];
+}; // struct WorkerStats
+
+// Stats is a point-in-time snapshot of the counters and latency histograms,
+// merged across workers
+struct Stats {
+  uint64_t operator[](Counter counter) const {
+    return m_counters[static_cast<int>(counter)];
+  }
+  void merge(const WorkerStats &worker);
+
+  const LatencySummary &latency(Stage stage) const {
+    return m_latency[static_cast<int>(stage)];
+  }
+
+  uint64_t m_counters[static_cast<int>(Counter::COUNT)] = {};
+  LatencySummary m_latency[static_cast<int>(Stage::COUNT)];
+}; // struct Stats
+
+// Pretty-prints the snapshot, one counter per line, followed by the
+// p50/p99/p99.9 latency of every stage that recorded samples
+std::ostream &operator<<(std::ostream &os, const DNS::Stats &stats);
+} // namespace DNS
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stats.hh>
+#include <string>
+#include <timer.hh>
+#include <tls.hh>
+#include <unordered_map>
+#include <vector>
+#include <wire.hh>
+
+namespace DNS {
+namespace Default {
+// Connections that neither read nor wrote anything for this long are closed,
+// replies not written yet included (c.f. RFC7766, section 6.2.3)
+static const uint32_t TCP_IDLE_TIMEOUT_MS = 10000;
+// Connections a worker accepts at once
+static const size_t TCP_MAX_CONNECTIONS = 1024;
+// Bytes of replies a connection may leave unread before its queries are no
+// longer read
+static const size_t TCP_MAX_OUTPUT = 64 * 1024;
+// Largest message, as bounded by the 2-byte length prefix
+static const size_t MAX_TCP_SIZE = 65535;
+} // namespace Default
+
+// TcpServer serves DNS over TCP (c.f. RFC7766) on a worker's reactor
+// Every worker listens on the port with SO_REUSEPORT, and the kernel spreads
+// the connections across them. Clients may send queries back to back: every
+// complete length-prefixed message read is answered before the next read,
+// and the replies of a read are written together, behind any output still
+// pending, with a single gathering write (sendmsg(), which unlike writev()
+// can be told not to raise SIGPIPE).
+// Replies need not come in order: queries the handler can't answer right
+// away (forwarded ones) are answered later with reply(), whatever was asked
+// after them. Connections are cheap: reads go to a buffer the server shares
+// across its connections, and a connection only keeps the bytes of a
+// partial query or of replies the client was too slow to read.
+// Given a TlsContext, the server serves DNS over TLS (c.f. RFC7858) the same
+// way: handshakes are driven by poll() like reads and writes, and the replies
+// of a read go out in as few records as they fit in.
+// The server never blocks: the worker polls addPollFDs() along with its own
+// sockets and calls process().
+// Note: A server is NOT thread-safe. Every worker owns one.
+class TcpServer {
+public:
+  // Answers a query into the builder, started with builder.begin(query)
+  // Returns false if the reply comes later, with reply(stream, ...).
+  using Handler =
+          std::function<bool(const MessageView &query, ResponseBuilder &builder,
+                             const sockaddr_in &client, uint64_t stream)>;
+
+  // Streams of TLS connections have the top bit set, so that a worker's TCP
+  // and TLS servers never number their streams alike
+  static const uint64_t TLS_STREAMS = uint64_t(1) << 63;
+
+  // Serves DNS over TLS if given a context, which must outlive the server
+  TcpServer(const sockaddr_in &address, Handler handler, WorkerStats &stats,
+            TimerWheel &timers, const TlsContext *tls = nullptr,
+            uint32_t idleTimeoutMs = Default::TCP_IDLE_TIMEOUT_MS);
+  ~TcpServer();
+  TcpServer(const TcpServer &) = delete;
+  TcpServer &operator=(const TcpServer &) = delete;
+
+  // Appends the sockets to wait for
+  void addPollFDs(std::vector<pollfd> &pollFDs) const;
+
+  // Accepts connections, answers the queries that arrived and writes what
+  // the clients can take, with a single poll() for all connections
+  // Returns the number of queries answered.
+  int process();
+
+  // Sends the reply to a query the handler answered later
+  // Replies to connections closed since are dropped.
+  void reply(uint64_t stream, const unsigned char *response, size_t len);
+
+  uint16_t port() const { return m_port; }
+  size_t connections() const { return m_connections.size(); }
+
+private:
+  struct Connection {
+    Connection(int fd, const sockaddr_in &peer, uint64_t stream,
+               Timer::Callback idle)
+        : m_fd(fd), m_peer(peer), m_stream(stream), m_idle(std::move(idle)) {}
+    ~Connection();
+
+    int m_fd;
+    sockaddr_in m_peer;
+    uint64_t m_stream;
+    // Start of a query not read in full yet
+    std::string m_partial;
+    // Replies not written yet
+    std::string m_output;
+    // Queries answered later
+    size_t m_waiting = 0;
+    // The client is done sending
+    bool m_eof = false;
+    Timer m_idle;
+    // TLS only
+    SSL *m_ssl = nullptr;
+    bool m_handshaking = false;
+    // The TLS connection waits for the socket to be writable, rather than
+    // readable, to go on
+    bool m_wantWrite = false;
+  };
+
+  void accept();
+  // Pushes the connection's idle timeout back
+  void rearm(Connection &connection);
+  // Goes on with the TLS handshake. Returns true once it completed.
+  bool handshake(Connection &connection);
+  // Reads what the client sent and answers every complete query
+  int read(Connection &connection);
+  // Returns the number of bytes received, 0 if there are none yet, or -1 if
+  // the client is done sending
+  ssize_t receive(Connection &connection, unsigned char *buf, size_t len);
+  // Returns the number of bytes sent, 0 if the client can't take any yet, or
+  // -1 if it is gone
+  ssize_t sendTls(Connection &connection);
+  // Writes the connection's pending output and the batched replies
+  void write(Connection &connection);
+  // Closes the connection once it has nothing left to do
+  void reap(Connection &connection);
+  void close(uint64_t stream);
+
+  int m_sockFD;
+  uint16_t m_port;
+  Handler m_handler;
+  WorkerStats &m_stats;
+  TimerWheel &m_timers;
+  const TlsContext *m_tls;
+  uint32_t m_idleTimeoutMs;
+  uint64_t m_nextStream;
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> m_connections;
+  // Shared by all connections
+  std::vector<unsigned char> m_readBuf;
+  ResponseBuilder m_builder;
+  // Replies of the current read, each behind its length
+  std::vector<unsigned char> m_batch;
+  // Sockets process() polls, and the connections they belong to
+  std::vector<pollfd> m_pollFDs;
+  std::vector<uint64_t> m_streams;
+  // Connections whose idle timer fired, which process() closes (a timer
+  // can't destroy itself)
+  std::vector<uint64_t> m_expired;
+}; // class TcpServer
+} // namespace DNS
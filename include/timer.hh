@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace DNS {
+class TimerWheel;
+
+// Timer is a callback scheduled on a TimerWheel
+// Timers are intrusive: the wheel links the timers themselves into its slots,
+// so scheduling, rescheduling and cancelling never allocate. A timer is meant
+// to be embedded in the object it times (a query in flight, a connection...)
+// and re-armed as often as needed. A timer is cancelled when destroyed.
+class Timer {
+public:
+  using Callback = std::function<void()>;
+
+  explicit Timer(Callback callback) : m_callback(std::move(callback)) {}
+  ~Timer();
+  Timer(const Timer &) = delete;
+  Timer &operator=(const Timer &) = delete;
+
+  bool pending() const { return m_pprev != nullptr; }
+  // Time the timer is due at, as given to TimerWheel::schedule()
+  uint64_t expiresMs() const { return m_expiresMs; }
+
+private:
+  friend class TimerWheel;
+
+  Timer *m_next = nullptr;
+  // Link that points to this timer, or nullptr if the timer is not pending
+  Timer **m_pprev = nullptr;
+  TimerWheel *m_wheel = nullptr;
+  uint64_t m_expiresMs = 0;
+  Callback m_callback;
+}; // class Timer
+
+// TimerWheel is a hierarchical timing wheel with a resolution of 1ms
+// c.f. Varghese & Lauck, "Hashed and Hierarchical Timing Wheels" (1987)
+// Four levels of 256 slots cover 2^32ms (49 days). The first level holds the
+// timers due within 256ms, one slot per millisecond; the next levels hold
+// later timers at a coarser grain, and every time the level below wraps
+// around, the timers of the next slot are cascaded down. Inserting and
+// cancelling are O(1), and a bitmap of the occupied slots lets advance() and
+// timeoutMs() skip over the empty ones.
+// The wheel is driven by its owner: a worker bounds the time it sleeps with
+// timeoutMs() and calls advance() when it wakes up.
+// Note: A wheel is NOT thread-safe. Every worker owns one.
+class TimerWheel {
+public:
+  // Starts the wheel at the given time (in ms, on any monotonic clock)
+  explicit TimerWheel(uint64_t nowMs);
+  ~TimerWheel();
+  TimerWheel(const TimerWheel &) = delete;
+  TimerWheel &operator=(const TimerWheel &) = delete;
+
+  // Schedules (or reschedules) the timer to fire at expiresMs
+  // Timers already due fire on the next tick the wheel advances to
+  void schedule(Timer &timer, uint64_t expiresMs);
+  // Does nothing if the timer is not pending
+  void cancel(Timer &timer);
+
+  // Fires the timers due at or before nowMs, in order of expiry (timers of
+  // the same millisecond fire in no particular order). Callbacks may schedule
+  // and cancel timers. Returns the number of timers fired.
+  int advance(uint64_t nowMs);
+
+  // Milliseconds until advance() has work to do, 0 if it is overdue, or -1 if
+  // no timer is pending. Waking up early is harmless: a timer far ahead may
+  // only need to be cascaded.
+  int timeoutMs(uint64_t nowMs) const;
+
+  // Time the wheel advanced to
+  uint64_t nowMs() const { return m_nextMs - 1; }
+  size_t size() const { return m_count; }
+
+private:
+  static const int LEVELS = 4;
+  static const int SLOT_BITS = 8;
+  static const int SLOTS = 1 << SLOT_BITS;
+  static const int WORD_BITS = 64;
+
+  void insert(Timer &timer);
+  void unlink(Timer &timer);
+  // Moves the timers of the current slot of the level down the wheel
+  void cascade(int level);
+  // Returns the first occupied slot at or after the given one in a level,
+  // or -1
+  int nextSlot(int level, int slot) const;
+
+  Timer *m_slots[LEVELS][SLOTS] = {};
+  uint64_t m_occupied[LEVELS][SLOTS / WORD_BITS] = {};
+  // Next tick to process: the timers due before it have fired
+  uint64_t m_nextMs;
+  size_t m_count = 0;
+}; // class TimerWheel
+} // namespace DNS
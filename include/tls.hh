@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <openssl/ssl.h>
+#include <string>
+
+namespace DNS {
+namespace Default {
+// DNS over TLS (c.f. RFC7858)
+static const uint16_t TLS_PORT = 853;
+// Seconds a session ticket can resume a session for
+static const long TLS_SESSION_LIFETIME = 7200;
+} // namespace Default
+
+// TlsContext holds the certificate and key the daemon serves DNS over TLS
+// with, and the keys its session tickets are sealed with
+// Clients resume their sessions with the tickets they were issued, which
+// skips the key exchange and the certificate on reconnects. Tickets carry the
+// session, so the server keeps no session cache, and one context shared by
+// all workers lets a ticket resume on any of them.
+// Note: A context is thread-safe once constructed. The connections it
+// creates are not.
+class TlsContext {
+public:
+  // Loads the PEM certificate chain and private key
+  // Throws a std::runtime_error if either doesn't load or they don't match
+  TlsContext(const std::string &certificateFile, const std::string &keyFile);
+  ~TlsContext();
+  TlsContext(const TlsContext &) = delete;
+  TlsContext &operator=(const TlsContext &) = delete;
+
+  // Creates the server side of a connection on the socket, which the
+  // caller frees with SSL_free()
+  SSL *accept(int fd) const;
+
+private:
+  SSL_CTX *m_ctx;
+}; // class TlsContext
+} // namespace DNS
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <lpm.hh>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+namespace DNS {
+namespace Default {
+// Name of the view serving the clients no other view matches
+static const char *const DEFAULT_VIEW = "default";
+} // namespace Default
+
+// NameTable maps domain names to IPv4 addresses
+// Names are stored in lowercase wire format and looked up straight from a
+// query's QNAME, case-insensitively and without allocating (open addressing,
+// linear probing).
+class NameTable {
+public:
+  // Adds (or replaces) a name, given as "www.example.com" (the trailing dot
+  // is optional). Throws if the name is invalid.
+  void insert(const std::string &name, in_addr address);
+
+  // Returns the address of the name, or nullptr if it is not in the table
+  const in_addr *find(const unsigned char *wireName, size_t length) const;
+
+  size_t size() const { return m_count; }
+
+private:
+  struct Entry {
+    // Empty for free slots
+    std::string m_name;
+    uint64_t m_hash;
+    in_addr m_address;
+  };
+
+  static uint64_t hash(const unsigned char *wireName, size_t length);
+
+  std::vector<Entry> m_entries;
+  size_t m_count = 0;
+}; // class NameTable
+
+// View is the set of answers given to one group of clients
+struct View {
+  std::string m_name;
+  // Whether the names missing from the table are answered with m_address
+  // (spoofed) or denied (NXDOMAIN)
+  bool m_spoof;
+  in_addr m_address;
+  NameTable m_names;
+}; // struct View
+
+// ViewConfig describes a view and the client networks it serves
+struct ViewConfig {
+  std::string m_name;
+  // Client networks, e.g. "10.0.0.0/8" or "fd00::/8"
+  std::vector<std::string> m_prefixes;
+  // Answer to the names missing from the table (default: the daemon's
+  // address, unless the daemon is authoritative)
+  std::string m_address;
+  // Names and their addresses
+  std::vector<std::pair<std::string, std::string>> m_records;
+}; // struct ViewConfig
+
+// Parses "NAME=PREFIX[,PREFIX...][@ADDRESS]"
+ViewConfig parseView(const std::string &view);
+
+// Parses "VIEW:NAME=ADDRESS" and adds the record to the named view
+// Throws unless the view was defined or is the default one, which is created
+// if needed.
+void addRecord(std::vector<ViewConfig> &views, const std::string &record);
+
+// Views implements split-horizon DNS: every query is answered from the view
+// with the longest prefix matching the client's address, or from the default
+// view if none matches. Selection is a single LpmTable lookup.
+// Views are built once and read-only afterwards, so all workers share them.
+class Views {
+public:
+  // Builds the views; the one named Default::DEFAULT_VIEW (which takes no
+  // prefixes) configures the default view. Views without an address of their
+  // own spoof the default address if spoofByDefault is set, and deny the
+  // names missing from their table otherwise.
+  // Throws if a view is invalid.
+  Views(const std::vector<ViewConfig> &views, in_addr defaultAddress,
+        bool spoofByDefault = true);
+
+  const View &select(const sockaddr *client) const {
+    if (client == nullptr) {
+      return m_views[0];
+    }
+    if (client->sa_family == AF_INET) {
+      auto addr = reinterpret_cast<const sockaddr_in *>(client);
+      return m_views[m_ipv4.lookup(
+              reinterpret_cast<const uint8_t *>(&addr->sin_addr))];
+    }
+    if (client->sa_family == AF_INET6) {
+      auto addr = reinterpret_cast<const sockaddr_in6 *>(client);
+      auto bytes = addr->sin6_addr.s6_addr;
+      // IPv4 clients of a dual stack socket
+      if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr)) {
+        return m_views[m_ipv4.lookup(bytes + 12)];
+      }
+      return m_views[m_ipv6.lookup(bytes)];
+    }
+    return m_views[0];
+  }
+
+  size_t size() const { return m_views.size(); }
+
+private:
+  // The default view comes first, so that LpmTable::NONE selects it
+  std::vector<View> m_views;
+  LpmTable m_ipv4;
+  LpmTable m_ipv6;
+}; // class Views
+} // namespace DNS
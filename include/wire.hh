@@ -0,0 +1,188 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <message.hh>
+#include <string>
+
+namespace DNS {
+namespace Default {
+// Questions a MessageView keeps track of (RFC1035 queries carry one)
+static const int MAX_VIEW_QUESTIONS = 8;
+} // namespace Default
+
+// Resource record TYPEs (and QTYPEs) the daemon knows about
+namespace Type {
+static const uint16_t A = 1;
+static const uint16_t NS = 2;
+static const uint16_t CNAME = 5;
+static const uint16_t SOA = 6;
+static const uint16_t PTR = 12;
+static const uint16_t MX = 15;
+static const uint16_t TXT = 16;
+static const uint16_t AAAA = 28;
+static const uint16_t ANY = 255;
+} // namespace Type
+
+// Response codes
+namespace Rcode {
+static const uint8_t NOERROR = 0;
+static const uint8_t FORMERR = 1;
+static const uint8_t SERVFAIL = 2;
+static const uint8_t NXDOMAIN = 3;
+static const uint8_t NOTIMP = 4;
+static const uint8_t REFUSED = 5;
+} // namespace Rcode
+
+static const uint16_t CLASS_IN = 1;
+static const uint16_t CLASS_ANY = 255;
+
+// Integers in wire format are big-endian (network order)
+inline uint16_t read16(const unsigned char *buf) {
+  return static_cast<uint16_t>(buf[0] << 8 | buf[1]);
+}
+
+inline uint32_t read32(const unsigned char *buf) {
+  return uint32_t(read16(buf)) << 16 | read16(buf + 2);
+}
+
+inline void write16(unsigned char *buf, uint16_t value) {
+  buf[0] = static_cast<unsigned char>(value >> 8);
+  buf[1] = static_cast<unsigned char>(value & 0xff);
+}
+
+inline void write32(unsigned char *buf, uint32_t value) {
+  write16(buf, static_cast<uint16_t>(value >> 16));
+  write16(buf + 2, static_cast<uint16_t>(value & 0xffff));
+}
+
+// Names compare without regard to ASCII case (RFC4343)
+inline unsigned char lower(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+// Returns the offset past the name at pos in a message of len bytes (past
+// its compression pointer, if it ends with one), or 0 if it is malformed or
+// runs off the message
+size_t skipName(const unsigned char *msg, size_t len, size_t pos);
+
+// Converts a name given as "www.example.com" (the trailing dot is optional)
+// to lowercase wire format. Throws if a label or the name is too long.
+std::string toWireName(const std::string &name);
+
+// Copies a question (QNAME, QTYPE and QCLASS in wire format) to key, which
+// must hold nameLength + 4 bytes. Only the name is lowercased, so that the
+// spellings of a name share a key and the QTYPE and QCLASS stay apart.
+void copyQuestionKey(const unsigned char *question, size_t nameLength,
+                     unsigned char *key);
+
+// MessageView is a non-owning, allocation-free view of a parsed DNS message
+// Parsing validates the header and the question section and records where
+// every question lives in the buffer. Nothing is copied, so the view is only
+// valid as long as the buffer it was parsed from.
+// Note: Like Message, the view ignores the sections after the questions
+class MessageView {
+public:
+  struct Question {
+    // Offset of the QNAME in the message
+    uint16_t m_offset;
+    // Length of the QNAME in wire format (including the 0-length octet)
+    uint16_t m_nameLength;
+    // QTYPE and QCLASS in host order
+    uint16_t m_qtype;
+    uint16_t m_qclass;
+  };
+
+  // Parses the message, throwing a std::runtime_error if it is malformed
+  MessageView(const unsigned char *data, int len);
+
+  const unsigned char *data() const { return m_data; }
+  uint16_t size() const { return m_length; }
+  // Length of the header and question section
+  uint16_t questionsEnd() const { return m_questionsEnd; }
+  uint16_t qdcount() const { return m_qdcount; }
+  const Question &question(int i) const { return m_questions[i]; }
+  // QNAME of the question in wire format
+  const unsigned char *name(int i) const {
+    return m_data + m_questions[i].m_offset;
+  }
+
+  // Header in network order, as in Message
+  Message::Header m_hdr;
+
+private:
+  const unsigned char *m_data;
+  uint16_t m_length;
+  uint16_t m_questionsEnd;
+  uint16_t m_qdcount;
+  Question m_questions[Default::MAX_VIEW_QUESTIONS];
+}; // class MessageView
+
+// ResponseBuilder serializes a response straight into a buffer it owns
+// begin() copies the header and question section of the query verbatim, so
+// the records that follow refer to a question's name with a compression
+// pointer instead of repeating it. Records are appended section by section
+// (answers, then authority, then additional).
+// A builder is move-only and meant to be reused: a worker keeps one and calls
+// begin() for every request, which never allocates.
+class ResponseBuilder {
+public:
+  enum class Section { ANSWER = 0, AUTHORITY, ADDITIONAL };
+
+  explicit ResponseBuilder(size_t capacity = Default::MAX_UDP_SIZE);
+  ResponseBuilder(ResponseBuilder &&other) noexcept;
+  ResponseBuilder &operator=(ResponseBuilder &&other) noexcept;
+  ResponseBuilder(const ResponseBuilder &) = delete;
+  ResponseBuilder &operator=(const ResponseBuilder &) = delete;
+
+  // Starts a response to the query: same ID, opcode, RD bit and questions,
+  // with QR set and every other flag, count and the RCODE cleared
+  void begin(const MessageView &query);
+
+  // Appends a record owned by the name of the given question
+  // Throws std::out_of_range if the response has no such question
+  // Returns false (and sets TC) if the record does not fit
+  bool add(Section section, int question, uint16_t type, uint16_t cls,
+           uint32_t ttl, const void *rdata, uint16_t rdLength);
+
+  // Appends count records already serialized in wire format
+  // Returns false (and sets TC) if the records do not fit
+  bool addRaw(Section section, const void *records, size_t len,
+              uint16_t count);
+
+  // Drops every record, leaving the header and the questions, and sets TC
+  void truncate();
+
+  // Offset of the QNAME of the given question, which the data of a record
+  // can point to as well
+  uint16_t nameOffset(int question) const { return m_offsets[question]; }
+
+  void setRcode(uint8_t rcode) { header().m_rcode = rcode; }
+  void setAuthoritative(bool aa) { header().m_aa = aa; }
+
+  Message::Header &header() {
+    return *reinterpret_cast<Message::Header *>(m_buf.get());
+  }
+  const Message::Header &header() const {
+    return *reinterpret_cast<const Message::Header *>(m_buf.get());
+  }
+  // The records can be patched in place (e.g. cached TTLs), but not resized
+  unsigned char *data() { return m_buf.get(); }
+  const unsigned char *data() const { return m_buf.get(); }
+  size_t size() const { return m_size; }
+
+private:
+  bool reserve(Section section, size_t len);
+  void count(Section section, uint16_t count);
+
+  std::unique_ptr<unsigned char[]> m_buf;
+  size_t m_capacity;
+  size_t m_size = 0;
+  size_t m_questionsEnd = 0;
+  Section m_section = Section::ANSWER;
+  // Offsets of the QNAMEs copied by begin(), the targets of name pointers
+  int m_qdcount = 0;
+  uint16_t m_offsets[Default::MAX_VIEW_QUESTIONS];
+}; // class ResponseBuilder
+} // namespace DNS
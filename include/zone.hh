@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace DNS {
+// Zone is the apex the daemon is authoritative for, and its SOA record
+// The SOA record is serialized once, when the zone is configured, so that a
+// negative response (RFC2308) only appends its bytes to the authority
+// section: it costs no more to build than a positive answer.
+class Zone {
+public:
+  // Parses the SOA in zone file order:
+  // "ZONE MNAME RNAME SERIAL REFRESH RETRY EXPIRE MINIMUM"
+  // Throws a std::runtime_error if it is invalid
+  explicit Zone(const std::string &soa);
+
+  // Whether the name (in wire format) is the apex or below it
+  bool contains(const unsigned char *wireName, size_t length) const;
+  // Whether the name (in wire format) is the apex
+  bool isApex(const unsigned char *wireName, size_t length) const {
+    return length == m_apex.size() && contains(wireName, length);
+  }
+
+  // The SOA record in wire format, owned by the apex, with MINIMUM as its
+  // TTL (the negative caching TTL)
+  const std::string &soaRecord() const { return m_soaRecord; }
+
+  const std::string &apex() const { return m_apex; }
+  // MNAME, the primary name server of the zone, in wire format
+  const std::string &primary() const { return m_primary; }
+
+private:
+  // Lowercase wire format
+  std::string m_apex;
+  std::string m_primary;
+  std::string m_soaRecord;
+}; // class Zone
+} // namespace DNS
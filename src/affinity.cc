@@ -0,0 +1,109 @@
+#include <affinity.hh>
+#include <cerrno>
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+[[noreturn]] void fail(int error, const std::string &context) {
+  std::stringstream message;
+  message << "What: " << std::strerror(error) << " - Context: " << context;
+  throw std::runtime_error(message.str());
+}
+
+int parseCpu(const std::string &list, const std::string &token) {
+  size_t end = 0;
+  int cpu = -1;
+  try {
+    cpu = std::stoi(token, &end);
+  } catch (std::exception &) {
+    end = 0;
+  }
+  if (token.empty() || end != token.size() || cpu < 0 || cpu >= CPU_SETSIZE) {
+    std::stringstream message;
+    message << "CPU list: " << list << " - Invalid CPU: " << token;
+    throw std::runtime_error(message.str());
+  }
+  return cpu;
+}
+} // namespace
+
+std::vector<int> DNS::parseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ranges(list);
+  std::string range;
+  while (std::getline(ranges, range, ',')) {
+    auto dash = range.find('-');
+    if (dash == std::string::npos) {
+      cpus.push_back(parseCpu(list, range));
+      continue;
+    }
+    auto first = parseCpu(list, range.substr(0, dash));
+    auto last = parseCpu(list, range.substr(dash + 1));
+    if (last < first) {
+      std::stringstream message;
+      message << "CPU list: " << list << " - Invalid range: " << range;
+      throw std::runtime_error(message.str());
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) {
+    std::stringstream message;
+    message << "CPU list: " << list << " - Empty";
+    throw std::runtime_error(message.str());
+  }
+  return cpus;
+}
+
+void DNS::pinThread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  auto ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    fail(ret, "pthread_setaffinity_np(" + std::to_string(cpu) + ")");
+  }
+}
+
+void DNS::avoidCpus(const std::vector<int> &cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  auto online = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int cpu = 0; cpu < online && cpu < CPU_SETSIZE; cpu++) {
+    CPU_SET(cpu, &set);
+  }
+  for (auto cpu : cpus) {
+    CPU_CLR(cpu, &set);
+  }
+  if (CPU_COUNT(&set) == 0) {
+    return;
+  }
+  auto ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (ret != 0) {
+    fail(ret, "pthread_setaffinity_np()");
+  }
+}
+
+void DNS::useLocalMemory() {
+  // glibc has no wrapper for set_mempolicy(2); libnuma is not needed for this
+  if (syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) < 0) {
+    fail(errno, "set_mempolicy(MPOL_LOCAL)");
+  }
+}
+
+void DNS::setRealtime(int priority) {
+  sched_param param{};
+  param.sched_priority = priority;
+  auto ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (ret != 0) {
+    fail(ret, "pthread_setschedparam(SCHED_FIFO, " + std::to_string(priority) +
+                      ")");
+  }
+}
@@ -0,0 +1,68 @@
+#include <arena.hh>
+#include <cstdlib>
+#include <new>
+
+// Constructs an arena and eagerly reserves its first block, so that the first
+// request served by a worker does not pay for it
+DNS::Arena::Arena(size_t blockSize) : m_blockSize(blockSize) {
+  auto block = static_cast<Block *>(std::malloc(sizeof(Block) + m_blockSize));
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  block->m_next = nullptr;
+  block->m_size = m_blockSize;
+  m_head = block;
+  m_capacity = m_blockSize;
+  enter(m_head);
+}
+
+DNS::Arena::~Arena() {
+  auto block = m_head;
+  while (block != nullptr) {
+    auto next = block->m_next;
+    std::free(block);
+    block = next;
+  }
+}
+
+void DNS::Arena::reset() {
+  m_retired = 0;
+  enter(m_head);
+}
+
+size_t DNS::Arena::used() const {
+  return m_retired + (m_ptr - m_current->data());
+}
+
+void DNS::Arena::enter(Block *block) {
+  m_current = block;
+  m_ptr = block->data();
+  m_end = m_ptr + block->m_size;
+}
+
+// Slow path of allocate()
+// Moves on to the next retained block that fits the allocation, or reserves a
+// new one. Blocks reserved here are kept for the lifetime of the arena.
+void *DNS::Arena::grow(size_t size, size_t align) {
+  auto needed = size + align;
+  while (m_current->m_next != nullptr) {
+    m_retired += m_ptr - m_current->data();
+    enter(m_current->m_next);
+    if (m_current->m_size >= needed) {
+      return allocate(size, align);
+    }
+  }
+
+  auto blockSize = needed > m_blockSize ? needed : m_blockSize;
+  auto block = static_cast<Block *>(std::malloc(sizeof(Block) + blockSize));
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  block->m_next = nullptr;
+  block->m_size = blockSize;
+  m_current->m_next = block;
+  m_capacity += blockSize;
+  m_retired += m_ptr - m_current->data();
+  enter(block);
+  return allocate(size, align);
+}
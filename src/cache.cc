@@ -0,0 +1,553 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cache.hh>
+#include <cstring>
+
+namespace {
+// Pseudo-record of EDNS, whose TTL field carries flags
+const uint16_t TYPE_OPT = 41;
+
+// Sizing of the index: one slot per this many bytes of arena, which is about
+// the size of an entry with a couple of records
+const uint64_t BYTES_PER_SLOT = 128;
+const int SLOTS_PER_BUCKET = 8;
+// Share of the arena that goes to the small log (S3-FIFO uses 10%)
+const uint64_t SMALL_LOG_PERCENT = 10;
+// Largest entry: header, the longest question, a full UDP response and the
+// offsets of its TTLs
+const uint32_t MAX_ENTRY = 2048;
+// Times a reader retries while the shard is being written to
+const int READ_ATTEMPTS = 4;
+const int MAX_FREQUENCY = 3;
+
+// Layout of a slot: the top 16 bits of the hash, a prefetching and a used
+// bit, the frequency and the offset of the entry in 8-byte units
+const uint64_t SLOT_PREFETCHING = uint64_t(1) << 35;
+const uint64_t SLOT_USED = uint64_t(1) << 34;
+const int FREQUENCY_SHIFT = 32;
+const int TAG_SHIFT = 48;
+
+uint64_t slotOffset(uint64_t slot) {
+  return (slot & 0xffffffff) * 8;
+}
+
+int slotFrequency(uint64_t slot) {
+  return static_cast<int>((slot >> FREQUENCY_SHIFT) & MAX_FREQUENCY);
+}
+
+uint64_t makeSlot(uint64_t hash, uint64_t offset, int frequency) {
+  return (hash >> TAG_SHIFT << TAG_SHIFT) | SLOT_USED |
+         uint64_t(frequency) << FREQUENCY_SHIFT | offset / 8;
+}
+
+bool sameTag(uint64_t slot, uint64_t hash) {
+  return slot >> TAG_SHIFT == hash >> TAG_SHIFT;
+}
+
+// Copies the key of a question (QNAME, QTYPE and QCLASS in wire format) and
+// returns its hash (FNV-1a, never 0)
+uint64_t makeKey(const unsigned char *question, size_t nameLength,
+                 unsigned char *key) {
+  DNS::copyQuestionKey(question, nameLength, key);
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < nameLength + 4; i++) {
+    hash = (hash ^ key[i]) * 0x100000001b3;
+  }
+  // Mix the high bits, which pick the bucket and the tag
+  hash ^= hash >> 29;
+  hash *= 0xbf58476d1ce4e5b9;
+  hash ^= hash >> 32;
+  return hash == 0 ? 1 : hash;
+}
+
+uint64_t align8(uint64_t size) {
+  return (size + 7) & ~uint64_t(7);
+}
+} // namespace
+
+// An entry, as laid out in the arena: this header, the key, the records and
+// the TTLs (6 bytes each: the offset in the records and the original value)
+struct DNS::AnswerCache::EntryHeader {
+  // 0 marks the padding at the end of a log
+  uint64_t m_hash;
+  uint64_t m_insertedMs;
+  uint64_t m_expiresMs;
+  // Bytes of the entry, header included, a multiple of 8
+  uint32_t m_size;
+  uint16_t m_keyLength;
+  uint16_t m_recordsLength;
+  uint16_t m_counts[3];
+  // End of every section in the records
+  uint16_t m_ends[3];
+  uint16_t m_ttlCount;
+  uint8_t m_rcode;
+  uint8_t m_ra;
+};
+
+DNS::AnswerCache::AnswerCache(size_t bytes, uint32_t prefetchPercent,
+                              uint32_t staleSeconds)
+    : m_capacity(bytes), m_prefetchPercent(prefetchPercent),
+      m_staleMs(uint64_t(staleSeconds) * 1000) {
+  auto shardBytes = std::max<uint64_t>(bytes / Default::CACHE_SHARDS, 4096);
+  // Round the index down to a power of 2 of buckets
+  uint64_t buckets = 1;
+  while (buckets * 2 * SLOTS_PER_BUCKET * BYTES_PER_SLOT <= shardBytes) {
+    buckets *= 2;
+  }
+  auto indexBytes = buckets * sizeof(Bucket);
+  auto arenaBytes = (shardBytes - indexBytes) & ~uint64_t(7);
+  auto smallBytes = (arenaBytes * SMALL_LOG_PERCENT / 100) & ~uint64_t(7);
+
+  for (auto &shard : m_shards) {
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, alignof(Bucket), indexBytes) != 0) {
+      throw std::bad_alloc();
+    }
+    shard.m_buckets = new (ptr) Bucket[buckets];
+    for (uint64_t i = 0; i < buckets; i++) {
+      for (auto &slot : shard.m_buckets[i].m_slots) {
+        slot.store(0, std::memory_order_relaxed);
+      }
+    }
+    shard.m_bucketMask = buckets - 1;
+    shard.m_arena.reset(new unsigned char[arenaBytes]);
+    shard.m_arenaSize = arenaBytes;
+    shard.m_small = Log{0, smallBytes, 0, 0, 0};
+    shard.m_main = Log{smallBytes, arenaBytes, smallBytes, smallBytes, 0};
+    shard.m_ghost.assign(buckets * SLOTS_PER_BUCKET, 0);
+  }
+}
+
+DNS::AnswerCache::~AnswerCache() {
+  for (auto &shard : m_shards) {
+    free(shard.m_buckets);
+  }
+}
+
+std::atomic<uint64_t> *DNS::AnswerCache::findSlot(Shard &shard, uint64_t hash,
+                                                  uint64_t offset) {
+  auto &bucket = shard.m_buckets[(hash >> 8) & shard.m_bucketMask];
+  for (auto &slot : bucket.m_slots) {
+    auto value = slot.load(std::memory_order_relaxed);
+    if ((value & SLOT_USED) != 0 && slotOffset(value) == offset) {
+      return &slot;
+    }
+  }
+  return nullptr;
+}
+
+// Takes a free slot of the bucket, or the least frequently accessed one
+void DNS::AnswerCache::addSlot(Shard &shard, uint64_t hash, uint64_t offset,
+                               int frequency, WorkerStats &stats) {
+  auto &bucket = shard.m_buckets[(hash >> 8) & shard.m_bucketMask];
+  std::atomic<uint64_t> *victim = nullptr;
+  auto victimFrequency = MAX_FREQUENCY + 1;
+  for (auto &slot : bucket.m_slots) {
+    auto value = slot.load(std::memory_order_relaxed);
+    if ((value & SLOT_USED) == 0) {
+      victim = &slot;
+      victimFrequency = -1;
+      break;
+    }
+    if (slotFrequency(value) < victimFrequency) {
+      victim = &slot;
+      victimFrequency = slotFrequency(value);
+    }
+  }
+  if (victimFrequency >= 0) {
+    // The entry it points to is left in its log, as garbage
+    stats.add(Counter::CACHE_EVICTIONS);
+  }
+  victim->store(makeSlot(hash, offset, frequency), std::memory_order_relaxed);
+}
+
+int64_t DNS::AnswerCache::append(Shard &shard, Log &log,
+                                 const unsigned char *entry, uint32_t size,
+                                 bool evict, uint64_t nowMs,
+                                 WorkerStats &stats) {
+  if (size > log.m_end - log.m_begin) {
+    return -1;
+  }
+  while (true) {
+    if (log.m_used == 0) {
+      log.m_head = log.m_begin;
+      log.m_tail = log.m_begin;
+    }
+    // Free space is [head, end) and [begin, tail) while the head is ahead of
+    // the tail, and [head, tail) once it wrapped around
+    auto wrapped = log.m_used > 0 && log.m_head <= log.m_tail;
+    auto contiguous = wrapped ? log.m_tail - log.m_head
+                              : log.m_end - log.m_head;
+    if (contiguous >= size) {
+      auto offset = log.m_head;
+      std::memcpy(shard.m_arena.get() + offset, entry, size);
+      log.m_head += size;
+      log.m_used += size;
+      if (log.m_head == log.m_end) {
+        log.m_head = log.m_begin;
+      }
+      return static_cast<int64_t>(offset);
+    }
+    if (!wrapped) {
+      // Pad the end of the log and continue from its beginning
+      if (contiguous >= sizeof(EntryHeader)) {
+        EntryHeader padding{};
+        std::memcpy(shard.m_arena.get() + log.m_head, &padding,
+                    sizeof(padding));
+      }
+      log.m_used += contiguous;
+      log.m_head = log.m_begin;
+      continue;
+    }
+    if (!evict) {
+      return -1;
+    }
+    evictOldest(shard, log, nowMs, stats);
+  }
+}
+
+void DNS::AnswerCache::evictOldest(Shard &shard, Log &log, uint64_t nowMs,
+                                   WorkerStats &stats) {
+  auto tail = log.m_tail;
+  auto arena = shard.m_arena.get();
+  EntryHeader header{};
+  if (log.m_end - tail >= sizeof(EntryHeader)) {
+    std::memcpy(&header, arena + tail, sizeof(header));
+  }
+  if (header.m_hash == 0) {
+    // Padding: the log continues from its beginning
+    log.m_used -= log.m_end - tail;
+    log.m_tail = log.m_begin;
+    return;
+  }
+
+  auto slot = findSlot(shard, header.m_hash, tail);
+  auto frequency = 0;
+  unsigned char entry[MAX_ENTRY];
+  if (slot != nullptr) {
+    frequency = slotFrequency(slot->load(std::memory_order_relaxed));
+    slot->store(0, std::memory_order_relaxed);
+    std::memcpy(entry, arena + tail, header.m_size);
+  }
+  log.m_used -= header.m_size;
+  log.m_tail += header.m_size;
+  if (log.m_tail == log.m_end) {
+    log.m_tail = log.m_begin;
+  }
+  // Entries no slot points to any more were replaced or evicted already
+  if (slot == nullptr || header.m_expiresMs + m_staleMs <= nowMs) {
+    return;
+  }
+
+  auto isSmall = &log == &shard.m_small;
+  if (frequency > 0) {
+    // Accessed entries move on to (or stay in) the main log. Re-inserting
+    // into the main log never evicts, so that eviction can't recurse.
+    auto offset = append(shard, shard.m_main, entry, header.m_size, isSmall,
+                         nowMs, stats);
+    if (offset >= 0) {
+      addSlot(shard, header.m_hash, offset, isSmall ? 0 : frequency - 1,
+              stats);
+      return;
+    }
+  } else if (isSmall) {
+    auto &ghost = shard.m_ghost[(header.m_hash >> 8) % shard.m_ghost.size()];
+    ghost = static_cast<uint32_t>(header.m_hash >> 32) | 1;
+  }
+  stats.add(Counter::CACHE_EVICTIONS);
+}
+
+bool DNS::AnswerCache::insert(const unsigned char *response, size_t len,
+                              uint64_t nowMs, WorkerStats &stats) {
+  if (len < static_cast<size_t>(Default::HDR_SIZE)) {
+    return false;
+  }
+  Message::Header hdr;
+  std::memcpy(&hdr, response, sizeof(hdr));
+  if (hdr.m_tc || ntohs(hdr.m_qdcount) != 1 ||
+      (hdr.m_rcode != Rcode::NOERROR && hdr.m_rcode != Rcode::NXDOMAIN)) {
+    return false;
+  }
+  size_t questionsEnd = 0;
+  uint16_t nameLength = 0;
+  try {
+    MessageView view(response, static_cast<int>(len));
+    questionsEnd = view.questionsEnd();
+    nameLength = view.question(0).m_nameLength;
+  } catch (std::runtime_error &) {
+    return false;
+  }
+
+  // Build the entry on the stack, then copy it into the arena
+  unsigned char entry[MAX_ENTRY];
+  EntryHeader header{};
+  header.m_keyLength =
+          static_cast<uint16_t>(questionsEnd - Default::HDR_SIZE);
+  auto key = entry + sizeof(EntryHeader);
+  header.m_hash = makeKey(response + Default::HDR_SIZE, nameLength, key);
+  header.m_rcode = hdr.m_rcode;
+  header.m_ra = hdr.m_ra;
+  header.m_counts[0] = ntohs(hdr.m_ancount);
+  header.m_counts[1] = ntohs(hdr.m_nscount);
+  header.m_counts[2] = ntohs(hdr.m_arcount);
+
+  // TTLs are stored after the records, whose length is only known once
+  // they are all parsed
+  unsigned char ttls[MAX_ENTRY];
+  size_t ttlsLength = 0;
+  auto ttl = Default::CACHE_MAX_TTL;
+  auto negativeTtl = 0u;
+  auto pos = questionsEnd;
+  for (int section = 0; section < 3; section++) {
+    for (int i = 0; i < header.m_counts[section]; i++) {
+      pos = skipName(response, len, pos);
+      if (pos == 0 || pos + 10 > len) {
+        return false;
+      }
+      auto type = read16(response + pos);
+      auto recordTtl = read32(response + pos + 4);
+      auto rdLength = read16(response + pos + 8);
+      if (pos + 10 + rdLength > len || ttlsLength + 6 > sizeof(ttls)) {
+        return false;
+      }
+      if (type != TYPE_OPT) {
+        // TTLs with the top bit set are treated as 0 (RFC2181)
+        if (recordTtl > INT32_MAX) {
+          recordTtl = 0;
+        }
+        auto offset = static_cast<uint16_t>(pos + 4 - questionsEnd);
+        std::memcpy(ttls + ttlsLength, &offset, sizeof(offset));
+        std::memcpy(ttls + ttlsLength + 2, &recordTtl, sizeof(recordTtl));
+        ttlsLength += 6;
+        ttl = std::min(ttl, recordTtl);
+        if (section == 1 && type == Type::SOA && rdLength >= 4) {
+          auto minimum = read32(response + pos + 10 + rdLength - 4);
+          negativeTtl = std::min(recordTtl, minimum);
+        }
+      }
+      pos += 10 + rdLength;
+    }
+    header.m_ends[section] = static_cast<uint16_t>(pos - questionsEnd);
+  }
+  // Negative answers without a SOA must not be cached (RFC2308)
+  if (header.m_counts[0] == 0) {
+    ttl = std::min(ttl, negativeTtl);
+  }
+  if (ttl == 0) {
+    return false;
+  }
+  header.m_recordsLength = static_cast<uint16_t>(pos - questionsEnd);
+  header.m_ttlCount = static_cast<uint16_t>(ttlsLength / 6);
+  auto size = align8(sizeof(EntryHeader) + header.m_keyLength +
+                     header.m_recordsLength + ttlsLength);
+  if (size > MAX_ENTRY) {
+    return false;
+  }
+  header.m_size = static_cast<uint32_t>(size);
+  header.m_insertedMs = nowMs;
+  header.m_expiresMs = nowMs + uint64_t(ttl) * 1000;
+  std::memcpy(entry, &header, sizeof(header));
+  auto records = key + header.m_keyLength;
+  std::memcpy(records, response + questionsEnd, header.m_recordsLength);
+  std::memcpy(records + header.m_recordsLength, ttls, ttlsLength);
+
+  auto &s = shard(header.m_hash);
+  std::lock_guard<std::mutex> lock(s.m_mutex);
+  // Readers that overlap with the changes see an odd sequence, or a
+  // different one once they are done, and retry
+  auto sequence = s.m_sequence.load(std::memory_order_relaxed);
+  s.m_sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // Drop the entry this one replaces
+  auto &bucket = s.m_buckets[(header.m_hash >> 8) & s.m_bucketMask];
+  for (auto &slot : bucket.m_slots) {
+    auto value = slot.load(std::memory_order_relaxed);
+    if ((value & SLOT_USED) == 0 || !sameTag(value, header.m_hash)) {
+      continue;
+    }
+    auto other = s.m_arena.get() + slotOffset(value);
+    EntryHeader otherHeader;
+    std::memcpy(&otherHeader, other, sizeof(otherHeader));
+    if (otherHeader.m_hash == header.m_hash &&
+        otherHeader.m_keyLength == header.m_keyLength &&
+        std::memcmp(other + sizeof(otherHeader), key, header.m_keyLength) ==
+                0) {
+      slot.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Entries evicted from the small log recently skip it
+  auto &ghost = s.m_ghost[(header.m_hash >> 8) % s.m_ghost.size()];
+  auto ghosted = ghost == (static_cast<uint32_t>(header.m_hash >> 32) | 1);
+  if (ghosted) {
+    ghost = 0;
+  }
+  auto offset = append(s, ghosted ? s.m_main : s.m_small, entry,
+                       header.m_size, true, nowMs, stats);
+  if (offset >= 0) {
+    addSlot(s, header.m_hash, offset, 0, stats);
+  }
+  s.m_sequence.store(sequence + 2, std::memory_order_release);
+  return offset >= 0;
+}
+
+// Copies the entry of the question out, and only trusts the copy if no
+// writer got in the way
+std::atomic<uint64_t> *DNS::AnswerCache::read(const MessageView &query,
+                                              unsigned char *entry,
+                                              uint64_t &value) {
+  if (query.qdcount() != 1) {
+    return nullptr;
+  }
+  unsigned char key[Default::MAX_DOMAIN_NAME_SIZE + 4];
+  auto keyLength = query.question(0).m_nameLength + 4;
+  auto hash = makeKey(query.name(0), query.question(0).m_nameLength, key);
+  auto &s = shard(hash);
+  auto &bucket = s.m_buckets[(hash >> 8) & s.m_bucketMask];
+
+  EntryHeader header{};
+  for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+    auto sequence = s.m_sequence.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0) {
+      continue;
+    }
+    std::atomic<uint64_t> *found = nullptr;
+    for (auto &slot : bucket.m_slots) {
+      value = slot.load(std::memory_order_relaxed);
+      if ((value & SLOT_USED) == 0 || !sameTag(value, hash)) {
+        continue;
+      }
+      auto offset = slotOffset(value);
+      if (offset + sizeof(header) > s.m_arenaSize) {
+        continue;
+      }
+      std::memcpy(&header, s.m_arena.get() + offset, sizeof(header));
+      if (header.m_hash != hash || header.m_keyLength != keyLength ||
+          header.m_size > MAX_ENTRY ||
+          offset + header.m_size > s.m_arenaSize) {
+        continue;
+      }
+      std::memcpy(entry, s.m_arena.get() + offset, header.m_size);
+      if (std::memcmp(entry + sizeof(header), key, keyLength) == 0) {
+        found = &slot;
+        break;
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Not cached (or cached), as of a consistent read
+    if (s.m_sequence.load(std::memory_order_relaxed) == sequence) {
+      return found;
+    }
+  }
+  return nullptr;
+}
+
+// The question is at the same offset and of the same length as in the
+// upstream response, so the compression pointers of the records still hold
+void DNS::AnswerCache::respond(const unsigned char *entry,
+                               ResponseBuilder &builder, uint64_t nowMs,
+                               bool stale) {
+  EntryHeader header;
+  std::memcpy(&header, entry, sizeof(header));
+  auto records = entry + sizeof(header) + header.m_keyLength;
+  auto start = builder.size();
+  uint16_t begin = 0;
+  for (int section = 0; section < 3; section++) {
+    auto end = header.m_ends[section];
+    if (end > begin &&
+        !builder.addRaw(static_cast<ResponseBuilder::Section>(section),
+                        records + begin, end - begin,
+                        header.m_counts[section])) {
+      builder.truncate();
+      return;
+    }
+    begin = end;
+  }
+
+  // Count the TTLs down by the time the response spent in the cache
+  auto age = static_cast<uint32_t>((nowMs - header.m_insertedMs) / 1000);
+  auto ttls = records + header.m_recordsLength;
+  for (int i = 0; i < header.m_ttlCount; i++) {
+    uint16_t offset;
+    uint32_t ttl;
+    std::memcpy(&offset, ttls + i * 6, sizeof(offset));
+    std::memcpy(&ttl, ttls + i * 6 + 2, sizeof(ttl));
+    auto value = htonl(stale ? Default::CACHE_STALE_TTL : ttl - age);
+    std::memcpy(builder.data() + start + offset, &value, sizeof(value));
+  }
+  builder.setRcode(header.m_rcode);
+  builder.header().m_ra = header.m_ra;
+}
+
+bool DNS::AnswerCache::lookup(const MessageView &query,
+                              ResponseBuilder &builder, uint64_t nowMs,
+                              WorkerStats &stats, bool *prefetch) {
+  unsigned char entry[MAX_ENTRY];
+  uint64_t value = 0;
+  auto found = read(query, entry, value);
+  EntryHeader header{};
+  if (found != nullptr) {
+    std::memcpy(&header, entry, sizeof(header));
+  }
+  if (found == nullptr || nowMs >= header.m_expiresMs) {
+    stats.add(Counter::CACHE_MISSES);
+    return false;
+  }
+
+  // Count the access and claim the refresh, unless a writer changed the slot
+  // (or another worker claimed the refresh) meanwhile
+  auto frequency = slotFrequency(value);
+  auto updated = value;
+  if (frequency < MAX_FREQUENCY) {
+    updated = (updated & ~(uint64_t(MAX_FREQUENCY) << FREQUENCY_SHIFT)) |
+              uint64_t(frequency + 1) << FREQUENCY_SHIFT;
+  }
+  auto ttlMs = header.m_expiresMs - header.m_insertedMs;
+  auto leftMs = header.m_expiresMs - nowMs;
+  auto refresh = prefetch != nullptr && (value & SLOT_PREFETCHING) == 0 &&
+                 leftMs * 100 < ttlMs * m_prefetchPercent;
+  if (refresh) {
+    updated |= SLOT_PREFETCHING;
+  }
+  if (updated != value) {
+    auto swapped = found->compare_exchange_strong(value, updated,
+                                                  std::memory_order_relaxed);
+    if (refresh && swapped) {
+      *prefetch = true;
+    }
+  }
+  respond(entry, builder, nowMs, false);
+  stats.add(Counter::CACHE_HITS);
+  return true;
+}
+
+bool DNS::AnswerCache::lookupStale(const MessageView &query,
+                                   ResponseBuilder &builder, uint64_t nowMs,
+                                   WorkerStats &stats) {
+  unsigned char entry[MAX_ENTRY];
+  uint64_t value = 0;
+  if (read(query, entry, value) == nullptr) {
+    return false;
+  }
+  EntryHeader header;
+  std::memcpy(&header, entry, sizeof(header));
+  if (nowMs >= header.m_expiresMs + m_staleMs) {
+    return false;
+  }
+  respond(entry, builder, nowMs, nowMs >= header.m_expiresMs);
+  stats.add(Counter::STALE_ANSWERS);
+  return true;
+}
+
+size_t DNS::AnswerCache::size() const {
+  size_t size = 0;
+  for (const auto &shard : m_shards) {
+    for (uint64_t i = 0; i <= shard.m_bucketMask; i++) {
+      for (const auto &slot : shard.m_buckets[i].m_slots) {
+        size += (slot.load(std::memory_order_relaxed) & SLOT_USED) != 0;
+      }
+    }
+  }
+  return size;
+}
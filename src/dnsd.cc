@@ -1,22 +1,32 @@
+#include <affinity.hh>
+#include <algorithm>
 #include <dnsd.hh>
+#include <format.hh>
 #include <message.hh>
+#include <pipeline.hh>
+#include <wire.hh>
 #include <arpa/inet.h>
+#include <cstdio>
 #include <cstring>
 #include <exception>
 #include <iostream>
 #include <netinet/in.h>
+#include <poll.h>
 #include <sstream>
 #include <stdexcept>
 #include <string>
 #include <sys/socket.h>
+#include <thread>
+#include <time.h>
 #include <unistd.h>
 #include <utility>
+#include <vector>
 
-// Constructs a spoofing daemon that spoofs A-record DNS lookup requests with
-// the given IP address for ANY class queries
+// Constructs a spoofing daemon that spoofs DNS lookup requests of class IN
+// with the given IP address
 // Note: This daemon only supports IPv4
 // Note: This daemon only implements a subset of the standard in RFC1035
-DNS::Daemon::Daemon(std::string spoof) {
+DNS::Daemon::Daemon(std::string spoof, Config config) : m_config(config) {
 
   // Validate IP address
   m_spoofIP = {0};
@@ -31,10 +41,525 @@ DNS::Daemon::Daemon(std::string spoof) {
     }
     throw std::runtime_error(message.str());
   }
+
+  if (!m_config.m_soa.empty()) {
+    m_zone.reset(new Zone(m_config.m_soa));
+  }
+  m_views.reset(new Views(m_config.m_views, m_spoofIP, m_zone == nullptr));
+  for (const auto &upstream : m_config.m_upstreams) {
+    m_upstreams.push_back(parseUpstream(upstream));
+  }
+  if (!m_upstreams.empty()) {
+    m_cache.reset(new AnswerCache(m_config.m_cacheBytes,
+                                   m_config.m_prefetchPercent,
+                                   m_config.m_staleSeconds));
+  }
+  if (!m_config.m_tlsCertificate.empty()) {
+    m_tls.reset(new TlsContext(m_config.m_tlsCertificate, m_config.m_tlsKey));
+  }
+  if (!m_config.m_queryLog.m_path.empty()) {
+    m_queryLog.reset(new QueryLog(m_config.m_queryLog, m_config.m_cpus));
+  }
 }
 
 DNS::Daemon::~Daemon() {
-  // Do nothing for now
+  // Flushes the log while the stats its writers count into are alive
+  m_queryLog.reset();
+  for (auto &worker : m_workers) {
+    delete worker.load(std::memory_order_acquire);
+  }
+}
+
+DNS::Stats DNS::Daemon::stats() const {
+  Stats snapshot;
+  for (const auto &worker : m_workers) {
+    auto stats = worker.load(std::memory_order_acquire);
+    if (stats != nullptr) {
+      snapshot.merge(*stats);
+    }
+  }
+  return snapshot;
+}
+
+void DNS::Daemon::stop() {
+  m_complete = true;
+  // Shutting down the receive side makes blocked receives return 0
+  std::lock_guard<std::mutex> lock(m_socketsMutex);
+  for (auto sockFD : m_sockets) {
+    shutdown(sockFD, SHUT_RD);
+  }
+}
+
+void DNS::Daemon::addSocket(int sockFD) {
+  std::lock_guard<std::mutex> lock(m_socketsMutex);
+  m_sockets.push_back(sockFD);
+  // Don't miss a stop() that raced with the worker's startup
+  if (m_complete) {
+    shutdown(sockFD, SHUT_RD);
+  }
+}
+
+void DNS::Daemon::removeSocket(int sockFD) {
+  std::lock_guard<std::mutex> lock(m_socketsMutex);
+  m_sockets.erase(std::remove(m_sockets.begin(), m_sockets.end(), sockFD),
+                  m_sockets.end());
+}
+
+// Called on the worker thread, so that the worker's stats are allocated (and
+// first touched) by the worker itself
+DNS::WorkerStats &DNS::Daemon::addWorker() {
+  auto slot = m_workerCount.fetch_add(1, std::memory_order_acq_rel);
+  if (slot >= Default::MAX_WORKERS) {
+    m_workerCount.fetch_sub(1, std::memory_order_acq_rel);
+    std::stringstream message;
+    message << "Workers: " << slot + 1 << " - Exceeds the maximum of "
+            << Default::MAX_WORKERS;
+    throw std::runtime_error(message.str());
+  }
+  auto stats = new WorkerStats();
+  m_workers[slot].store(stats, std::memory_order_release);
+  return *stats;
+}
+
+namespace {
+// Coarse monotonic clock in milliseconds (vDSO, a few nanoseconds per call)
+uint64_t monotonicMs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Queues the query log record of a request
+// The log wants wall clock time, but latency is measured on the monotonic
+// clock, so the receive time is derived from both.
+void logQuery(DNS::QueryLog::Writer &queryLog, const sockaddr_in &client,
+              const DNS::MessageView &query,
+              const DNS::ResponseBuilder &builder, uint8_t flags,
+              uint64_t receivedNs) {
+  DNS::QueryLogRecord record{};
+  auto latencyNs = DNS::monotonicNs() - receivedNs;
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  record.m_timeNs =
+          uint64_t(now.tv_sec) * 1000000000 + now.tv_nsec - latencyNs;
+  record.m_latencyNs = static_cast<uint32_t>(latencyNs);
+  record.m_port = ntohs(client.sin_port);
+  record.m_family = AF_INET;
+  std::memcpy(record.m_address, &client.sin_addr, sizeof(client.sin_addr));
+  record.m_rcode = builder.header().m_rcode;
+  record.m_flags = flags |
+                   (builder.header().m_tc ? DNS::QueryLogRecord::TRUNCATED : 0);
+  // Only the first question is logged
+  if (query.qdcount() > 0) {
+    record.m_qtype = query.question(0).m_qtype;
+    record.m_nameLength = query.question(0).m_nameLength;
+    std::memcpy(record.m_name, query.name(0), record.m_nameLength);
+  }
+  queryLog.log(record);
+}
+
+// Returns how long the datagram waited between its arrival (as stamped by the
+// kernel) and now, or 0 if it carries no timestamp
+uint64_t queueDelayNs(msghdr &hdr) {
+  for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+      continue;
+    }
+    timespec arrival;
+    std::memcpy(&arrival, CMSG_DATA(cmsg), sizeof(arrival));
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t delay = (int64_t(now.tv_sec) - arrival.tv_sec) * 1000000000 +
+                    (now.tv_nsec - arrival.tv_nsec);
+    return delay > 0 ? delay : 0;
+  }
+  return 0;
+}
+
+// Returns the socket's cumulative count of datagrams dropped by the kernel
+// (SO_RXQ_OVFL), or -1 if the datagram carries no count
+int64_t kernelDrops(msghdr &hdr) {
+  for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      return drops;
+    }
+  }
+  return -1;
+}
+
+// Sizes a socket buffer
+// The forced variant lifts the net.core.[rw]mem_max cap but needs
+// CAP_NET_ADMIN, so unprivileged daemons fall back to the capped one. A
+// buffer smaller than requested is reported, since the kernel silently caps
+// it.
+void setBufferSize(int sockFD, int option, int forced, const char *name,
+                   uint32_t bytes) {
+  int size = static_cast<int>(bytes);
+  if (setsockopt(sockFD, SOL_SOCKET, forced, &size, sizeof(size)) < 0 &&
+      setsockopt(sockFD, SOL_SOCKET, option, &size, sizeof(size)) < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno) << " - Context: setsockopt("
+            << name << ")";
+    throw std::runtime_error(message.str());
+  }
+  // The kernel doubles the requested size to account for its bookkeeping
+  int actual = 0;
+  socklen_t len = sizeof(actual);
+  if (getsockopt(sockFD, SOL_SOCKET, option, &actual, &len) == 0 &&
+      actual / 2 < size) {
+    std::cerr << name << ": " << actual / 2 << " bytes - Capped below "
+              << size << " bytes" << std::endl;
+  }
+}
+
+// BusyPoll decides whether a worker that found its socket empty keeps
+// spinning on it or goes to sleep
+// A spin phase starts with the first empty receive and lasts until a packet
+// arrives (a hit) or the budget runs out (a sleep). Idle workers therefore
+// spin for at most one budget before blocking, instead of burning their CPU.
+class BusyPoll {
+public:
+  BusyPoll(uint32_t budgetUs, DNS::WorkerStats &stats)
+      : m_budgetNs(uint64_t(budgetUs) * 1000), m_stats(stats) {}
+
+  bool enabled() const { return m_budgetNs != 0; }
+
+  // Called on an empty receive. Returns true while the budget lasts.
+  bool spin() {
+    if (!enabled()) {
+      return false;
+    }
+    auto now = DNS::monotonicNs();
+    if (m_start == 0) {
+      m_start = now;
+    }
+    if (now - m_start < m_budgetNs) {
+      return true;
+    }
+    end(now);
+    m_stats.add(DNS::Counter::BUSY_POLL_SLEEPS);
+    return false;
+  }
+
+  // Called when a packet arrives
+  void hit() {
+    if (m_start != 0) {
+      end(DNS::monotonicNs());
+      m_stats.add(DNS::Counter::BUSY_POLL_HITS);
+    }
+  }
+
+private:
+  void end(uint64_t now) {
+    m_stats.add(DNS::Counter::BUSY_POLL_SPIN_US, (now - m_start) / 1000);
+    m_start = 0;
+  }
+
+  uint64_t m_budgetNs;
+  uint64_t m_start = 0;
+  DNS::WorkerStats &m_stats;
+};
+
+// Asks the kernel to busy poll the device queue on receives as well
+// Both options are best-effort: SO_BUSY_POLL beyond net.core.busy_poll needs
+// CAP_NET_ADMIN, and SO_PREFER_BUSY_POLL needs Linux 5.11
+void enableKernelBusyPoll(int sockFD, uint32_t budgetUs) {
+  int budget = static_cast<int>(budgetUs);
+  if (setsockopt(sockFD, SOL_SOCKET, SO_BUSY_POLL, &budget, sizeof(budget)) <
+      0) {
+    std::cerr << "What: " << std::strerror(errno)
+              << " - Context: setsockopt(SO_BUSY_POLL)" << std::endl;
+  }
+#ifdef SO_PREFER_BUSY_POLL
+  int prefer = 1;
+  if (setsockopt(sockFD, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer,
+                 sizeof(prefer)) < 0) {
+    std::cerr << "What: " << std::strerror(errno)
+              << " - Context: setsockopt(SO_PREFER_BUSY_POLL)" << std::endl;
+  }
+#endif
+}
+
+// Request is what the stages of the serving pipelines know of a query
+struct Request {
+  const DNS::MessageView &m_query;
+  DNS::ResponseBuilder &m_builder;
+  const sockaddr_in &m_client;
+  // 0 for UDP
+  uint64_t m_stream;
+  uint64_t m_receivedNs;
+  // Flags of the query log record: the transport, and what the stages did
+  uint8_t m_flags;
+};
+
+// Answers the query locally or from the cache, or hands it to the
+// forwarder, which replies later and ends the request
+template <typename Respond> class RespondStage : public DNS::PipelineStage {
+public:
+  RespondStage(Respond &respond, DNS::StageTimer &timer)
+      : m_respond(respond), m_timer(timer) {}
+
+  bool process(Request &request) {
+    auto answered = m_respond(request.m_query, request.m_builder,
+                              request.m_client, request.m_stream);
+    m_timer.lap(DNS::Stage::LOOKUP);
+    if (!answered) {
+      request.m_flags |= DNS::QueryLogRecord::FORWARDED;
+    }
+    return answered;
+  }
+
+private:
+  Respond &m_respond;
+  DNS::StageTimer &m_timer;
+};
+
+// Applies response rate limiting to the client's prefix, accounting answers,
+// negative answers and errors separately
+class RateLimitStage : public DNS::PipelineStage {
+public:
+  RateLimitStage(DNS::RateLimiter &rrl, DNS::WorkerStats &stats,
+                 DNS::StageTimer &timer)
+      : m_rrl(rrl), m_stats(stats), m_timer(timer) {}
+
+  bool process(Request &request) {
+    auto action = m_rrl.check(
+            reinterpret_cast<const sockaddr *>(&request.m_client),
+            DNS::RateLimiter::classify(request.m_builder.header()),
+            m_rrl.enabled() ? monotonicMs() : 0);
+    m_timer.lap(DNS::Stage::RRL);
+    if (action == DNS::RateLimiter::Action::DROP) {
+      m_stats.add(DNS::Counter::RRL_DROPPED);
+      request.m_flags |= DNS::QueryLogRecord::DROPPED;
+      return false;
+    }
+    if (action == DNS::RateLimiter::Action::SLIP) {
+      // Slipped replies are truncated, prompting the client to retry over
+      // TCP, and carry no answers to amplify with
+      request.m_builder.truncate();
+      m_stats.add(DNS::Counter::RRL_SLIPPED);
+    }
+    return true;
+  }
+
+private:
+  DNS::RateLimiter &m_rrl;
+  DNS::WorkerStats &m_stats;
+  DNS::StageTimer &m_timer;
+};
+
+// Sends the reply to the client from the worker's socket
+class SendStage : public DNS::PipelineStage {
+public:
+  SendStage(int sockFD, DNS::WorkerStats &stats, DNS::StageTimer &timer)
+      : m_sockFD(sockFD), m_stats(stats), m_timer(timer) {}
+
+  bool process(Request &request) {
+    // The records are serialized as they are added, so this stage is empty
+    // and only kept for the sake of comparison
+    m_timer.lap(DNS::Stage::SERIALIZE);
+    const auto &builder = request.m_builder;
+    auto n = sendto(m_sockFD, builder.data(), builder.size(), 0,
+                    reinterpret_cast<const sockaddr *>(&request.m_client),
+                    sizeof(request.m_client));
+    if (n < static_cast<ssize_t>(builder.size())) {
+      m_stats.add(DNS::Counter::SEND_ERRORS);
+      std::stringstream message;
+      message << "What: " << std::strerror(errno) << " - Context: sendto()";
+      std::cerr << message.str() << std::endl;
+    } else {
+      m_stats.add(DNS::Counter::RESPONSES);
+    }
+    m_timer.lap(DNS::Stage::SEND);
+    return true;
+  }
+
+private:
+  int m_sockFD;
+  DNS::WorkerStats &m_stats;
+  DNS::StageTimer &m_timer;
+};
+
+// Queues the query log record of every request, however it ended
+class LogStage : public DNS::PipelineStage {
+public:
+  explicit LogStage(DNS::QueryLog::Writer *queryLog) : m_queryLog(queryLog) {}
+
+  void complete(Request &request) {
+    if (m_queryLog != nullptr) {
+      logQuery(*m_queryLog, request.m_client, request.m_query,
+               request.m_builder, request.m_flags, request.m_receivedNs);
+    }
+  }
+
+private:
+  DNS::QueryLog::Writer *m_queryLog;
+};
+
+// Prints every Nth query, and the reply unless there is none yet, to stderr
+// The text is formatted in the thread's buffer, without allocating, and goes
+// out in a single write(), so that sampling can stay on in production.
+class DebugStage : public DNS::PipelineStage {
+public:
+  DebugStage(uint32_t sample, bool json)
+      : m_sample(sample),
+        m_style(json ? DNS::Formatter::Style::JSON
+                     : DNS::Formatter::Style::DIG) {}
+
+  void complete(Request &request) {
+    if (m_sample == 0 || ++m_count < m_sample) {
+      return;
+    }
+    m_count = 0;
+    char address[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &request.m_client.sin_addr, address, sizeof(address));
+    const char *transport = "UDP";
+    if ((request.m_flags & DNS::QueryLogRecord::TLS) != 0) {
+      transport = "TLS";
+    } else if ((request.m_flags & DNS::QueryLogRecord::TCP) != 0) {
+      transport = "TCP";
+    }
+    auto json = m_style == DNS::Formatter::Style::JSON;
+    char line[128];
+    snprintf(line, sizeof(line),
+             json ? "{\"client\":\"%s\",\"port\":%u,\"transport\":\"%s\","
+                    "\"query\":"
+                  : ";; Query from %s#%u over %s\n",
+             address, ntohs(request.m_client.sin_port), transport);
+    DNS::Formatter formatter(m_style);
+    formatter.append(line).format(request.m_query.data(),
+                                  request.m_query.size());
+    auto replied = (request.m_flags & (DNS::QueryLogRecord::FORWARDED |
+                                       DNS::QueryLogRecord::DROPPED)) == 0;
+    if (replied) {
+      formatter.append(json ? ",\"reply\":" : "\n;; Reply\n")
+              .format(request.m_builder.data(), request.m_builder.size());
+    }
+    formatter.append(json ? "}\n" : "\n");
+    auto n = ::write(STDERR_FILENO, formatter.data(), formatter.size());
+    (void)n;
+  }
+
+private:
+  uint32_t m_sample;
+  DNS::Formatter::Style m_style;
+  uint32_t m_count = 0;
+};
+} // namespace
+
+// Starts a worker per configured CPU. Each worker places itself (CPU, NUMA
+// node, scheduling policy) before run() allocates anything, so its buffers
+// and tables end up local to the CPU it serves on.
+void DNS::Daemon::serve() {
+  auto cpus = m_config.m_cpus;
+  if (cpus.empty()) {
+    // A single, unpinned worker
+    cpus.push_back(-1);
+  }
+
+  std::vector<std::thread> workers;
+  std::vector<std::exception_ptr> errors(cpus.size());
+  for (size_t i = 0; i < cpus.size(); i++) {
+    auto cpu = cpus[i];
+    auto &error = errors[i];
+    workers.emplace_back([this, cpu, &error]() {
+      try {
+        if (cpu >= 0) {
+          DNS::pinThread(cpu);
+          DNS::useLocalMemory();
+        }
+        if (m_config.m_realtimePriority > 0) {
+          DNS::setRealtime(m_config.m_realtimePriority);
+        }
+        run(true);
+      } catch (...) {
+        // stop() wakes the other workers, whose sockets it shuts down
+        error = std::current_exception();
+        stop();
+      }
+    });
+  }
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+}
+
+// Answers every question of class IN from the name's address in the client's
+// view, or from the view's spoofed IP if the name is not in its table, with
+// the handler of its type (see handlers.hh). The records' names point back
+// at the question.
+// An authoritative daemon denies the names it has no address for (NXDOMAIN)
+// and the types it has no records of (NODATA) with its SOA, and refuses the
+// names outside of its zone.
+bool DNS::Daemon::answer(const MessageView &query, ResponseBuilder &builder,
+                         const sockaddr *client) const {
+  const auto &view = m_views->select(client);
+  // Forwarders relay the names they don't know of (and that are outside
+  // their zone) instead of spoofing them
+  if (!m_upstreams.empty() && query.qdcount() == 1) {
+    auto name = query.name(0);
+    auto length = query.question(0).m_nameLength;
+    if ((!m_zone || !m_zone->contains(name, length)) &&
+        view.m_names.find(name, length) == nullptr) {
+      return false;
+    }
+  }
+  // A question outside the zone refuses the whole query, before any record
+  // is added for the others
+  for (int i = 0; m_zone && i < query.qdcount(); i++) {
+    if (!m_zone->contains(query.name(i), query.question(i).m_nameLength)) {
+      builder.setRcode(Rcode::REFUSED);
+      return true;
+    }
+  }
+  auto nxdomain = false;
+  for (int i = 0; i < query.qdcount(); i++) {
+    const auto &question = query.question(i);
+    auto name = query.name(i);
+    // Every record is of class IN
+    if (question.m_qclass != CLASS_IN && question.m_qclass != CLASS_ANY) {
+      continue;
+    }
+    // The apex exists whether it has an address or not
+    auto apex = m_zone && m_zone->isApex(name, question.m_nameLength);
+    auto address = view.m_names.find(name, question.m_nameLength);
+    if (address == nullptr && view.m_spoof) {
+      address = &view.m_address;
+    }
+    if (address == nullptr && !apex) {
+      nxdomain = true;
+      continue;
+    }
+    QuestionContext context{i, address, m_zone.get(), apex};
+    if (!Handlers::answer(question.m_qtype, context, builder)) {
+      break;
+    }
+  }
+
+  if (m_zone) {
+    builder.setAuthoritative(true);
+    if (builder.header().m_ancount == 0) {
+      // Negative answers carry the SOA, whose MINIMUM tells resolvers for
+      // how long to cache them (RFC2308)
+      if (nxdomain) {
+        builder.setRcode(Rcode::NXDOMAIN);
+      }
+      const auto &soa = m_zone->soaRecord();
+      builder.addRaw(DNS::ResponseBuilder::Section::AUTHORITY, soa.data(),
+                     soa.size(), 1);
+    }
+  }
+  return true;
 }
 
 // Start the daemon to receive DNS messages over UDP.
@@ -48,6 +573,50 @@ void DNS::Daemon::run(bool block) {
     throw std::runtime_error(message.str());
   }
 
+  // Every worker binds a socket of its own, and the kernel spreads the
+  // clients across them
+  int reuse = 1;
+  if (setsockopt(sockFD, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) <
+      0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno)
+            << " - Context: setsockopt(SO_REUSEPORT)";
+    throw std::runtime_error(message.str());
+  }
+
+  // Have the kernel stamp every datagram with its arrival time, which tells
+  // how long it waited in the socket queue
+  auto timestamps = m_config.m_rxTimestamps || m_config.m_maxQueueDelayMs > 0;
+  if (timestamps) {
+    int enable = 1;
+    if (setsockopt(sockFD, SOL_SOCKET, SO_TIMESTAMPNS, &enable,
+                   sizeof(enable)) < 0) {
+      std::stringstream message;
+      message << "What: " << std::strerror(errno)
+              << " - Context: setsockopt(SO_TIMESTAMPNS)";
+      throw std::runtime_error(message.str());
+    }
+  }
+  auto maxQueueDelayNs = uint64_t(m_config.m_maxQueueDelayMs) * 1000000;
+
+  // Have the kernel report its drop count along with every datagram
+  int overflow = 1;
+  if (setsockopt(sockFD, SOL_SOCKET, SO_RXQ_OVFL, &overflow,
+                 sizeof(overflow)) < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno)
+            << " - Context: setsockopt(SO_RXQ_OVFL)";
+    throw std::runtime_error(message.str());
+  }
+  if (m_config.m_rcvbuf > 0) {
+    setBufferSize(sockFD, SO_RCVBUF, SO_RCVBUFFORCE, "SO_RCVBUF",
+                  m_config.m_rcvbuf);
+  }
+  if (m_config.m_sndbuf > 0) {
+    setBufferSize(sockFD, SO_SNDBUF, SO_SNDBUFFORCE, "SO_SNDBUF",
+                  m_config.m_sndbuf);
+  }
+
   // Bind to UDP port (default: 53; address: 0.0.0.0)
   const sockaddr_in srvAddr {
       AF_INET,
@@ -65,86 +634,219 @@ void DNS::Daemon::run(bool block) {
   // c.f. https://www.ietf.org/rfc/rfc1035
   unsigned char buf[DNS::Default::BUFFER_SIZE];
 
+  // Replies are written in place into the worker's builder, which is reused
+  // for every request. Queries don't advertise a larger size with EDNS, as
+  // far as the daemon knows, so UDP replies that exceed the RFC1035 limit
+  // are truncated.
+  DNS::ResponseBuilder builder(DNS::Default::MAX_UDP_SIZE);
+  DNS::RateLimiter rrl(m_config.m_rrl);
+  auto &stats = addWorker();
+  DNS::QueryLog::Writer *queryLog = nullptr;
+  if (m_queryLog) {
+    queryLog = &m_queryLog->addWriter(stats);
+  }
+  DNS::StageTimer timer(m_config.m_stageTiming, stats.m_latency);
+  BusyPoll busyPoll(block ? m_config.m_busyPollUs : 0, stats);
+  if (busyPoll.enabled()) {
+    enableKernelBusyPoll(sockFD, m_config.m_busyPollUs);
+  }
+  auto &queueDelay = stats.m_latency[static_cast<int>(DNS::Stage::QUEUE)];
+  double ticksPerNs = timestamps ? 1.0 / DNS::Clock::nsPerTick() : 0;
+  addSocket(sockFD);
+
+  // Forwarding workers relay the queries they can't answer upstream, and wait
+  // for the upstream replies along with the queries
+  DNS::TimerWheel timers(monotonicMs());
+  std::unique_ptr<DNS::Forwarder> forwarder;
+  std::vector<pollfd> pollFDs{pollfd{sockFD, POLLIN, 0}};
+  if (!m_upstreams.empty()) {
+    forwarder.reset(new DNS::Forwarder(
+            m_upstreams, m_config.m_upstreamSockets,
+            m_config.m_upstreamRetries, m_config.m_staleDeadlineMs, *m_cache,
+            stats, timers, sockFD, rrl.enabled() ? &rrl : nullptr));
+    for (auto fd : forwarder->fds()) {
+      pollFDs.push_back(pollfd{fd, POLLIN, 0});
+    }
+  }
+  auto ownPollFDs = pollFDs.size();
+
+  // Answers a query locally or from the cache, or hands it to the forwarder,
+  // which replies later
+  auto respond = [&](const DNS::MessageView &query,
+                     DNS::ResponseBuilder &reply, const sockaddr_in &client,
+                     uint64_t stream) {
+    if (answer(query, reply, reinterpret_cast<const sockaddr *>(&client))) {
+      return true;
+    }
+    auto prefetch = false;
+    if (m_cache->lookup(query, reply, monotonicMs(), stats, &prefetch)) {
+      if (prefetch) {
+        forwarder->prefetch(query);
+      }
+      return true;
+    }
+    forwarder->forward(query, client, stream);
+    return false;
+  };
+
+  // Queries are served by pipelines of stages, whose calls are resolved at
+  // compile time
+  auto pipeline = DNS::makePipeline(
+          RespondStage<decltype(respond)>(respond, timer),
+          RateLimitStage(rrl, stats, timer), SendStage(sockFD, stats, timer),
+          LogStage(queryLog),
+          DebugStage(m_config.m_debugSample, m_config.m_debugJson));
+
+  // TCP and TLS connections are served on the same reactor. Rate limiting
+  // does not apply, as their clients can't spoof their address, and the
+  // server writes the replies. Their queries are not timed.
+  DNS::StageTimer streamTimer(false, nullptr);
+  auto streamPipeline = DNS::makePipeline(
+          RespondStage<decltype(respond)>(respond, streamTimer),
+          LogStage(queryLog),
+          DebugStage(m_config.m_debugSample, m_config.m_debugJson));
+  auto streamHandler = [&](uint8_t transport) {
+    return [&, transport](const DNS::MessageView &query,
+                          DNS::ResponseBuilder &reply,
+                          const sockaddr_in &client, uint64_t stream) {
+      Request request{query, reply, client, stream,
+                      queryLog != nullptr ? DNS::monotonicNs() : 0, transport};
+      streamPipeline.run(request);
+      return (request.m_flags & DNS::QueryLogRecord::FORWARDED) == 0;
+    };
+  };
+  std::vector<std::unique_ptr<DNS::TcpServer>> streamServers;
+  DNS::TcpServer *tcp = nullptr;
+  DNS::TcpServer *tls = nullptr;
+  if (m_config.m_tcp) {
+    streamServers.emplace_back(new DNS::TcpServer(
+            srvAddr, streamHandler(DNS::QueryLogRecord::TCP), stats, timers));
+    tcp = streamServers.back().get();
+  }
+  if (m_tls) {
+    auto tlsAddr = srvAddr;
+    tlsAddr.sin_port = htons(m_config.m_tlsPort);
+    streamServers.emplace_back(new DNS::TcpServer(
+            tlsAddr, streamHandler(DNS::QueryLogRecord::TLS), stats, timers,
+            m_tls.get()));
+    tls = streamServers.back().get();
+  }
+  if (forwarder) {
+    forwarder->setStreamSink([tcp, tls](uint64_t stream,
+                                        const unsigned char *response,
+                                        size_t len) {
+      auto server = (stream & DNS::TcpServer::TLS_STREAMS) != 0 ? tls : tcp;
+      server->reply(stream, response, len);
+    });
+  }
+  uint64_t tcpProcessedMs = 0;
+
+  // Ancillary data carried along with every datagram
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec)) +
+                                 CMSG_SPACE(sizeof(uint32_t))];
+
   // Cache client address to reply back
   while (!m_complete) {
     sockaddr_in clientAddr{};
-    socklen_t clientLen = sizeof(clientAddr);
+    // Timers are due at the coarse clock's resolution, which is plenty for
+    // timeouts and costs a few nanoseconds per iteration
+    auto nowMs = monotonicMs();
+    timers.advance(nowMs);
+    if (forwarder && forwarder->inflight() > 0) {
+      forwarder->process(nowMs);
+    }
+    // While datagrams keep the worker busy, connections are checked once per
+    // millisecond
+    if (!streamServers.empty() && nowMs != tcpProcessedMs) {
+      tcpProcessedMs = nowMs;
+      for (auto &server : streamServers) {
+        server->process();
+      }
+    }
     int flags = 0;
-    if (!block) {
+    if (!block || timer.enabled() || busyPoll.enabled() || forwarder ||
+        !streamServers.empty()) {
+      // Timed receives never block, so that idle time is not charged to the
+      // RECV stage. Busy polling workers only block once their budget ran
+      // out, and forwarding and TCP workers wait on their other sockets as
+      // well.
       flags = MSG_DONTWAIT;
     }
-    int n = recvfrom(sockFD, buf, DNS::Default::BUFFER_SIZE, flags,
-                     reinterpret_cast<sockaddr *>(&clientAddr), &clientLen);
+    timer.start();
+    iovec iov{buf, DNS::Default::BUFFER_SIZE};
+    msghdr hdr{};
+    hdr.msg_name = &clientAddr;
+    hdr.msg_namelen = sizeof(clientAddr);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    int n = recvmsg(sockFD, &hdr, flags);
+    if (m_complete) {
+      break;
+    }
     if (n < 0) {
-      if (!block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (block && !busyPoll.spin()) {
+          // Wake up for the next timer
+          pollFDs.resize(ownPollFDs);
+          for (const auto &server : streamServers) {
+            server->addPollFDs(pollFDs);
+          }
+          poll(pollFDs.data(), pollFDs.size(),
+               timers.timeoutMs(monotonicMs()));
+          tcpProcessedMs = 0;
+        }
         continue;
       }
       std::stringstream message;
-      message << "What: " << std::strerror(errno) << " - Context: recvfrom()";
+      message << "What: " << std::strerror(errno) << " - Context: recvmsg()";
       std::cerr << message.str() << std::endl;
     }
+    busyPoll.hit();
+    stats.add(DNS::Counter::QUERIES);
+    auto receivedNs = queryLog != nullptr ? DNS::monotonicNs() : 0;
 
-    // Parse DNS query
-    try {
-      DNS::Message msg(buf, n);
-
-      // Copy DNS query to reply
-      // The reply needs identical fields for ID, QDCOUNT, Question fields
-      DNS::Message reply = msg;
-      // Set message type to Response
-      reply.m_hdr.m_qr = 1;
-      // We are not a domain authority
-      reply.m_hdr.m_aa = 0;
-      // We don't support recursive lookup
-      reply.m_hdr.m_ra = 0;
-      // Set answer count = question count
-      reply.m_hdr.m_ancount = reply.m_hdr.m_qdcount;
-      // No Authority records
-      reply.m_hdr.m_nscount = 0;
-      // No Additional records
-      reply.m_hdr.m_arcount = 0;
-
-      // Generate a Resource Record for every answer with the spoofed IP
-      for (int i = 0; i < htons(reply.m_hdr.m_qdcount); i++) {
-        DNS::Message::ResourceRecord rr;
-        // Copy domain labels
-        rr.m_name = reply.m_questions[i].m_qname;
-        // Set type to A record
-        rr.m_type = htons(1);
-        // Set class to IN (Internet)
-        rr.m_class = htons(1);
-        // Set TTL to 180 seconds
-        rr.m_ttl = htonl(180);
-        // Set RD length to 4 bytes (binary container for IPv4)
-        rr.m_rdLength = htons(4);
-        // Set RD data to the spoofed IPv4
-        rr.m_rdata = reinterpret_cast<unsigned char *>(&m_spoofIP.s_addr);
-        // TODO: The resource m_size is not updated here
-        reply.m_answers.push_back(rr);
-      }
+    // The kernel only reports drops once there were any
+    auto drops = kernelDrops(hdr);
+    if (drops >= 0) {
+      stats.set(DNS::Counter::KERNEL_DROPS, drops);
+    }
 
-      // Mark response code with no errors
-      reply.m_hdr.m_rcode = 0;
+    // Account the time spent in the socket queue, and shed queries that
+    // waited so long that the client has retried them already
+    if (timestamps && n >= 0) {
+      auto delayNs = queueDelayNs(hdr);
+      queueDelay.record(static_cast<uint64_t>(delayNs * ticksPerNs));
+      if (maxQueueDelayNs > 0 && delayNs > maxQueueDelayNs) {
+        stats.add(DNS::Counter::STALE_DROPPED);
+        continue;
+      }
+    }
+    timer.lap(DNS::Stage::RECV);
 
-      // Serialize reply message from the stream
-      std::ostringstream replybuffer;
-      replybuffer << reply;
+    // Parse DNS query
+    try {
+      DNS::MessageView query(buf, n);
+      timer.lap(DNS::Stage::PARSE);
 
-      // Send reply to client
-      n = sendto(sockFD, replybuffer.str().c_str(), replybuffer.tellp(), 0,
-                 reinterpret_cast<sockaddr *>(&clientAddr), clientLen);
-      if (n < replybuffer.tellp()) {
-        std::stringstream message;
-        message << "What: " << std::strerror(errno) << " - Context: sendto()";
-        std::cerr << message.str() << std::endl;
-      }
+      // Start the reply from the query
+      // The reply needs identical fields for ID, QDCOUNT, Question fields;
+      // the builder sets QR and clears the other flags and counts
+      builder.begin(query);
+      timer.lap(DNS::Stage::BUILD);
+      Request request{query, builder, clientAddr, 0, receivedNs, 0};
+      pipeline.run(request);
     } catch (std::exception &e) {
+      stats.add(DNS::Counter::PARSE_ERRORS);
       std::cerr << "Failed to parse DNS request: " << e.what()
                 << " Ignoring request" << std::endl;
     }
+    timer.commit();
   }
 
   // Close socket
+  removeSocket(sockFD);
   if (close(sockFD) < 0) {
     std::stringstream message;
     message << "What: " << std::strerror(errno) << " - Context: close()";
@@ -0,0 +1,640 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <format.hh>
+#include <wire.hh>
+
+namespace {
+// Shared by the formatters of a thread that bring no buffer of their own
+thread_local char t_buf[DNS::Default::FORMAT_BUFFER_SIZE];
+
+// A name has at most 127 labels, so a name with more pointers loops
+const int MAX_JUMPS = 127;
+
+// Room kept at the end of the buffer to mark output that was cut short
+const size_t ELLIPSIS = 3;
+
+const char *const SECTION_HEADINGS[] = {
+    "\n;; QUESTION SECTION:\n", "\n;; ANSWER SECTION:\n",
+    "\n;; AUTHORITY SECTION:\n", "\n;; ADDITIONAL SECTION:\n"};
+const char *const SECTION_KEYS[] = {",\"question\":[", ",\"answer\":[",
+                                    ",\"authority\":[", ",\"additional\":["};
+
+const char *typeName(uint16_t type) {
+  switch (type) {
+  case 1:
+    return "A";
+  case 2:
+    return "NS";
+  case 5:
+    return "CNAME";
+  case 6:
+    return "SOA";
+  case 12:
+    return "PTR";
+  case 15:
+    return "MX";
+  case 16:
+    return "TXT";
+  case 28:
+    return "AAAA";
+  case 33:
+    return "SRV";
+  case 41:
+    return "OPT";
+  case 43:
+    return "DS";
+  case 46:
+    return "RRSIG";
+  case 47:
+    return "NSEC";
+  case 48:
+    return "DNSKEY";
+  case 64:
+    return "SVCB";
+  case 65:
+    return "HTTPS";
+  case 251:
+    return "IXFR";
+  case 252:
+    return "AXFR";
+  case 255:
+    return "ANY";
+  case 257:
+    return "CAA";
+  default:
+    return nullptr;
+  }
+}
+
+const char *className(uint16_t cls) {
+  switch (cls) {
+  case 1:
+    return "IN";
+  case 3:
+    return "CH";
+  case 4:
+    return "HS";
+  case 254:
+    return "NONE";
+  case 255:
+    return "ANY";
+  default:
+    return nullptr;
+  }
+}
+
+const char *const OPCODE_NAMES[16] = {"QUERY", "IQUERY", "STATUS", nullptr,
+                                      "NOTIFY", "UPDATE"};
+const char *const RCODE_NAMES[16] = {
+    "NOERROR", "FORMERR",  "SERVFAIL", "NXDOMAIN", "NOTIMP",  "REFUSED",
+    "YXDOMAIN", "YXRRSET", "NXRRSET",  "NOTAUTH",  "NOTZONE"};
+} // namespace
+
+DNS::Formatter::Formatter(char *buf, size_t len, Style style)
+    : m_buf(buf), m_capacity(len), m_style(style) {}
+
+DNS::Formatter::Formatter(Style style)
+    : Formatter(t_buf, sizeof(t_buf), style) {}
+
+DNS::Formatter &DNS::Formatter::format(const Message &msg) {
+  if (m_style == Style::JSON) {
+    put('{');
+  }
+  header(msg.m_hdr);
+  if (!msg.m_questions.empty()) {
+    beginSection(Section::QUESTION);
+    for (const auto &q : msg.m_questions) {
+      beginQuestion();
+      name(q.m_qname);
+      endQuestion(ntohs(q.m_qtype), ntohs(q.m_qclass));
+    }
+    endSection();
+  }
+  if (!msg.m_answers.empty()) {
+    beginSection(Section::ANSWER);
+    for (const auto &rr : msg.m_answers) {
+      beginRecord();
+      name(rr.m_name);
+      recordFields(ntohl(rr.m_ttl), ntohs(rr.m_type), ntohs(rr.m_class));
+      rdata(ntohs(rr.m_type), rr.m_rdata, ntohs(rr.m_rdLength), nullptr, 0);
+      endRecord();
+    }
+    endSection();
+  }
+  if (m_style == Style::JSON) {
+    put('}');
+  }
+  return *this;
+}
+
+DNS::Formatter &DNS::Formatter::format(const Message::Header &hdr) {
+  if (m_style == Style::JSON) {
+    put('{');
+    header(hdr);
+    put('}');
+  } else {
+    header(hdr);
+  }
+  return *this;
+}
+
+DNS::Formatter &DNS::Formatter::format(const Message::Question &q) {
+  m_first = true;
+  beginQuestion();
+  name(q.m_qname);
+  endQuestion(ntohs(q.m_qtype), ntohs(q.m_qclass));
+  return *this;
+}
+
+DNS::Formatter &DNS::Formatter::format(const Message::ResourceRecord &rr) {
+  m_first = true;
+  beginRecord();
+  name(rr.m_name);
+  recordFields(ntohl(rr.m_ttl), ntohs(rr.m_type), ntohs(rr.m_class));
+  rdata(ntohs(rr.m_type), rr.m_rdata, ntohs(rr.m_rdLength), nullptr, 0);
+  endRecord();
+  return *this;
+}
+
+DNS::Formatter &DNS::Formatter::format(const unsigned char *wire,
+                                       size_t len) {
+  if (m_style == Style::JSON) {
+    put('{');
+  }
+  Message::Header hdr;
+  if (len < sizeof(hdr)) {
+    if (m_style == Style::JSON) {
+      put("\"malformed\":0}");
+    } else {
+      put(";; MALFORMED at offset 0\n");
+    }
+    return *this;
+  }
+  std::memcpy(&hdr, wire, sizeof(hdr));
+  header(hdr);
+  uint16_t counts[] = {ntohs(hdr.m_qdcount), ntohs(hdr.m_ancount),
+                       ntohs(hdr.m_nscount), ntohs(hdr.m_arcount)};
+  size_t pos = sizeof(hdr);
+  for (int s = 0; s < 4; s++) {
+    if (counts[s] == 0) {
+      continue;
+    }
+    beginSection(static_cast<Section>(s));
+    for (int i = 0; i < counts[s]; i++) {
+      // Malformed entries are dropped whole, so that the output stays
+      // well-formed
+      auto mark = m_size;
+      auto first = m_first;
+      auto dropEntry = [&]() {
+        if (!m_overflowed) {
+          m_size = mark;
+          m_first = first;
+        }
+        endSection();
+        malformed(pos);
+      };
+      if (s == 0) {
+        beginQuestion();
+        auto n = name(wire + pos, len - pos, wire, len);
+        if (n == 0 || pos + n + 4 > len) {
+          dropEntry();
+          return *this;
+        }
+        endQuestion(read16(wire + pos + n), read16(wire + pos + n + 2));
+        pos += n + 4;
+        continue;
+      }
+      beginRecord();
+      auto n = name(wire + pos, len - pos, wire, len);
+      if (n == 0 || pos + n + 10 > len ||
+          pos + n + 10 + read16(wire + pos + n + 8) > len) {
+        dropEntry();
+        return *this;
+      }
+      auto fields = wire + pos + n;
+      auto type = read16(fields);
+      auto rdLength = read16(fields + 8);
+      recordFields(read32(fields + 4), type, read16(fields + 2));
+      rdata(type, fields + 10, rdLength, wire, len);
+      endRecord();
+      pos += n + 10 + rdLength;
+    }
+    endSection();
+  }
+  if (m_style == Style::JSON) {
+    put('}');
+  }
+  return *this;
+}
+
+DNS::Formatter &DNS::Formatter::append(const char *text) {
+  put(text);
+  return *this;
+}
+
+void DNS::Formatter::header(const Message::Header &hdr) {
+  auto opcode = OPCODE_NAMES[hdr.m_opcode];
+  auto rcode = RCODE_NAMES[hdr.m_rcode];
+  const char *flags[7];
+  int count = 0;
+  const bool set[] = {hdr.m_qr != 0, hdr.m_aa != 0, hdr.m_tc != 0,
+                      hdr.m_rd != 0, hdr.m_ra != 0, hdr.m_ad != 0,
+                      hdr.m_cd != 0};
+  const char *const names[] = {"qr", "aa", "tc", "rd", "ra", "ad", "cd"};
+  for (int i = 0; i < 7; i++) {
+    if (set[i]) {
+      flags[count++] = names[i];
+    }
+  }
+
+  if (m_style == Style::JSON) {
+    put("\"id\":");
+    number(ntohs(hdr.m_id));
+    put(",\"opcode\":");
+    if (opcode != nullptr) {
+      put('"');
+      put(opcode);
+      put('"');
+    } else {
+      number(hdr.m_opcode);
+    }
+    put(",\"status\":");
+    if (rcode != nullptr) {
+      put('"');
+      put(rcode);
+      put('"');
+    } else {
+      number(hdr.m_rcode);
+    }
+    put(",\"flags\":[");
+    for (int i = 0; i < count; i++) {
+      put(i == 0 ? "\"" : ",\"");
+      put(flags[i]);
+      put('"');
+    }
+    put(']');
+    return;
+  }
+
+  put(";; ->>HEADER<<- opcode: ");
+  if (opcode != nullptr) {
+    put(opcode);
+  } else {
+    number(hdr.m_opcode);
+  }
+  put(", status: ");
+  if (rcode != nullptr) {
+    put(rcode);
+  } else {
+    number(hdr.m_rcode);
+  }
+  put(", id: ");
+  number(ntohs(hdr.m_id));
+  put("\n;; flags:");
+  for (int i = 0; i < count; i++) {
+    put(' ');
+    put(flags[i]);
+  }
+  put("; QUERY: ");
+  number(ntohs(hdr.m_qdcount));
+  put(", ANSWER: ");
+  number(ntohs(hdr.m_ancount));
+  put(", AUTHORITY: ");
+  number(ntohs(hdr.m_nscount));
+  put(", ADDITIONAL: ");
+  number(ntohs(hdr.m_arcount));
+  put('\n');
+}
+
+void DNS::Formatter::beginSection(Section section) {
+  auto index = static_cast<int>(section);
+  if (m_style == Style::JSON) {
+    put(SECTION_KEYS[index]);
+    m_first = true;
+  } else {
+    put(SECTION_HEADINGS[index]);
+  }
+}
+
+void DNS::Formatter::endSection() {
+  if (m_style == Style::JSON) {
+    put(']');
+  }
+}
+
+void DNS::Formatter::beginQuestion() {
+  if (m_style == Style::JSON) {
+    separator();
+    put("{\"name\":\"");
+  } else {
+    put(';');
+  }
+}
+
+void DNS::Formatter::endQuestion(uint16_t qtype, uint16_t qclass) {
+  if (m_style == Style::JSON) {
+    put("\",\"class\":\"");
+    cls(qclass);
+    put("\",\"type\":\"");
+    type(qtype);
+    put("\"}");
+  } else {
+    put("\t\t");
+    cls(qclass);
+    put('\t');
+    type(qtype);
+    put('\n');
+  }
+}
+
+void DNS::Formatter::beginRecord() {
+  if (m_style == Style::JSON) {
+    separator();
+    put("{\"name\":\"");
+  }
+}
+
+void DNS::Formatter::recordFields(uint32_t ttl, uint16_t type, uint16_t cls) {
+  if (m_style == Style::JSON) {
+    put("\",\"ttl\":");
+    number(ttl);
+    put(",\"class\":\"");
+    this->cls(cls);
+    put("\",\"type\":\"");
+    this->type(type);
+    put("\",\"data\":\"");
+  } else {
+    put('\t');
+    number(ttl);
+    put('\t');
+    this->cls(cls);
+    put('\t');
+    this->type(type);
+    put('\t');
+  }
+}
+
+void DNS::Formatter::endRecord() {
+  put(m_style == Style::JSON ? "\"}" : "\n");
+}
+
+void DNS::Formatter::name(const Labels &labels) {
+  for (const auto &label : labels) {
+    for (auto c : label) {
+      escaped(static_cast<unsigned char>(c), true);
+    }
+    put('.');
+  }
+  if (labels.empty()) {
+    put('.');
+  }
+}
+
+size_t DNS::Formatter::name(const unsigned char *data, size_t len,
+                            const unsigned char *msg, size_t msgLen) {
+  auto mark = m_size;
+  auto fail = [&]() -> size_t {
+    if (!m_overflowed) {
+      m_size = mark;
+    }
+    return 0;
+  };
+  size_t consumed = 0;
+  bool jumped = false;
+  int jumps = 0;
+  bool root = true;
+  while (true) {
+    if (len == 0) {
+      return fail();
+    }
+    auto length = data[0];
+    if ((length & 0xc0) == 0xc0) {
+      if (len < 2 || msg == nullptr || ++jumps > MAX_JUMPS) {
+        return fail();
+      }
+      size_t offset = (length & 0x3f) << 8 | data[1];
+      if (offset >= msgLen) {
+        return fail();
+      }
+      if (!jumped) {
+        consumed += 2;
+        jumped = true;
+      }
+      data = msg + offset;
+      len = msgLen - offset;
+      continue;
+    }
+    if (length > Default::MAX_LABEL_LENGTH || len < 1u + length) {
+      return fail();
+    }
+    if (!jumped) {
+      consumed += 1 + length;
+    }
+    if (length == 0) {
+      break;
+    }
+    for (int i = 1; i <= length; i++) {
+      escaped(data[i], true);
+    }
+    put('.');
+    root = false;
+    data += 1 + length;
+    len -= 1 + length;
+  }
+  if (root) {
+    put('.');
+  }
+  return consumed;
+}
+
+void DNS::Formatter::rdata(uint16_t type, const unsigned char *data,
+                           size_t len, const unsigned char *msg,
+                           size_t msgLen) {
+  auto mark = m_size;
+  if (data != nullptr && typedRdata(type, data, len, msg, msgLen)) {
+    return;
+  }
+  if (!m_overflowed) {
+    m_size = mark;
+  }
+  static const char HEX[] = "0123456789ABCDEF";
+  text('\\');
+  put("# ");
+  number(len);
+  if (len > 0) {
+    put(' ');
+  }
+  for (size_t i = 0; i < len; i++) {
+    put(HEX[data[i] >> 4]);
+    put(HEX[data[i] & 0xf]);
+  }
+}
+
+bool DNS::Formatter::typedRdata(uint16_t type, const unsigned char *data,
+                                size_t len, const unsigned char *msg,
+                                size_t msgLen) {
+  switch (type) {
+  case 1:
+  case 28: {
+    char address[INET6_ADDRSTRLEN];
+    if (len != (type == 1 ? 4u : 16u) ||
+        inet_ntop(type == 1 ? AF_INET : AF_INET6, data, address,
+                  sizeof(address)) == nullptr) {
+      return false;
+    }
+    put(address);
+    return true;
+  }
+  case 2:
+  case 5:
+  case 12:
+    return len > 0 && name(data, len, msg, msgLen) == len;
+  case 15:
+    if (len < 3) {
+      return false;
+    }
+    number(read16(data));
+    put(' ');
+    return name(data + 2, len - 2, msg, msgLen) == len - 2;
+  case 6: {
+    auto mname = name(data, len, msg, msgLen);
+    if (mname == 0) {
+      return false;
+    }
+    put(' ');
+    auto rname = name(data + mname, len - mname, msg, msgLen);
+    if (rname == 0 || len - mname - rname != 20) {
+      return false;
+    }
+    for (int i = 0; i < 5; i++) {
+      put(' ');
+      number(read32(data + mname + rname + 4 * i));
+    }
+    return true;
+  }
+  case 16: {
+    size_t pos = 0;
+    while (pos < len) {
+      size_t length = data[pos];
+      if (pos + 1 + length > len) {
+        return false;
+      }
+      if (pos > 0) {
+        put(' ');
+      }
+      text('"');
+      for (size_t i = 0; i < length; i++) {
+        escaped(data[pos + 1 + i], false);
+      }
+      text('"');
+      pos += 1 + length;
+    }
+    return len > 0;
+  }
+  default:
+    return false;
+  }
+}
+
+void DNS::Formatter::type(uint16_t type) {
+  auto name = typeName(type);
+  if (name != nullptr) {
+    put(name);
+  } else {
+    put("TYPE");
+    number(type);
+  }
+}
+
+void DNS::Formatter::cls(uint16_t cls) {
+  auto name = className(cls);
+  if (name != nullptr) {
+    put(name);
+  } else {
+    put("CLASS");
+    number(cls);
+  }
+}
+
+// Labels escape the characters with a meaning in zone files, and
+// character-strings (which are quoted) only quotes and backslashes. Other
+// unprintable bytes are written as \DDD.
+void DNS::Formatter::escaped(unsigned char c, bool label) {
+  if (c < 0x20 || c > 0x7e || (label && c == ' ')) {
+    text('\\');
+    put(static_cast<char>('0' + c / 100));
+    put(static_cast<char>('0' + c / 10 % 10));
+    put(static_cast<char>('0' + c % 10));
+    return;
+  }
+  if (c == '"' || c == '\\' ||
+      (label && std::strchr(".();@$", c) != nullptr)) {
+    text('\\');
+  }
+  text(static_cast<char>(c));
+}
+
+void DNS::Formatter::text(char c) {
+  if (m_style == Style::JSON && (c == '"' || c == '\\')) {
+    put('\\');
+  }
+  put(c);
+}
+
+void DNS::Formatter::put(char c) {
+  if (m_overflowed) {
+    return;
+  }
+  if (m_size + 1 + ELLIPSIS > m_capacity) {
+    m_overflowed = true;
+    for (size_t i = 0; i < ELLIPSIS && m_size < m_capacity; i++) {
+      m_buf[m_size++] = '.';
+    }
+    return;
+  }
+  m_buf[m_size++] = c;
+}
+
+void DNS::Formatter::put(const char *s) { put(s, std::strlen(s)); }
+
+void DNS::Formatter::put(const char *s, size_t len) {
+  if (!m_overflowed && m_size + len + ELLIPSIS <= m_capacity) {
+    std::memcpy(m_buf + m_size, s, len);
+    m_size += len;
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    put(s[i]);
+  }
+}
+
+void DNS::Formatter::number(uint64_t value) {
+  char digits[20];
+  int count = 0;
+  do {
+    digits[count++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  while (count > 0) {
+    put(digits[--count]);
+  }
+}
+
+void DNS::Formatter::separator() {
+  if (!m_first) {
+    put(',');
+  }
+  m_first = false;
+}
+
+void DNS::Formatter::malformed(size_t offset) {
+  if (m_style == Style::JSON) {
+    put(",\"malformed\":");
+    number(offset);
+    put('}');
+  } else {
+    put("\n;; MALFORMED at offset ");
+    number(offset);
+    put('\n');
+  }
+}
@@ -0,0 +1,315 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <forwarder.hh>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <utility>
+
+sockaddr_in DNS::parseUpstream(const std::string &upstream) {
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(Default::UPSTREAM_PORT);
+  auto colon = upstream.find(':');
+  auto host = upstream.substr(0, colon);
+  if (colon != std::string::npos) {
+    auto port = upstream.substr(colon + 1);
+    size_t end = 0;
+    int value = -1;
+    try {
+      value = std::stoi(port, &end);
+    } catch (std::exception &) {
+      end = 0;
+    }
+    if (port.empty() || end != port.size() || value <= 0 ||
+        value > UINT16_MAX) {
+      std::stringstream message;
+      message << "Upstream: " << upstream << " - Invalid port";
+      throw std::runtime_error(message.str());
+    }
+    address.sin_port = htons(static_cast<uint16_t>(value));
+  }
+  if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1) {
+    std::stringstream message;
+    message << "Upstream: " << upstream << " - Invalid IPv4 address";
+    throw std::runtime_error(message.str());
+  }
+  return address;
+}
+
+DNS::Forwarder::Forwarder(const std::vector<sockaddr_in> &upstreams,
+                          int socketsPerUpstream, Resolver::Options options,
+                          uint32_t staleDeadlineMs, AnswerCache &cache,
+                          WorkerStats &stats, TimerWheel &timers, int sockFD,
+                          RateLimiter *rrl)
+    : m_staleDeadlineMs(staleDeadlineMs),
+      m_socketsPerUpstream(socketsPerUpstream < 1 ? 1 : socketsPerUpstream),
+      m_cache(cache), m_stats(stats), m_timers(timers),
+      m_retransmit([this]() { process(m_timers.nowMs()); }), m_sockFD(sockFD),
+      m_rrl(rrl), m_buf(Default::MAX_UDP_SIZE) {
+  for (const auto &upstream : upstreams) {
+    for (int i = 0; i < m_socketsPerUpstream; i++) {
+      m_resolvers.emplace_back(new Resolver(upstream, options));
+      m_pollFDs.push_back(pollfd{m_resolvers.back()->fd(), POLLIN, 0});
+    }
+  }
+}
+
+void DNS::Forwarder::forward(const MessageView &query,
+                             const sockaddr_in &client, uint64_t stream) {
+  if (m_resolvers.empty() || query.qdcount() != 1) {
+    throw std::logic_error("Only single questions can be forwarded");
+  }
+  const auto &question = query.question(0);
+  Client pending{client, stream, query.m_hdr,
+                 std::string(reinterpret_cast<const char *>(query.name(0)),
+                             question.m_nameLength + 4)};
+
+  auto key = questionKey(query);
+  auto it = m_pending.find(key);
+  if (it == m_pending.end()) {
+    // Nothing waits for the reply until the question was sent, which throws
+    // when the socket has every query ID in flight
+    try {
+      resolve(key);
+    } catch (std::runtime_error &) {
+      fail(pending);
+      return;
+    }
+    it = m_pending.emplace(key, Pending()).first;
+    m_stats.add(Counter::FORWARDED);
+  } else {
+    // Past the deadline, later clients get the stale answer right away
+    const auto &deadline = it->second.m_deadline;
+    if (deadline && !deadline->pending() && serveStale(pending)) {
+      return;
+    }
+    m_stats.add(Counter::COALESCED);
+  }
+  auto &inflight = it->second;
+  inflight.m_clients.push_back(std::move(pending));
+  if (!inflight.m_deadline && m_staleDeadlineMs > 0) {
+    inflight.m_deadline.reset(new Timer([this, key]() { deadline(key); }));
+    m_timers.schedule(*inflight.m_deadline,
+                      m_timers.nowMs() + m_staleDeadlineMs);
+  }
+}
+
+void DNS::Forwarder::prefetch(const MessageView &query) {
+  if (m_resolvers.empty() || query.qdcount() != 1) {
+    throw std::logic_error("Only single questions can be prefetched");
+  }
+  auto key = questionKey(query);
+  if (m_pending.count(key) != 0) {
+    return;
+  }
+  // A refresh that can't be sent leaves the entry to expire, as a failed one
+  // does
+  try {
+    resolve(key);
+  } catch (std::runtime_error &) {
+    return;
+  }
+  m_pending.emplace(key, Pending());
+  m_stats.add(Counter::PREFETCHES);
+}
+
+// The question in lowercase, so that the spellings of clients that
+// randomize the case of their queries share the upstream query
+std::string DNS::Forwarder::questionKey(const MessageView &query) {
+  auto nameLength = query.question(0).m_nameLength;
+  std::string key(nameLength + 4, '\0');
+  copyQuestionKey(query.name(0), nameLength,
+                  reinterpret_cast<unsigned char *>(&key[0]));
+  return key;
+}
+
+void DNS::Forwarder::resolve(const std::string &key) {
+  nextResolver().resolve(
+          reinterpret_cast<const unsigned char *>(key.data()), key.size(),
+          [this, key](Resolver::Result result) {
+            complete(key, std::move(result));
+          });
+  rearm();
+}
+
+DNS::Resolver &DNS::Forwarder::nextResolver() {
+  auto upstreams = m_resolvers.size() / m_socketsPerUpstream;
+  auto upstream = m_nextUpstream++ % upstreams;
+  auto socket = m_random.next() % m_socketsPerUpstream;
+  return *m_resolvers[upstream * m_socketsPerUpstream + socket];
+}
+
+// A single poll() finds the sockets with replies, so that the worker can call
+// this between queries without a system call per socket
+int DNS::Forwarder::process(uint64_t nowMs) {
+  m_nowMs = nowMs;
+  if (::poll(m_pollFDs.data(), m_pollFDs.size(), 0) < 0) {
+    return 0;
+  }
+  int completed = 0;
+  for (size_t i = 0; i < m_resolvers.size(); i++) {
+    auto &resolver = *m_resolvers[i];
+    if ((m_pollFDs[i].revents & POLLIN) != 0 ||
+        (resolver.inflight() > 0 && resolver.nextTimeoutMs() == 0)) {
+      completed += resolver.poll(0);
+    }
+  }
+  rearm();
+  return completed;
+}
+
+std::vector<int> DNS::Forwarder::fds() const {
+  std::vector<int> fds;
+  for (const auto &pfd : m_pollFDs) {
+    fds.push_back(pfd.fd);
+  }
+  return fds;
+}
+
+void DNS::Forwarder::rearm() {
+  int timeoutMs = -1;
+  for (const auto &resolver : m_resolvers) {
+    auto next = resolver->nextTimeoutMs();
+    if (next >= 0 && (timeoutMs < 0 || next < timeoutMs)) {
+      timeoutMs = next;
+    }
+  }
+  if (timeoutMs < 0) {
+    m_timers.cancel(m_retransmit);
+  } else {
+    m_timers.schedule(m_retransmit, m_timers.nowMs() + timeoutMs);
+  }
+}
+
+// Caches a reply and relays it to every client waiting for it, or answers
+// them from a stale entry or SERVFAIL if the query failed (a failed refresh
+// leaves the entry to expire)
+void DNS::Forwarder::complete(const std::string &key,
+                              Resolver::Result result) {
+  auto it = m_pending.find(key);
+  auto clients = std::move(it->second.m_clients);
+  m_pending.erase(it);
+  if (result.m_error == 0 &&
+      result.m_reply->size() <= static_cast<int>(Default::MAX_UDP_SIZE)) {
+    const auto &reply = *result.m_reply;
+    m_cache.insert(reply.data(), reply.size(), m_nowMs, m_stats);
+    for (const auto &client : clients) {
+      send(client, reply.data(), reply.size());
+    }
+    return;
+  }
+
+  for (const auto &client : clients) {
+    fail(client);
+  }
+}
+
+void DNS::Forwarder::fail(const Client &client) {
+  if (serveStale(client)) {
+    return;
+  }
+  m_stats.add(Counter::UPSTREAM_ERRORS);
+  auto hdr = client.m_hdr;
+  hdr.m_qr = 1;
+  hdr.m_aa = 0;
+  hdr.m_tc = 0;
+  hdr.m_ra = 1;
+  hdr.m_z = 0;
+  hdr.m_ad = 0;
+  hdr.m_rcode = Rcode::SERVFAIL;
+  hdr.m_qdcount = htons(1);
+  hdr.m_ancount = 0;
+  hdr.m_nscount = 0;
+  hdr.m_arcount = 0;
+  std::memcpy(m_buf.data(), &hdr, sizeof(hdr));
+  send(client, m_buf.data(), sizeof(hdr) + client.m_question.size());
+}
+
+// The query goes on, to refresh the cache and answer the clients that have
+// no stale answer
+void DNS::Forwarder::deadline(const std::string &key) {
+  auto &clients = m_pending.at(key).m_clients;
+  std::vector<Client> waiting;
+  for (auto &client : clients) {
+    if (!serveStale(client)) {
+      waiting.push_back(std::move(client));
+    }
+  }
+  clients.swap(waiting);
+}
+
+bool DNS::Forwarder::serveStale(const Client &client) {
+  // Start the response from the client's query
+  auto hdr = client.m_hdr;
+  hdr.m_qdcount = htons(1);
+  hdr.m_ancount = 0;
+  hdr.m_nscount = 0;
+  hdr.m_arcount = 0;
+  std::memcpy(m_buf.data(), &hdr, sizeof(hdr));
+  std::memcpy(m_buf.data() + sizeof(hdr), client.m_question.data(),
+              client.m_question.size());
+  MessageView query(m_buf.data(),
+                    static_cast<int>(sizeof(hdr) + client.m_question.size()));
+  m_builder.begin(query);
+  if (!m_cache.lookupStale(query, m_builder, m_timers.nowMs(), m_stats)) {
+    return false;
+  }
+  send(client, m_builder.data(), m_builder.size());
+  return true;
+}
+
+// Sends a response to the client, under the client's ID and RD bit and with
+// the question spelled as the client did (c.f. draft-vixie-dnsext-dns0x20)
+// Replies are at least as long as the query they matched.
+void DNS::Forwarder::send(const Client &client, const unsigned char *response,
+                          size_t len) {
+  if (response != m_buf.data()) {
+    std::memcpy(m_buf.data(), response, len);
+  }
+  auto &hdr = *reinterpret_cast<Message::Header *>(m_buf.data());
+  hdr.m_id = client.m_hdr.m_id;
+  hdr.m_rd = client.m_hdr.m_rd;
+  std::memcpy(m_buf.data() + sizeof(Message::Header),
+              client.m_question.data(), client.m_question.size());
+  if (client.m_stream != 0) {
+    m_streamSink(client.m_stream, m_buf.data(), len);
+    m_stats.add(Counter::RESPONSES);
+    return;
+  }
+
+  // Spoofed clients would otherwise get relayed replies reflected at them
+  // without limit
+  if (m_rrl != nullptr) {
+    auto action = m_rrl->check(
+            reinterpret_cast<const sockaddr *>(&client.m_address),
+            RateLimiter::classify(hdr), m_timers.nowMs());
+    if (action == RateLimiter::Action::DROP) {
+      m_stats.add(Counter::RRL_DROPPED);
+      return;
+    }
+    if (action == RateLimiter::Action::SLIP) {
+      hdr.m_tc = 1;
+      hdr.m_ancount = 0;
+      hdr.m_nscount = 0;
+      hdr.m_arcount = 0;
+      len = sizeof(Message::Header) + client.m_question.size();
+      m_stats.add(Counter::RRL_SLIPPED);
+    }
+  }
+
+  auto n = sendto(m_sockFD, m_buf.data(), len, 0,
+                  reinterpret_cast<const sockaddr *>(&client.m_address),
+                  sizeof(client.m_address));
+  if (n < static_cast<ssize_t>(len)) {
+    m_stats.add(Counter::SEND_ERRORS);
+    std::stringstream message;
+    message << "What: " << std::strerror(errno) << " - Context: sendto()";
+    std::cerr << message.str() << std::endl;
+  } else {
+    m_stats.add(Counter::RESPONSES);
+  }
+}
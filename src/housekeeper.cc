@@ -0,0 +1,109 @@
+#include <affinity.hh>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <housekeeper.hh>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <utility>
+
+DNS::Housekeeper::Housekeeper(std::vector<int> workerCpus)
+    : m_workerCpus(std::move(workerCpus)) {
+  m_wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeFD < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno) << " - Context: eventfd()";
+    throw std::runtime_error(message.str());
+  }
+}
+
+DNS::Housekeeper::~Housekeeper() {
+  stop();
+  close(m_wakeFD);
+}
+
+void DNS::Housekeeper::every(std::chrono::milliseconds interval, Task task) {
+  m_tasks.push_back(Periodic{interval, {}, std::move(task)});
+}
+
+void DNS::Housekeeper::watch(int fd, Task task) {
+  m_watches.push_back(Watch{fd, std::move(task)});
+}
+
+void DNS::Housekeeper::start() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto &task : m_tasks) {
+    task.m_due = now + task.m_interval;
+  }
+  m_thread = std::thread(&Housekeeper::loop, this);
+}
+
+void DNS::Housekeeper::stop() {
+  m_stopped = true;
+  // Can only fail once the counter is about to overflow, which a few wake
+  // ups never do
+  uint64_t one = 1;
+  auto ret = write(m_wakeFD, &one, sizeof(one));
+  (void)ret;
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+}
+
+// Sleeps until the earliest task is due or a watched descriptor is readable,
+// runs every task that is ready, and repeats
+void DNS::Housekeeper::loop() {
+  try {
+    avoidCpus(m_workerCpus);
+  } catch (std::exception &e) {
+    std::cerr << "Failed to move housekeeping off the worker CPUs: "
+              << e.what() << std::endl;
+  }
+
+  // The wake up descriptor comes last
+  std::vector<pollfd> pfds;
+  for (const auto &watch : m_watches) {
+    pfds.push_back(pollfd{watch.m_fd, POLLIN, 0});
+  }
+  pfds.push_back(pollfd{m_wakeFD, POLLIN, 0});
+
+  while (!m_stopped) {
+    auto due = std::chrono::steady_clock::time_point::max();
+    for (const auto &task : m_tasks) {
+      due = std::min(due, task.m_due);
+    }
+    int timeoutMs = -1;
+    if (due != std::chrono::steady_clock::time_point::max()) {
+      auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+              due - std::chrono::steady_clock::now());
+      // Round up, so that the tasks are due once poll() returns
+      timeoutMs = wait.count() < 0 ? 0 : static_cast<int>(wait.count()) + 1;
+    }
+    if (poll(pfds.data(), pfds.size(), timeoutMs) < 0 && errno != EINTR) {
+      std::cerr << "What: " << std::strerror(errno)
+                << " - Context: poll(housekeeper)" << std::endl;
+      return;
+    }
+    if (m_stopped) {
+      break;
+    }
+
+    for (size_t i = 0; i < m_watches.size(); i++) {
+      if (pfds[i].revents != 0) {
+        m_watches[i].m_task();
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (auto &task : m_tasks) {
+      if (task.m_due <= now) {
+        task.m_due = now + task.m_interval;
+        task.m_task();
+      }
+    }
+  }
+}
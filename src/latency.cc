@@ -0,0 +1,114 @@
+#include <latency.hh>
+#include <mutex>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace {
+// Indexed by DNS::Stage
+const char *const STAGE_NAMES[] = {
+    "queue", "recv", "parse", "lookup", "build", "serialize", "send", "rrl",
+};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) ==
+                      static_cast<size_t>(DNS::Stage::COUNT),
+              "Every stage needs a name");
+
+std::once_flag s_clockInit;
+double s_nsPerTick = 1.0;
+
+// The TSC is only usable as a clock if it ticks at a constant rate across
+// frequency changes and sleep states (CPUID.80000007H:EDX[8])
+bool invariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0) {
+    return false;
+  }
+  return (edx & (1 << 8)) != 0;
+#else
+  return false;
+#endif
+}
+} // namespace
+
+bool DNS::Clock::s_tsc = false;
+const int DNS::Histogram::SUB_BITS;
+const int DNS::Histogram::MAX_BITS;
+const int DNS::Histogram::BUCKETS;
+
+const char *DNS::stageName(Stage stage) {
+  return STAGE_NAMES[static_cast<int>(stage)];
+}
+
+// Calibrates the TSC against CLOCK_MONOTONIC over ~10ms
+void DNS::Clock::init() {
+  std::call_once(s_clockInit, []() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (!invariantTsc()) {
+      return;
+    }
+    auto startNs = monotonicNs();
+    auto startTicks = __rdtsc();
+    timespec pause{0, 10000000};
+    nanosleep(&pause, nullptr);
+    auto elapsedNs = monotonicNs() - startNs;
+    auto elapsedTicks = __rdtsc() - startTicks;
+    if (elapsedTicks == 0) {
+      return;
+    }
+    s_nsPerTick = double(elapsedNs) / double(elapsedTicks);
+    s_tsc = true;
+#endif
+  });
+}
+
+double DNS::Clock::nsPerTick() {
+  init();
+  return s_nsPerTick;
+}
+
+DNS::StageTimer::StageTimer(bool enabled, Histogram *histograms)
+    : m_enabled(enabled), m_histograms(histograms) {
+  if (m_enabled) {
+    Clock::init();
+  }
+}
+
+void DNS::LatencySummary::merge(const Histogram &histogram) {
+  for (int i = 0; i < Histogram::BUCKETS; i++) {
+    m_buckets[i] += histogram.m_buckets[i].load(std::memory_order_relaxed);
+  }
+}
+
+uint64_t DNS::LatencySummary::count() const {
+  uint64_t total = 0;
+  for (auto bucket : m_buckets) {
+    total += bucket;
+  }
+  return total;
+}
+
+// Walks the buckets up to the rank of the quantile and returns the middle of
+// the bucket it falls in
+double DNS::LatencySummary::percentileNs(double quantile) const {
+  auto total = count();
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(quantile * total);
+  if (rank >= total) {
+    rank = total - 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < Histogram::BUCKETS; i++) {
+    seen += m_buckets[i];
+    if (seen > rank) {
+      double low = Histogram::lowerBound(i);
+      double high = i + 1 < Histogram::BUCKETS ? Histogram::lowerBound(i + 1)
+                                                : low + 1;
+      return (low + high) / 2 * Clock::nsPerTick();
+    }
+  }
+  return Histogram::lowerBound(Histogram::BUCKETS - 1) * Clock::nsPerTick();
+}
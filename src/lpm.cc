@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <lpm.hh>
+#include <sstream>
+#include <stdexcept>
+
+const uint32_t DNS::LpmTable::NONE;
+const uint32_t DNS::LpmTable::CHILD;
+const int DNS::LpmTable::ROOT_SIZE;
+const int DNS::LpmTable::CHUNK_SIZE;
+
+DNS::Prefix DNS::parsePrefix(const std::string &prefix) {
+  Prefix parsed{};
+  auto slash = prefix.find('/');
+  auto address = prefix.substr(0, slash);
+  if (inet_pton(AF_INET, address.c_str(), parsed.m_address) == 1) {
+    parsed.m_bytes = 4;
+  } else if (inet_pton(AF_INET6, address.c_str(), parsed.m_address) == 1) {
+    parsed.m_bytes = 16;
+  } else {
+    std::stringstream message;
+    message << "Prefix: " << prefix << " - Invalid address";
+    throw std::runtime_error(message.str());
+  }
+
+  parsed.m_length = parsed.m_bytes * 8;
+  if (slash != std::string::npos) {
+    auto length = prefix.substr(slash + 1);
+    size_t end = 0;
+    int value = -1;
+    try {
+      value = std::stoi(length, &end);
+    } catch (std::exception &) {
+      end = 0;
+    }
+    if (length.empty() || end != length.size() || value < 0 ||
+        value > parsed.m_length) {
+      std::stringstream message;
+      message << "Prefix: " << prefix << " - Invalid length";
+      throw std::runtime_error(message.str());
+    }
+    parsed.m_length = value;
+  }
+
+  // Clear the host bits, so that 10.1.2.3/8 means 10.0.0.0/8
+  for (int bit = parsed.m_length; bit < parsed.m_bytes * 8; bit++) {
+    parsed.m_address[bit / 8] &= ~(0x80 >> (bit % 8));
+  }
+  return parsed;
+}
+
+// Inserts the prefixes from the shortest to the longest, so that every
+// prefix overwrites the expansion of the shorter prefixes it is nested in
+DNS::LpmTable::LpmTable(int bytes,
+                        std::vector<std::pair<Prefix, uint32_t>> prefixes)
+    : m_bytes(bytes), m_entries(ROOT_SIZE, NONE) {
+  if (bytes != 4 && bytes != 16) {
+    std::stringstream message;
+    message << "Address size: " << bytes << " - Must be 4 or 16 bytes";
+    throw std::runtime_error(message.str());
+  }
+  std::stable_sort(prefixes.begin(), prefixes.end(),
+                   [](const std::pair<Prefix, uint32_t> &a,
+                      const std::pair<Prefix, uint32_t> &b) {
+                     return a.first.m_length < b.first.m_length;
+                   });
+  for (const auto &prefix : prefixes) {
+    if (prefix.first.m_bytes != bytes || prefix.second == NONE ||
+        (prefix.second & CHILD) != 0) {
+      std::stringstream message;
+      message << "Prefix of " << prefix.first.m_bytes << " bytes with value "
+              << prefix.second << " - Does not fit a table of " << bytes
+              << " byte addresses";
+      throw std::runtime_error(message.str());
+    }
+    insert(prefix.first, prefix.second);
+  }
+}
+
+void DNS::LpmTable::insert(const Prefix &prefix, uint32_t value) {
+  const auto *address = prefix.m_address;
+  auto length = prefix.m_length;
+  size_t first = address[0] << 8 | address[1];
+  if (length <= 16) {
+    // Expand into every root entry the prefix covers
+    auto span = size_t(1) << (16 - length);
+    std::fill(m_entries.begin() + (first & ~(span - 1)),
+              m_entries.begin() + (first & ~(span - 1)) + span, value);
+    return;
+  }
+
+  size_t slot = first;
+  int remaining = length - 16;
+  for (int byte = 2;; byte++) {
+    // Descend, splitting the entry into a chunk that inherits its value
+    if ((m_entries[slot] & CHILD) == 0) {
+      auto inherited = m_entries[slot];
+      auto chunk = m_entries.size();
+      m_entries.resize(chunk + CHUNK_SIZE, inherited);
+      m_entries[slot] = static_cast<uint32_t>(chunk) | CHILD;
+    }
+    auto chunk = m_entries[slot] & ~CHILD;
+    if (remaining <= 8) {
+      auto span = size_t(1) << (8 - remaining);
+      auto start = chunk + (address[byte] & ~(span - 1));
+      std::fill(m_entries.begin() + start, m_entries.begin() + start + span,
+                value);
+      return;
+    }
+    slot = chunk + address[byte];
+    remaining -= 8;
+  }
+}
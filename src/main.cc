@@ -1,7 +1,11 @@
 #include <CLI11.hh>
+#include <affinity.hh>
+#include <chrono>
 #include <dnsd.hh>
+#include <housekeeper.hh>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <metrics.hh>
 
 int main(int argc, char **argv) {
   // Declare a new CLI app for help/usage context generation
@@ -12,15 +16,147 @@ int main(int argc, char **argv) {
   app.add_option("-a,--address", address, "IP address to spoof with")
       ->required();
 
+  // Response rate limiting
+  DNS::Config config;
+  auto &rrl = config.m_rrl;
+  app.add_option("--rrl-rate", rrl.m_rate,
+                 "Responses per second per client prefix (0 disables RRL)");
+  app.add_option("--rrl-burst", rrl.m_burst,
+                 "Responses a prefix can burst (default: one second worth)");
+  app.add_option("--rrl-slip", rrl.m_slip,
+                 "Answer every Nth dropped response with TC=1 (0 = never)");
+  app.add_option("--rrl-ipv4-prefix", rrl.m_ipv4Prefix,
+                 "IPv4 prefix length clients are grouped by");
+  app.add_option("--rrl-ipv6-prefix", rrl.m_ipv6Prefix,
+                 "IPv6 prefix length clients are grouped by (at most 56)");
+  app.add_option("--rrl-table-size", rrl.m_tableSize,
+                 "Rate limiting buckets per worker");
+
+  // Split-horizon views
+  std::vector<std::string> views;
+  app.add_option("--view", views,
+                 "Answer clients in these networks from a view of their own: "
+                 "NAME=PREFIX[,PREFIX...][@ADDRESS]");
+  std::vector<std::string> records;
+  app.add_option("--record", records,
+                 "Answer a name from a view (\"default\" for every other "
+                 "client): VIEW:NAME=ADDRESS");
+
+  app.add_option("--soa", config.m_soa,
+                 "Be authoritative for a zone, denying unknown names and "
+                 "types: \"ZONE MNAME RNAME SERIAL REFRESH RETRY EXPIRE "
+                 "MINIMUM\"");
+
+  // Forwarding
+  app.add_option("--forward", config.m_upstreams,
+                 "Forward the names missing from the views to these upstream "
+                 "servers instead of spoofing them: ADDRESS[:PORT]");
+  app.add_option("--upstream-sockets", config.m_upstreamSockets,
+                 "UDP sockets every worker opens to each upstream server");
+  app.add_option("--cache-size", config.m_cacheBytes,
+                 "Bytes of memory the cache of upstream responses takes");
+  app.add_option("--prefetch", config.m_prefetchPercent,
+                 "Refresh cached responses served with less than this "
+                 "percentage of their TTL left (0: never)");
+  app.add_option("--stale-window", config.m_staleSeconds,
+                 "Seconds expired responses are served for when upstreams "
+                 "fail (0: never)");
+  app.add_option("--stale-deadline", config.m_staleDeadlineMs,
+                 "Milliseconds a client waits for upstreams before getting a "
+                 "stale response (0: only once they failed)");
+
+  // Transports
+  bool noTcp = false;
+  app.add_flag("--no-tcp", noTcp, "Only answer queries over UDP");
+  auto tlsCertificate =
+          app.add_option("--tls-cert", config.m_tlsCertificate,
+                         "Serve DNS over TLS with this PEM certificate chain");
+  auto tlsKey = app.add_option("--tls-key", config.m_tlsKey,
+                               "PEM private key of the DNS over TLS "
+                               "certificate");
+  tlsCertificate->needs(tlsKey);
+  tlsKey->needs(tlsCertificate);
+  app.add_option("--tls-port", config.m_tlsPort,
+                 "Port to serve DNS over TLS on");
+
+  // Socket buffers
+  app.add_option("--rcvbuf", config.m_rcvbuf,
+                 "Receive buffer size of every worker socket in bytes");
+  app.add_option("--sndbuf", config.m_sndbuf,
+                 "Send buffer size of every worker socket in bytes");
+
+  // Overload protection
+  app.add_option("--max-queue-delay", config.m_maxQueueDelayMs,
+                 "Drop queries that waited longer than N milliseconds in the "
+                 "socket queue (0 disables)");
+
+  // Observability
+  app.add_flag("--rx-timestamps", config.m_rxTimestamps,
+               "Record how long queries wait in the socket queue");
+  app.add_flag("--stage-timing", config.m_stageTiming,
+               "Record per-stage latency histograms");
+  auto &queryLog = config.m_queryLog;
+  app.add_option("--query-log", queryLog.m_path,
+                 "Write a binary record of every query to this file");
+  app.add_option("--query-log-size", queryLog.m_fileSize,
+                 "Rotate the query log once it reaches N bytes");
+  app.add_option("--query-log-files", queryLog.m_files,
+                 "Query log files to keep, including the current one");
+  app.add_option("--debug-sample", config.m_debugSample,
+                 "Print every Nth query of each worker and its reply to "
+                 "stderr, dig-style (0 disables)");
+  app.add_flag("--debug-json", config.m_debugJson,
+               "Print the sampled queries as JSON lines");
+  unsigned int statsInterval = 0;
+  app.add_option("--stats-interval", statsInterval,
+                 "Print stats to stderr every N seconds (0 disables)");
+  uint16_t metricsPort = 0;
+  app.add_option("--metrics-port", metricsPort,
+                 "Serve Prometheus metrics on this localhost port "
+                 "(0 disables)");
+
+  // Worker placement
+  std::string cpus;
+  app.add_option("--cpus", cpus,
+                 "Run one worker pinned to each CPU in the list (e.g. 2,4-7)");
+  app.add_option("--sched-fifo", config.m_realtimePriority,
+                 "Run workers under SCHED_FIFO with this priority (1-99)");
+  app.add_option("--busy-poll", config.m_busyPollUs,
+                 "Spin on an empty socket for up to N microseconds before "
+                 "sleeping (0 disables)");
+
   // Parse input arguments
   CLI11_PARSE(app, argc, argv);
+  config.m_tcp = !noTcp;
+  if (!cpus.empty()) {
+    config.m_cpus = DNS::parseCpuList(cpus);
+  }
+  for (const auto &view : views) {
+    config.m_views.push_back(DNS::parseView(view));
+  }
+  for (const auto &record : records) {
+    DNS::addRecord(config.m_views, record);
+  }
 
   // Start Daemon (inits resolver and starts server)
-  DNS::Daemon daemon(address);
-  auto serve = [&]() { daemon.run(true); };
-  auto serveThread = std::thread(serve);
+  DNS::Daemon daemon(address, config);
+
+  // Periodically dump stats from the housekeeping thread
+  DNS::Housekeeper housekeeper(config.m_cpus);
+  if (statsInterval > 0) {
+    housekeeper.every(std::chrono::seconds(statsInterval),
+                      [&]() { std::cerr << daemon.stats() << std::endl; });
+  }
+  std::unique_ptr<DNS::MetricsServer> metrics;
+  if (metricsPort > 0) {
+    metrics.reset(new DNS::MetricsServer(metricsPort,
+                                         [&]() { return daemon.stats(); }));
+    housekeeper.watch(metrics->fd(), [&]() { metrics->serve(); });
+  }
+  housekeeper.start();
 
-  // Wait for the daemon to finish
-  serveThread.join();
+  // Wait for the workers to finish
+  daemon.serve();
+  housekeeper.stop();
   return 0;
 } // main()
\ No newline at end of file
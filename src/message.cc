@@ -1,15 +1,45 @@
 #include <arpa/inet.h>
+#include <cstring>
 #include <iostream>
 #include <message.hh>
 #include <ostream>
 #include <sstream>
 #include <stdexcept>
 #include <sys/socket.h>
+#include <utility>
+
+DNS::Labels DNS::toLabels(const std::vector<std::string> &labels,
+                          Arena *arena) {
+  Labels result(arena);
+  result.reserve(labels.size());
+  for (const auto &label : labels) {
+    result.emplace_back(label.data(), label.size(),
+                        ArenaAllocator<char>(arena));
+  }
+  return result;
+}
+
+bool DNS::operator==(const Labels &lhs, const std::vector<std::string> &rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.size(); i++) {
+    if (lhs[i].compare(0, lhs[i].size(), rhs[i].data(), rhs[i].size()) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DNS::operator==(const std::vector<std::string> &lhs, const Labels &rhs) {
+  return rhs == lhs;
+}
 
 // Parses a DNS message from the buffer and the given length
 // Note: This daemon minimally parses only the question & answer sections and
 // ignores the authority records & additional records
-DNS::Message::Message(unsigned char *data, int len) {
+DNS::Message::Message(unsigned char *data, int len, Arena *arena)
+    : m_questions(arena), m_answers(arena) {
   // Check for minimum required size (= Header size)
   if (len < DNS::Default::HDR_SIZE) {
     std::stringstream message;
@@ -22,9 +52,9 @@ DNS::Message::Message(unsigned char *data, int len) {
   // Parse questions
   uint16_t offset = DNS::Default::HDR_SIZE;
   for (int i = 0; i < ntohs(m_hdr.m_qdcount); i++) {
-    Question q(data, offset, len);
-    m_questions.push_back(q);
+    Question q(data, offset, len, arena);
     offset += q.Size();
+    m_questions.push_back(std::move(q));
     if (offset >= len && i < (ntohs(m_hdr.m_qdcount) - 1)) {
       std::stringstream message;
       message << "[QUESTION] Incomplete message. Current offset: " << offset
@@ -43,9 +73,9 @@ DNS::Message::Message(unsigned char *data, int len) {
 
   // Parse answers
   for (int i = 0; i < ntohs(m_hdr.m_ancount); i++) {
-    ResourceRecord rr(data, offset, len);
-    m_answers.push_back(rr);
+    ResourceRecord rr(data, offset, len, arena);
     offset += rr.Size();
+    m_answers.push_back(std::move(rr));
     if (offset >= len && i < (ntohs(m_hdr.m_ancount) - 1)) {
       std::stringstream message;
       message << "[ANSWER] Incomplete message. Current offset: " << offset
@@ -55,12 +85,22 @@ DNS::Message::Message(unsigned char *data, int len) {
   }
 }
 
+// Parses a private copy of the buffer
+DNS::Reply::Reply(const unsigned char *data, int len)
+    : m_wire(new unsigned char[len > 0 ? len : 1]), m_length(len) {
+  if (len > 0) {
+    std::memcpy(m_wire.get(), data, len);
+  }
+  static_cast<Message &>(*this) = Message(m_wire.get(), len);
+}
+
 // Question is built from the offset given.
 // Since the question section is a variable field, this constructor reads from
 // the buffer and follows the algorithm described in RFC1035 to parse domain
 // labels and question type/class.
 DNS::Message::Question::Question(unsigned char *data, uint16_t offset,
-                                 uint16_t msgLength) {
+                                 uint16_t msgLength, Arena *arena)
+    : m_qname(arena) {
   m_size = 0;
   // Label length
   // Start parsing from the offset
@@ -84,18 +124,16 @@ DNS::Message::Question::Question(unsigned char *data, uint16_t offset,
               << " out of bounds. Message length: " << msgLength;
       throw std::runtime_error(message.str());
     }
-    std::string label;
-    for (int i = 0; i < length; i++) {
-      char c = *buffer++;
-      label.append(1, c);
-    }
+    String label(reinterpret_cast<char *>(buffer), length,
+                 ArenaAllocator<char>(arena));
+    buffer += length;
 
     // Add a byte for the length octet for every label
     m_size += 1;
 
     length = *buffer++;
     // Each label is stored as an element in a vector
-    m_qname.push_back(label);
+    m_qname.push_back(std::move(label));
   }
   // Add a byte for the final 0-length octet
   m_size += 1;
@@ -122,7 +160,8 @@ DNS::Message::Question::Question(unsigned char *data, uint16_t offset,
 // RFC1035 to parse domain labels and the other fields.
 DNS::Message::ResourceRecord::ResourceRecord(unsigned char *data,
                                              uint16_t offset,
-                                             uint16_t msgLength) {
+                                             uint16_t msgLength, Arena *arena)
+    : m_name(arena) {
   m_size = 0;
   // Label length
   // Start parsing from the offset
@@ -134,33 +173,73 @@ DNS::Message::ResourceRecord::ResourceRecord(unsigned char *data,
     throw std::runtime_error(message.str());
   }
   // Every domain label length precedes the data
-  int length = *buffer++;
-
-  // End of the NAME field is marked by a 0-length octet
-  while (length != 0) {
-    // Verify offset is within bounds
-    m_size += length;
-    if ((m_size + offset) >= msgLength) {
+  // A name may end with a compression pointer (RFC1035 4.1.4) to labels
+  // earlier in the message. Only the octets up to the first pointer belong to
+  // this record.
+  uint16_t position = offset;
+  bool jumped = false;
+  int nameLength = 0;
+  while (true) {
+    if (position >= msgLength) {
       std::stringstream message;
-      message << "Offset: " << (m_size + offset)
+      message << "Offset: " << position
               << " out of bounds. Message length: " << msgLength;
       throw std::runtime_error(message.str());
     }
-    std::string label;
-    for (int i = 0; i < length; i++) {
-      char c = *buffer++;
-      label.append(1, c);
+    int length = data[position];
+    if ((length & 0xc0) == 0xc0) {
+      if (position + 1 >= msgLength) {
+        std::stringstream message;
+        message << "Offset: " << (position + 1)
+                << " out of bounds. Message length: " << msgLength;
+        throw std::runtime_error(message.str());
+      }
+      if (!jumped) {
+        m_size += 2;
+        jumped = true;
+      }
+      auto target = static_cast<uint16_t>((length & 0x3f) << 8 |
+                                           data[position + 1]);
+      // Pointers may only refer to prior occurrences, which rules out loops
+      if (target >= position) {
+        std::stringstream message;
+        message << "Compression pointer to offset: " << target
+                << " at offset: " << position << " does not point backwards";
+        throw std::runtime_error(message.str());
+      }
+      position = target;
+      continue;
+    }
+    if (length > DNS::Default::MAX_LABEL_LENGTH) {
+      std::stringstream message;
+      message << "Unsupported label length: " << length
+              << " at offset: " << position;
+      throw std::runtime_error(message.str());
+    }
+    if (!jumped) {
+      // Add a byte for the length octet of every label
+      m_size += length + 1;
+    }
+    nameLength += length + 1;
+    if (nameLength > DNS::Default::MAX_DOMAIN_NAME_SIZE) {
+      throw std::runtime_error("NAME exceeds max length (255 octets)");
+    }
+    // End of the NAME field is marked by a 0-length octet
+    if (length == 0) {
+      break;
+    }
+    if (position + 1 + length >= msgLength) {
+      std::stringstream message;
+      message << "Offset: " << (position + 1 + length)
+              << " out of bounds. Message length: " << msgLength;
+      throw std::runtime_error(message.str());
     }
-
-    // Add a byte for the length octet for every label
-    m_size += 1;
-
-    length = *buffer++;
     // Each label is stored as an element in a vector
-    m_name.push_back(label);
+    m_name.push_back(String(reinterpret_cast<char *>(data + position + 1),
+                            length, ArenaAllocator<char>(arena)));
+    position += length + 1;
   }
-  // Add a byte for the final 0-length octet
-  m_size += 1;
+  buffer = data + offset + m_size;
 
   // Check for the TYPE, CLASS, TTL, RDLENGTH bytes
   if ((m_size + offset + 2 + 2 + 4 + 2) > msgLength) {
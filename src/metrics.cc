@@ -0,0 +1,222 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dnsd.hh>
+#include <iostream>
+#include <metrics.hh>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+// Bucket bounds of the exported histograms, in powers of two nanoseconds
+const int MIN_BUCKET_BITS = 7;
+const int MAX_BUCKET_BITS = 30;
+
+void writeHistogram(std::ostream &os, const char *stage,
+                    const DNS::LatencySummary &latency) {
+  auto nsPerTick = DNS::Clock::nsPerTick();
+  uint64_t cumulative = 0;
+  double sumNs = 0;
+  int i = 0;
+  for (int bits = MIN_BUCKET_BITS; bits <= MAX_BUCKET_BITS; bits++) {
+    // Every source bucket whose upper bound fits under the exported bound
+    double boundNs = double(uint64_t(1) << bits);
+    for (; i < DNS::Histogram::BUCKETS; i++) {
+      double low = DNS::Histogram::lowerBound(i);
+      double high = i + 1 < DNS::Histogram::BUCKETS
+                            ? DNS::Histogram::lowerBound(i + 1)
+                            : low + 1;
+      if (high * nsPerTick > boundNs) {
+        break;
+      }
+      cumulative += latency.m_buckets[i];
+      sumNs += latency.m_buckets[i] * (low + high) / 2 * nsPerTick;
+    }
+    os << "dnsd_latency_seconds_bucket{stage=\"" << stage << "\",le=\""
+       << boundNs / 1e9 << "\"} " << cumulative << "\n";
+  }
+  for (; i < DNS::Histogram::BUCKETS; i++) {
+    double low = DNS::Histogram::lowerBound(i);
+    cumulative += latency.m_buckets[i];
+    sumNs += latency.m_buckets[i] * low * nsPerTick;
+  }
+  os << "dnsd_latency_seconds_bucket{stage=\"" << stage << "\",le=\"+Inf\"} "
+     << cumulative << "\n"
+     << "dnsd_latency_seconds_sum{stage=\"" << stage << "\"} " << sumNs / 1e9
+     << "\n"
+     << "dnsd_latency_seconds_count{stage=\"" << stage << "\"} " << cumulative
+     << "\n";
+}
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+// Waits for the (non-blocking) socket to be ready, until the deadline
+// Returns false once it passed, or on errors.
+bool wait(int fd, short events, Deadline deadline) {
+  while (true) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now());
+    if (left.count() <= 0) {
+      return false;
+    }
+    pollfd pfd{fd, events, 0};
+    auto ready = poll(&pfd, 1, static_cast<int>(left.count()));
+    if (ready > 0) {
+      return true;
+    }
+    if (ready < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+// Sends the whole buffer, giving up once the scraper stops reading or the
+// deadline passed
+void sendAll(int fd, const std::string &data, Deadline deadline) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    auto n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n > 0) {
+      sent += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                          errno != EINTR) ||
+               !wait(fd, POLLOUT, deadline)) {
+      return;
+    }
+  }
+}
+
+std::string httpResponse(const char *status, const std::string &body) {
+  std::stringstream response;
+  response << "HTTP/1.1 " << status << "\r\n"
+           << "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "Connection: close\r\n\r\n"
+           << body;
+  return response.str();
+}
+} // namespace
+
+namespace DNS {
+void writePrometheus(std::ostream &os, const Stats &stats) {
+  for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+    auto counter = static_cast<Counter>(i);
+    auto name = counterName(counter);
+    os << "# TYPE dnsd_" << name << "_total counter\n"
+       << "dnsd_" << name << "_total " << stats[counter] << "\n";
+  }
+  bool typed = false;
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+    auto stage = static_cast<Stage>(i);
+    const auto &latency = stats.latency(stage);
+    if (latency.count() == 0) {
+      continue;
+    }
+    if (!typed) {
+      os << "# TYPE dnsd_latency_seconds histogram\n";
+      typed = true;
+    }
+    writeHistogram(os, stageName(stage), latency);
+  }
+}
+} // namespace DNS
+
+DNS::MetricsServer::MetricsServer(uint16_t port, Source source,
+                                  uint32_t address)
+    : m_source(std::move(source)) {
+  m_sockFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_sockFD < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno) << " - Context: socket(TCP)";
+    throw std::runtime_error(message.str());
+  }
+  int reuse = 1;
+  setsockopt(m_sockFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in addr{AF_INET, htons(port), {htonl(address)}};
+  socklen_t len = sizeof(addr);
+  if (bind(m_sockFD, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(m_sockFD, Default::BACKLOG) < 0 ||
+      getsockname(m_sockFD, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno)
+            << " - Context: listen(metrics port " << port << ")";
+    close(m_sockFD);
+    throw std::runtime_error(message.str());
+  }
+  m_port = ntohs(addr.sin_port);
+}
+
+DNS::MetricsServer::~MetricsServer() {
+  close(m_sockFD);
+}
+
+void DNS::MetricsServer::serve() {
+  while (true) {
+    auto clientFD =
+            accept4(m_sockFD, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientFD < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        std::cerr << "What: " << std::strerror(errno)
+                  << " - Context: accept(metrics)" << std::endl;
+      }
+      return;
+    }
+    // One deadline for the whole exchange, however slowly the scraper
+    // trickles its request in, so that housekeeping is never held up for
+    // longer
+    respond(clientFD,
+            std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(Default::METRICS_TIMEOUT_MS));
+    close(clientFD);
+  }
+}
+
+// Reads the request head and answers it, until the deadline
+// Only the request line matters; headers and bodies are ignored
+void DNS::MetricsServer::respond(
+        int clientFD, std::chrono::steady_clock::time_point deadline) {
+  std::string request;
+  char buf[512];
+  while (request.find("\r\n\r\n") == std::string::npos) {
+    if (request.size() >= static_cast<size_t>(Default::METRICS_MAX_REQUEST)) {
+      sendAll(clientFD,
+              httpResponse("431 Request Header Fields Too Large",
+                           "Request too large\n"),
+              deadline);
+      return;
+    }
+    auto n = recv(clientFD, buf, sizeof(buf), 0);
+    if (n > 0) {
+      request.append(buf, n);
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                          errno != EINTR) ||
+               !wait(clientFD, POLLIN, deadline)) {
+      return;
+    }
+  }
+
+  std::stringstream line(request.substr(0, request.find("\r\n")));
+  std::string method, target, version;
+  line >> method >> target >> version;
+  auto path = target.substr(0, target.find('?'));
+  std::string response;
+  if (version.compare(0, 5, "HTTP/") != 0) {
+    response = httpResponse("400 Bad Request", "Bad request\n");
+  } else if (method != "GET") {
+    response = httpResponse("405 Method Not Allowed", "Method not allowed\n");
+  } else if (path != "/metrics") {
+    response = httpResponse("404 Not Found", "Not found\n");
+  } else {
+    std::stringstream body;
+    writePrometheus(body, m_source());
+    response = httpResponse("200 OK", body.str());
+  }
+  sendAll(clientFD, response, deadline);
+}
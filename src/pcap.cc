@@ -0,0 +1,218 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <netinet/in.h>
+#include <pcap.hh>
+#include <sstream>
+#include <stdexcept>
+#include <wire.hh>
+
+namespace {
+// Link types of the captures that can be loaded
+// c.f. https://www.tcpdump.org/linktypes.html
+const uint32_t LINKTYPE_NULL = 0;
+const uint32_t LINKTYPE_ETHERNET = 1;
+const uint32_t LINKTYPE_RAW = 101;
+const uint32_t LINKTYPE_LINUX_SLL = 113;
+const uint32_t LINKTYPE_IPV4 = 228;
+const uint32_t LINKTYPE_IPV6 = 229;
+const uint32_t LINKTYPE_LINUX_SLL2 = 276;
+
+const uint16_t ETHERTYPE_IPV4 = 0x0800;
+const uint16_t ETHERTYPE_IPV6 = 0x86dd;
+const uint16_t ETHERTYPE_VLAN = 0x8100;
+const uint16_t ETHERTYPE_QINQ = 0x88a8;
+
+// Reads pcap (not pcapng) files, in either byte order and timestamp precision
+class PcapReader {
+public:
+  explicit PcapReader(const std::string &path)
+      : m_file(path, std::ios::binary) {
+    if (!m_file) {
+      std::stringstream message;
+      message << "What: " << std::strerror(errno) << " - Context: open("
+              << path << ")";
+      throw std::runtime_error(message.str());
+    }
+    unsigned char header[24];
+    if (!m_file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+      throw std::runtime_error("Pcap: " + path + " - Truncated file header");
+    }
+    uint32_t magic;
+    std::memcpy(&magic, header, sizeof(magic));
+    if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+      m_swapped = false;
+    } else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+      m_swapped = true;
+    } else {
+      throw std::runtime_error("Pcap: " + path +
+                               " - Not a pcap file (pcapng is not supported)");
+    }
+    m_linkType = read32(header + 20) & 0xffff;
+  }
+
+  uint32_t linkType() const { return m_linkType; }
+
+  // Reads the next packet. Returns false at the end of the file.
+  bool next(std::vector<unsigned char> &packet) {
+    unsigned char header[16];
+    if (!m_file.read(reinterpret_cast<char *>(header), sizeof(header))) {
+      return false;
+    }
+    auto captured = read32(header + 8);
+    if (captured > MAX_PACKET) {
+      throw std::runtime_error("Pcap: Corrupt packet header");
+    }
+    packet.resize(captured);
+    if (!m_file.read(reinterpret_cast<char *>(packet.data()), captured)) {
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static const uint32_t MAX_PACKET = 256 * 1024;
+
+  uint32_t read32(const unsigned char *buf) const {
+    uint32_t value;
+    std::memcpy(&value, buf, sizeof(value));
+    return m_swapped ? __builtin_bswap32(value) : value;
+  }
+
+  std::ifstream m_file;
+  bool m_swapped;
+  uint32_t m_linkType;
+};
+
+// Finds the UDP payload of a packet sent to the given port
+// Returns the reason the packet was skipped, or nullptr
+const char *udpPayload(uint32_t linkType,
+                       const std::vector<unsigned char> &packet, uint16_t port,
+                       size_t &offset, int &length) {
+  const unsigned char *data = packet.data();
+  size_t size = packet.size();
+  size_t pos = 0;
+  uint16_t etherType = 0;
+
+  switch (linkType) {
+  case LINKTYPE_NULL:
+    if (size < 4) {
+      return "truncated";
+    }
+    // Host order address family; IPv6 has several values across the BSDs
+    pos = 4;
+    etherType = (data[pos] >> 4) == 6 ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+    break;
+  case LINKTYPE_ETHERNET:
+    if (size < 14) {
+      return "truncated";
+    }
+    etherType = DNS::read16(data + 12);
+    pos = 14;
+    while (etherType == ETHERTYPE_VLAN || etherType == ETHERTYPE_QINQ) {
+      if (size < pos + 4) {
+        return "truncated";
+      }
+      etherType = DNS::read16(data + pos + 2);
+      pos += 4;
+    }
+    break;
+  case LINKTYPE_RAW:
+  case LINKTYPE_IPV4:
+  case LINKTYPE_IPV6:
+    if (size < 1) {
+      return "truncated";
+    }
+    etherType = (data[0] >> 4) == 6 ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+    break;
+  case LINKTYPE_LINUX_SLL:
+    if (size < 16) {
+      return "truncated";
+    }
+    etherType = DNS::read16(data + 14);
+    pos = 16;
+    break;
+  case LINKTYPE_LINUX_SLL2:
+    if (size < 20) {
+      return "truncated";
+    }
+    etherType = DNS::read16(data);
+    pos = 20;
+    break;
+  default:
+    return "unsupported link type";
+  }
+
+  uint8_t protocol;
+  if (etherType == ETHERTYPE_IPV4) {
+    if (size < pos + 20) {
+      return "truncated";
+    }
+    auto headerLength = (data[pos] & 0x0f) * 4;
+    auto fragment = DNS::read16(data + pos + 6);
+    // Only the first fragment carries the UDP header, and a reassembled
+    // query would be an outlier anyway
+    if ((fragment & 0x3fff) != 0) {
+      return "fragment";
+    }
+    protocol = data[pos + 9];
+    pos += headerLength;
+  } else if (etherType == ETHERTYPE_IPV6) {
+    if (size < pos + 40) {
+      return "truncated";
+    }
+    protocol = data[pos + 6];
+    pos += 40;
+    // Skip the common extension headers
+    while (protocol == 0 || protocol == 43 || protocol == 60) {
+      if (size < pos + 2) {
+        return "truncated";
+      }
+      protocol = data[pos];
+      pos += (data[pos + 1] + 1) * 8;
+    }
+    if (protocol == 44) {
+      return "fragment";
+    }
+  } else {
+    return "not ip";
+  }
+
+  if (protocol != IPPROTO_UDP) {
+    return "not udp";
+  }
+  if (size < pos + 8) {
+    return "truncated";
+  }
+  if (DNS::read16(data + pos + 2) != port) {
+    return "other port";
+  }
+  auto udpLength = DNS::read16(data + pos + 4);
+  if (udpLength < 8 || size < pos + udpLength) {
+    return "truncated";
+  }
+  offset = pos + 8;
+  length = udpLength - 8;
+  return nullptr;
+}
+} // namespace
+
+DNS::Capture DNS::loadCapture(const std::string &path, uint16_t port) {
+  Capture capture;
+  PcapReader reader(path);
+  std::vector<unsigned char> packet;
+  while (reader.next(packet)) {
+    size_t offset = 0;
+    int length = 0;
+    auto skipped = udpPayload(reader.linkType(), packet, port, offset, length);
+    if (skipped != nullptr) {
+      capture.m_skipped[skipped]++;
+      continue;
+    }
+    capture.m_payloads.push_back(
+            Capture::Payload{capture.m_data.size(), length});
+    capture.m_data.insert(capture.m_data.end(), packet.begin() + offset,
+                          packet.begin() + offset + length);
+  }
+  return capture;
+}
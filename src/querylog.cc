@@ -0,0 +1,221 @@
+#include <affinity.hh>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <querylog.hh>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+// Records taken from one ring before moving on to the next, so that a busy
+// worker does not starve the others
+const int DRAIN_BATCH = 256;
+const auto IDLE_SLEEP = std::chrono::milliseconds(1);
+
+[[noreturn]] void fail(const std::string &context) {
+  std::stringstream message;
+  message << "What: " << std::strerror(errno) << " - Context: " << context;
+  throw std::runtime_error(message.str());
+}
+} // namespace
+
+DNS::QueryLog::QueryLog(Options options, std::vector<int> workerCpus)
+    : m_options(options), m_workerCpus(workerCpus) {
+  if (m_options.m_fileSize <
+      sizeof(QueryLogHeader) + sizeof(QueryLogRecord)) {
+    std::stringstream message;
+    message << "Query log file size: " << m_options.m_fileSize
+            << " - Smaller than a record";
+    throw std::runtime_error(message.str());
+  }
+  if (m_options.m_files < 1) {
+    std::stringstream message;
+    message << "Query log files: " << m_options.m_files
+            << " - At least one is needed";
+    throw std::runtime_error(message.str());
+  }
+  open();
+  m_thread = std::thread(&QueryLog::writeLoop, this);
+}
+
+DNS::QueryLog::~QueryLog() {
+  stop();
+  for (auto &writer : m_writers) {
+    delete writer.load(std::memory_order_acquire);
+  }
+}
+
+// Like the worker stats, the ring is allocated by the worker itself
+DNS::QueryLog::Writer &DNS::QueryLog::addWriter(WorkerStats &stats) {
+  auto slot = m_writerCount.load(std::memory_order_relaxed);
+  while (slot < Default::MAX_WORKERS &&
+         !m_writerCount.compare_exchange_weak(slot, slot + 1,
+                                              std::memory_order_acq_rel)) {
+  }
+  if (slot >= Default::MAX_WORKERS) {
+    std::stringstream message;
+    message << "Query log writers: " << slot + 1
+            << " - Exceeds the maximum of " << Default::MAX_WORKERS;
+    throw std::runtime_error(message.str());
+  }
+  auto writer = new Writer(m_options.m_ringSize, stats);
+  m_writers[slot].store(writer, std::memory_order_release);
+  return *writer;
+}
+
+void DNS::QueryLog::stop() {
+  if (m_stopping.exchange(true)) {
+    return;
+  }
+  m_thread.join();
+}
+
+void DNS::QueryLog::writeLoop() {
+  try {
+    DNS::avoidCpus(m_workerCpus);
+  } catch (std::exception &e) {
+    std::cerr << "Failed to move the query log writer off the worker CPUs: "
+              << e.what() << std::endl;
+  }
+  while (!m_stopping.load(std::memory_order_acquire)) {
+    if (!drain()) {
+      std::this_thread::sleep_for(IDLE_SLEEP);
+    }
+  }
+  // Whatever the workers queued before the daemon stopped
+  while (drain()) {
+  }
+  close();
+}
+
+// Moves queued records into the file. Returns false if there were none.
+bool DNS::QueryLog::drain() {
+  bool drained = false;
+  auto count = m_writerCount.load(std::memory_order_acquire);
+  for (int i = 0; i < count; i++) {
+    auto writer = m_writers[i].load(std::memory_order_acquire);
+    if (writer == nullptr) {
+      // Registered, but not published yet
+      continue;
+    }
+    auto &ring = writer->m_ring;
+    for (int n = 0; n < DRAIN_BATCH; n++) {
+      auto record = ring.front();
+      if (record == nullptr) {
+        break;
+      }
+      if (m_map != nullptr &&
+          m_size + sizeof(QueryLogRecord) > m_options.m_fileSize) {
+        rotate();
+      }
+      // Records are discarded if the log could not be reopened
+      if (m_map != nullptr) {
+        std::memcpy(m_map + m_size, record, sizeof(QueryLogRecord));
+        m_size += sizeof(QueryLogRecord);
+      }
+      ring.pop();
+      drained = true;
+    }
+  }
+  return drained;
+}
+
+// Creates the current file at its full size and maps it
+// The blocks are allocated up front: stores into a sparse file that the disk
+// has no room left for raise SIGBUS.
+void DNS::QueryLog::open() {
+  m_fd = ::open(m_options.m_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (m_fd < 0) {
+    fail("open(" + m_options.m_path + ")");
+  }
+  auto error = posix_fallocate(m_fd, 0, m_options.m_fileSize);
+  if (error != 0) {
+    ::close(m_fd);
+    m_fd = -1;
+    errno = error;
+    fail("posix_fallocate(" + m_options.m_path + ")");
+  }
+  auto map = mmap(nullptr, m_options.m_fileSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, m_fd, 0);
+  if (map == MAP_FAILED) {
+    ::close(m_fd);
+    m_fd = -1;
+    fail("mmap(" + m_options.m_path + ")");
+  }
+  m_map = static_cast<unsigned char *>(map);
+
+  QueryLogHeader header{QueryLogHeader::MAGIC, sizeof(QueryLogRecord), 0};
+  std::memcpy(m_map, &header, sizeof(header));
+  m_size = sizeof(header);
+}
+
+// Unmaps the current file and trims it to the records it holds
+void DNS::QueryLog::close() {
+  if (m_map != nullptr) {
+    munmap(m_map, m_options.m_fileSize);
+    m_map = nullptr;
+  }
+  if (m_fd >= 0) {
+    if (ftruncate(m_fd, m_size) < 0) {
+      std::cerr << "What: " << std::strerror(errno)
+                << " - Context: ftruncate(" << m_options.m_path << ")"
+                << std::endl;
+    }
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+// Shifts the rotated files by one, dropping the oldest, and starts a new file
+void DNS::QueryLog::rotate() {
+  close();
+  const auto &path = m_options.m_path;
+  for (int i = m_options.m_files - 1; i >= 1; i--) {
+    auto from = i == 1 ? path : path + "." + std::to_string(i - 1);
+    auto to = path + "." + std::to_string(i);
+    if (std::rename(from.c_str(), to.c_str()) < 0 && errno != ENOENT) {
+      std::cerr << "What: " << std::strerror(errno) << " - Context: rename("
+                << from << ", " << to << ")" << std::endl;
+    }
+  }
+  try {
+    open();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+std::vector<DNS::QueryLogRecord>
+DNS::QueryLog::read(const std::string &path) {
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fail("open(" + path + ")");
+  }
+  std::vector<QueryLogRecord> records;
+  QueryLogHeader header;
+  auto n = ::read(fd, &header, sizeof(header));
+  if (n != sizeof(header) || header.m_magic != QueryLogHeader::MAGIC ||
+      header.m_recordSize != sizeof(QueryLogRecord)) {
+    ::close(fd);
+    std::stringstream message;
+    message << "Query log: " << path << " - Not a query log";
+    throw std::runtime_error(message.str());
+  }
+  QueryLogRecord record;
+  while (::read(fd, &record, sizeof(record)) == sizeof(record)) {
+    // The zeroed tail of a file that was not closed cleanly
+    if (record.m_timeNs == 0) {
+      break;
+    }
+    records.push_back(record);
+  }
+  ::close(fd);
+  return records;
+}
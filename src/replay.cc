@@ -0,0 +1,126 @@
+#include <CLI11.hh>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <dnsd.hh>
+#include <iostream>
+#include <map>
+#include <new>
+#include <pcap.hh>
+#include <string>
+#include <wire.hh>
+
+// Replays the DNS queries of a pcap through the daemon's parser and responder,
+// in memory and on a single thread, to measure the userspace cost per query
+// on realistic traffic. No socket is involved.
+
+namespace {
+// Every allocation of the process is counted, so that the replay can report
+// how many the request path performs
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocatedBytes{0};
+
+// Groups parse errors by their message, up to the first detail
+std::string failureKind(const char *what) {
+  std::string kind(what);
+  auto colon = kind.find_first_of(".:");
+  return colon == std::string::npos ? kind : kind.substr(0, colon);
+}
+} // namespace
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  void *ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+// Kept out of line, so that the callers don't see free() release what
+// operator new returned, which -Wmismatched-new-delete reports
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, size_t) noexcept { ::operator delete(ptr); }
+
+int main(int argc, char **argv) {
+  CLI::App app("Replays the DNS queries of a pcap through the daemon, in "
+               "memory");
+
+  std::string path;
+  app.add_option("pcap", path, "Capture to replay")->required();
+  std::string address = "127.0.0.1";
+  app.add_option("-a,--address", address, "IP address to spoof with");
+  uint16_t port = DNS::Default::PORT;
+  app.add_option("--port", port, "Replay the UDP datagrams sent to this port");
+  unsigned int loops = 1;
+  app.add_option("--loops", loops, "Replay the capture this many times");
+  CLI11_PARSE(app, argc, argv);
+
+  DNS::Capture capture;
+  try {
+    capture = DNS::loadCapture(path, port);
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  DNS::Daemon daemon(address);
+  DNS::ResponseBuilder builder(DNS::Default::MAX_UDP_SIZE);
+  std::map<std::string, uint64_t> failures;
+  uint64_t replies = 0;
+  uint64_t replyBytes = 0;
+
+  auto startAllocations = allocations.load();
+  auto startBytes = allocatedBytes.load();
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned int loop = 0; loop < loops; loop++) {
+    for (const auto &payload : capture.m_payloads) {
+      try {
+        DNS::MessageView query(capture.m_data.data() + payload.m_offset,
+                               payload.m_length);
+        builder.begin(query);
+        daemon.answer(query, builder);
+        replies++;
+        replyBytes += builder.size();
+      } catch (std::exception &e) {
+        failures[failureKind(e.what())]++;
+      }
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start);
+  auto spentAllocations = allocations.load() - startAllocations;
+  auto spentBytes = allocatedBytes.load() - startBytes;
+
+  uint64_t packets = uint64_t(capture.m_payloads.size()) * loops;
+  uint64_t failed = packets - replies;
+  std::cout << "packets: " << packets << std::endl;
+  std::cout << "replies: " << replies << std::endl;
+  std::cout << "reply_bytes: " << replyBytes << std::endl;
+  std::cout << "parse_failures: " << failed << std::endl;
+  for (const auto &failure : failures) {
+    std::cout << "  " << failure.first << ": " << failure.second << std::endl;
+  }
+  std::cout << "skipped_packets:" << std::endl;
+  for (const auto &skipped : capture.m_skipped) {
+    std::cout << "  " << skipped.first << ": " << skipped.second << std::endl;
+  }
+  std::cout << "seconds: " << elapsed.count() << std::endl;
+  if (packets > 0 && elapsed.count() > 0) {
+    std::cout << "packets_per_second: "
+              << static_cast<uint64_t>(packets / elapsed.count()) << std::endl;
+    std::cout << "ns_per_packet: " << elapsed.count() * 1e9 / packets
+              << std::endl;
+  }
+  std::cout << "allocations: " << spentAllocations << std::endl;
+  std::cout << "allocated_bytes: " << spentBytes << std::endl;
+  if (packets > 0) {
+    std::cout << "allocations_per_packet: "
+              << static_cast<double>(spentAllocations) / packets << std::endl;
+  }
+  return 0;
+} // main()
@@ -0,0 +1,247 @@
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <resolver.hh>
+#include <sstream>
+#include <stdexcept>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+#include <wire.hh>
+
+namespace {
+const uint16_t BUFFER_SIZE = 4096;
+
+// Compares two questions (QNAME, QTYPE and QCLASS), ignoring the case of the
+// name (resolvers may randomize it, c.f. draft-vixie-dnsext-dns0x20)
+bool sameQuestion(const unsigned char *a, const unsigned char *b, size_t len) {
+  auto nameLength = len - 4;
+  for (size_t i = 0; i < nameLength; i++) {
+    if (DNS::lower(a[i]) != DNS::lower(b[i])) {
+      return false;
+    }
+  }
+  return std::memcmp(a + nameLength, b + nameLength, 4) == 0;
+}
+} // namespace
+
+DNS::Random::Random() {
+  if (getrandom(m_state, sizeof(m_state), 0) != sizeof(m_state)) {
+    std::stringstream message;
+    message << "[CLIENT] What: " << std::strerror(errno)
+            << " - Context: getrandom()";
+    throw std::runtime_error(message.str());
+  }
+  // xorshift must not start from an all-zero state
+  m_state[0] |= 1;
+}
+
+DNS::Resolver::Resolver(sockaddr_in server) : Resolver(server, Options()) {}
+
+// Dials a UDP socket to the server
+// The socket is connected, so the kernel filters out datagrams from any
+// other address
+DNS::Resolver::Resolver(sockaddr_in server, Options options)
+    : m_server(server), m_options(options) {
+  m_sockFD = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (m_sockFD < 0) {
+    std::stringstream message;
+    message << "[CLIENT] What: " << std::strerror(errno)
+            << " - Context: socket(UDP)";
+    throw std::runtime_error(message.str());
+  }
+  if (connect(m_sockFD, reinterpret_cast<sockaddr *>(&m_server),
+              sizeof(m_server)) < 0) {
+    std::stringstream message;
+    message << "[CLIENT] What: " << std::strerror(errno)
+            << " - Context: connect()";
+    close(m_sockFD);
+    throw std::runtime_error(message.str());
+  }
+}
+
+DNS::Resolver::~Resolver() {
+  close(m_sockFD);
+}
+
+void DNS::Resolver::resolve(const std::vector<std::string> &domainLabels,
+                            uint16_t qtype, uint16_t qclass,
+                            Callback callback) {
+  // Add a question
+  DNS::Message query;
+  query.m_hdr.m_qdcount = htons(1);
+  DNS::Message::Question q;
+  q.m_qtype = htons(qtype);
+  q.m_qclass = htons(qclass);
+  q.m_qname = DNS::toLabels(domainLabels);
+  query.m_questions.push_back(q);
+
+  // Serialization throws on invalid labels, before anything is sent
+  std::ostringstream queryBuf;
+  queryBuf << query;
+  auto question = queryBuf.str().substr(DNS::Default::HDR_SIZE);
+  resolve(reinterpret_cast<const unsigned char *>(question.data()),
+          question.size(), std::move(callback));
+}
+
+void DNS::Resolver::resolve(const unsigned char *question, size_t len,
+                            Callback callback) {
+  if (m_pending.size() >= UINT16_MAX) {
+    throw std::runtime_error("[CLIENT] Every query ID is in flight");
+  }
+
+  // Generate query headers
+  DNS::Message::Header hdr{};
+  hdr.m_qdcount = htons(1);
+  hdr.m_rd = 1;
+  do {
+    hdr.m_id = static_cast<uint16_t>(m_random.next());
+  } while (m_pending.count(hdr.m_id) != 0);
+
+  std::string query(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+  query.append(reinterpret_cast<const char *>(question), len);
+  Pending pending{std::move(query), 0, Clock::now() + timeout(0),
+                  std::move(callback)};
+  send(pending);
+  m_timeouts.push(Timeout{pending.m_deadline, hdr.m_id});
+  m_pending.emplace(hdr.m_id, std::move(pending));
+}
+
+std::future<std::unique_ptr<DNS::Reply>>
+DNS::Resolver::resolve(const std::vector<std::string> &domainLabels,
+                       uint16_t qtype, uint16_t qclass) {
+  auto promise = std::make_shared<std::promise<std::unique_ptr<Reply>>>();
+  auto future = promise->get_future();
+  resolve(domainLabels, qtype, qclass, [promise](Result result) {
+    if (result.m_error != 0) {
+      std::stringstream message;
+      message << "[CLIENT] What: " << std::strerror(result.m_error)
+              << " - Context: resolve()";
+      promise->set_exception(
+              std::make_exception_ptr(std::runtime_error(message.str())));
+      return;
+    }
+    promise->set_value(std::move(result.m_reply));
+  });
+  return future;
+}
+
+int DNS::Resolver::poll(int timeoutMs) {
+  int completed = 0;
+
+  // Don't sleep past the next retransmission
+  auto untilNext = nextTimeoutMs();
+  if (untilNext >= 0 && (timeoutMs < 0 || untilNext < timeoutMs)) {
+    timeoutMs = untilNext;
+  }
+  pollfd pfd{m_sockFD, POLLIN, 0};
+  if (::poll(&pfd, 1, timeoutMs) > 0) {
+    // Drain every reply already queued on the socket
+    unsigned char buf[BUFFER_SIZE];
+    while (true) {
+      auto n = recv(m_sockFD, buf, sizeof(buf), 0);
+      if (n < 0) {
+        break;
+      }
+      receive(buf, static_cast<int>(n), completed);
+    }
+  }
+  expire(completed);
+  return completed;
+}
+
+int DNS::Resolver::nextTimeoutMs() const {
+  if (m_timeouts.empty()) {
+    return -1;
+  }
+  auto untilNext = std::chrono::duration_cast<std::chrono::milliseconds>(
+          m_timeouts.top().m_deadline - Clock::now());
+  return untilNext.count() < 0 ? 0 : static_cast<int>(untilNext.count()) + 1;
+}
+
+void DNS::Resolver::drain() {
+  while (!m_pending.empty()) {
+    poll(-1);
+  }
+}
+
+std::chrono::milliseconds DNS::Resolver::timeout(int attempt) const {
+  auto timeoutMs = m_options.m_initialTimeoutMs;
+  for (int i = 0; i < attempt && timeoutMs < m_options.m_maxTimeoutMs; i++) {
+    timeoutMs *= 2;
+  }
+  if (timeoutMs > m_options.m_maxTimeoutMs) {
+    timeoutMs = m_options.m_maxTimeoutMs;
+  }
+  return std::chrono::milliseconds(timeoutMs);
+}
+
+// A failed send is not fatal: the query is retransmitted on its next timeout
+void DNS::Resolver::send(const Pending &pending) {
+  ::send(m_sockFD, pending.m_query.data(), pending.m_query.size(), 0);
+}
+
+// Matches a reply to its query by ID and question, then completes it
+// Replies that match nothing (late duplicates, spoofing attempts) are dropped
+void DNS::Resolver::receive(const unsigned char *buf, int len,
+                            int &completed) {
+  if (len < DNS::Default::HDR_SIZE) {
+    return;
+  }
+  uint16_t id;
+  std::memcpy(&id, buf, sizeof(id));
+  auto iter = m_pending.find(id);
+  if (iter == m_pending.end()) {
+    return;
+  }
+  const auto &query = iter->second.m_query;
+  auto questionLen = query.size() - DNS::Default::HDR_SIZE;
+  if (static_cast<size_t>(len) < query.size() ||
+      !sameQuestion(buf + DNS::Default::HDR_SIZE,
+                    reinterpret_cast<const unsigned char *>(query.data()) +
+                            DNS::Default::HDR_SIZE,
+                    questionLen)) {
+    return;
+  }
+
+  Result result{0, nullptr};
+  try {
+    result.m_reply.reset(new DNS::Reply(buf, len));
+  } catch (std::exception &) {
+    result.m_error = EBADMSG;
+  }
+  auto callback = std::move(iter->second.m_callback);
+  m_pending.erase(iter);
+  completed++;
+  callback(std::move(result));
+}
+
+// Retransmits the queries whose deadline passed, and fails those that ran out
+// of attempts
+void DNS::Resolver::expire(int &completed) {
+  auto now = Clock::now();
+  while (!m_timeouts.empty() && m_timeouts.top().m_deadline <= now) {
+    auto timeout = m_timeouts.top();
+    m_timeouts.pop();
+    auto iter = m_pending.find(timeout.m_id);
+    if (iter == m_pending.end() ||
+        iter->second.m_deadline != timeout.m_deadline) {
+      continue;
+    }
+
+    auto &pending = iter->second;
+    pending.m_attempt++;
+    if (pending.m_attempt < m_options.m_attempts) {
+      pending.m_deadline = now + this->timeout(pending.m_attempt);
+      m_timeouts.push(Timeout{pending.m_deadline, timeout.m_id});
+      send(pending);
+      continue;
+    }
+
+    auto callback = std::move(pending.m_callback);
+    m_pending.erase(iter);
+    completed++;
+    callback(Result{ETIMEDOUT, nullptr});
+  }
+}
@@ -0,0 +1,154 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <netinet/in.h>
+#include <rrl.hh>
+#include <sstream>
+#include <stdexcept>
+#include <wire.hh>
+
+namespace {
+// Layout of a bucket key:
+// [ prefix : 56 ][ unused : 2 ][ used : 1 ][ ipv4 : 1 ][ class : 4 ]
+const uint64_t KEY_USED = 1 << 5;
+const uint64_t KEY_IPV4 = 1 << 4;
+
+// Tokens are accounted in 1/1000th of a response, which lets the refill run
+// at millisecond granularity with integer arithmetic only
+const int64_t TOKEN = 1000;
+const int64_t MAX_BURST = 2000000;
+
+uint64_t prefixMask(int prefix, int width) {
+  if (prefix <= 0) {
+    return 0;
+  }
+  return ~uint64_t(0) << (width - prefix);
+}
+} // namespace
+
+// Constructs a rate limiter and reserves its whole bucket table up front
+DNS::RateLimiter::RateLimiter(const Options &options) : m_options(options) {
+  if (m_options.m_ipv4Prefix < 0 || m_options.m_ipv4Prefix > 32) {
+    std::stringstream message;
+    message << "RRL IPv4 prefix: " << m_options.m_ipv4Prefix
+            << " - Not in range [0, 32]";
+    throw std::runtime_error(message.str());
+  }
+  if (m_options.m_ipv6Prefix < 0 || m_options.m_ipv6Prefix > 56) {
+    std::stringstream message;
+    message << "RRL IPv6 prefix: " << m_options.m_ipv6Prefix
+            << " - Not in range [0, 56]";
+    throw std::runtime_error(message.str());
+  }
+
+  // IPv4 prefixes are kept in the low 32 bits, IPv6 in all 64 bits, of the
+  // prefix field
+  m_ipv4Mask = prefixMask(m_options.m_ipv4Prefix, 32) & 0xffffffff;
+  m_ipv6Mask = prefixMask(m_options.m_ipv6Prefix, 64);
+
+  int64_t burst = m_options.m_burst ? m_options.m_burst : m_options.m_rate;
+  if (burst > MAX_BURST) {
+    burst = MAX_BURST;
+  }
+  m_capacity = burst * TOKEN;
+
+  uint32_t size = 1;
+  m_shift = 64;
+  while (size < m_options.m_tableSize || size < Default::RRL_PROBES) {
+    size <<= 1;
+    m_shift--;
+  }
+  if (enabled()) {
+    m_buckets.assign(size, Bucket{});
+  }
+}
+
+DNS::RateLimiter::Class
+DNS::RateLimiter::classify(const Message::Header &hdr) {
+  if (hdr.m_rcode == Rcode::NXDOMAIN) {
+    return Class::NXDOMAIN;
+  }
+  if (hdr.m_rcode != Rcode::NOERROR) {
+    return Class::ERROR;
+  }
+  return hdr.m_ancount == 0 ? Class::NODATA : Class::ANSWER;
+}
+
+uint64_t DNS::RateLimiter::key(const sockaddr *client, Class cls) const {
+  uint64_t prefix = 0;
+  uint64_t flags = KEY_USED | static_cast<uint64_t>(cls);
+  if (client->sa_family == AF_INET6) {
+    auto addr = reinterpret_cast<const sockaddr_in6 *>(client);
+    uint64_t high;
+    std::memcpy(&high, addr->sin6_addr.s6_addr, sizeof(high));
+    prefix = be64toh(high) & m_ipv6Mask;
+  } else {
+    auto addr = reinterpret_cast<const sockaddr_in *>(client);
+    prefix = (uint64_t(ntohl(addr->sin_addr.s_addr)) & m_ipv4Mask) << 8;
+    flags |= KEY_IPV4;
+  }
+  // The IPv6 mask is at most 56 bits wide, which leaves the low byte free
+  return (prefix & ~uint64_t(0xff)) | flags;
+}
+
+// Accounts a response to the client and decides whether it may be sent
+DNS::RateLimiter::Action DNS::RateLimiter::check(const sockaddr *client,
+                                                 Class cls, uint64_t nowMs) {
+  if (!enabled()) {
+    return Action::PASS;
+  }
+  if (m_epoch == 0) {
+    m_epoch = nowMs;
+  }
+  auto now = static_cast<uint32_t>(nowMs - m_epoch);
+
+  // Fibonacci hashing, then a short linear probe
+  auto k = key(client, cls);
+  auto mask = m_buckets.size() - 1;
+  auto index = (k * 0x9E3779B97F4A7C15ull) >> m_shift;
+  Bucket *bucket = nullptr;
+  Bucket *stalest = nullptr;
+  for (int i = 0; i < Default::RRL_PROBES; i++) {
+    auto &candidate = m_buckets[(index + i) & mask];
+    if (candidate.m_key == k) {
+      bucket = &candidate;
+      break;
+    }
+    if (candidate.m_key == 0) {
+      stalest = &candidate;
+      break;
+    }
+    if (stalest == nullptr ||
+        now - candidate.m_stamp > now - stalest->m_stamp) {
+      stalest = &candidate;
+    }
+  }
+
+  // Unknown prefixes start with a full bucket, recycling the stalest one
+  if (bucket == nullptr) {
+    bucket = stalest;
+    bucket->m_key = k;
+    bucket->m_stamp = now;
+    bucket->m_tokens = static_cast<int32_t>(m_capacity);
+    bucket->m_dropped = 0;
+  }
+
+  // Refill by the elapsed time, capped at the burst size
+  uint32_t elapsed = now - bucket->m_stamp;
+  if (elapsed > 0) {
+    int64_t tokens = bucket->m_tokens + int64_t(elapsed) * m_options.m_rate;
+    bucket->m_tokens =
+            static_cast<int32_t>(tokens > m_capacity ? m_capacity : tokens);
+    bucket->m_stamp = now;
+  }
+
+  if (bucket->m_tokens >= TOKEN) {
+    bucket->m_tokens -= TOKEN;
+    return Action::PASS;
+  }
+
+  bucket->m_dropped++;
+  if (m_options.m_slip != 0 && bucket->m_dropped % m_options.m_slip == 0) {
+    return Action::SLIP;
+  }
+  return Action::DROP;
+}
@@ -0,0 +1,57 @@
+#include <ostream>
+#include <stats.hh>
+
+namespace {
+// Indexed by DNS::Counter
+const char *const COUNTER_NAMES[] = {
+    "queries",        "responses",        "parse_errors",
+    "send_errors",    "rrl_dropped",      "rrl_slipped",
+    "busy_poll_hits", "busy_poll_sleeps", "busy_poll_spin_us",
+    "stale_dropped",  "kernel_drops",     "query_log_dropped",
+    "forwarded",      "cache_hits",       "upstream_errors",
+    "cache_misses",   "cache_evictions",  "prefetches",
+    "coalesced",      "stale_answers",    "tcp_connections",
+    "tls_handshakes", "tls_resumed",      "tls_handshake_errors",
+};
+static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) ==
+                      static_cast<size_t>(DNS::Counter::COUNT),
+              "Every counter needs a name");
+} // namespace
+
+const char *DNS::counterName(Counter counter) {
+  return COUNTER_NAMES[static_cast<int>(counter)];
+}
+
+void DNS::Stats::merge(const WorkerStats &worker) {
+  for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+    m_counters[i] += worker.get(static_cast<Counter>(i));
+  }
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+    m_latency[i].merge(worker.m_latency[i]);
+  }
+}
+
+namespace DNS {
+// Prints one "name: value" line per counter
+std::ostream &operator<<(std::ostream &os, const DNS::Stats &stats) {
+  for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+    auto counter = static_cast<Counter>(i);
+    os << counterName(counter) << ": " << stats[counter] << "\n";
+  }
+  for (int i = 0; i < static_cast<int>(Stage::COUNT); i++) {
+    auto stage = static_cast<Stage>(i);
+    const auto &latency = stats.latency(stage);
+    if (latency.count() == 0) {
+      continue;
+    }
+    auto name = stageName(stage);
+    os << "latency_" << name << "_p50_ns: " << latency.percentileNs(0.5)
+       << "\n"
+       << "latency_" << name << "_p99_ns: " << latency.percentileNs(0.99)
+       << "\n"
+       << "latency_" << name << "_p999_ns: " << latency.percentileNs(0.999)
+       << "\n";
+  }
+  return os;
+}
+} // namespace DNS
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <tcp.hh>
+#include <unistd.h>
+
+namespace {
+// Returns true if the TLS call that returned ret is to be retried once the
+// socket is ready, which is writable rather than readable if wantWrite
+bool retry(SSL *ssl, int ret, bool &wantWrite) {
+  auto error = SSL_get_error(ssl, ret);
+  wantWrite = error == SSL_ERROR_WANT_WRITE;
+  if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+    return true;
+  }
+  if (error != SSL_ERROR_ZERO_RETURN) {
+    // Nothing may be sent on a failed connection, not even a close_notify
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+  }
+  ERR_clear_error();
+  return false;
+}
+} // namespace
+
+DNS::TcpServer::TcpServer(const sockaddr_in &address, Handler handler,
+                          WorkerStats &stats, TimerWheel &timers,
+                          const TlsContext *tls, uint32_t idleTimeoutMs)
+    : m_handler(std::move(handler)), m_stats(stats), m_timers(timers),
+      m_tls(tls), m_idleTimeoutMs(idleTimeoutMs),
+      m_nextStream(tls != nullptr ? TLS_STREAMS | 1 : 1),
+      // Room for a partial message and a read of at least as much
+      m_readBuf(2 * (Default::MAX_TCP_SIZE + 2)),
+      m_builder(Default::MAX_TCP_SIZE) {
+  m_sockFD = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_sockFD < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno) << " - Context: socket(TCP)";
+    throw std::runtime_error(message.str());
+  }
+  int reuse = 1;
+  setsockopt(m_sockFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  setsockopt(m_sockFD, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+
+  auto addr = address;
+  socklen_t len = sizeof(addr);
+  if (bind(m_sockFD, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(m_sockFD, SOMAXCONN) < 0 ||
+      getsockname(m_sockFD, reinterpret_cast<sockaddr *>(&addr), &len) < 0) {
+    std::stringstream message;
+    message << "What: " << std::strerror(errno)
+            << " - Context: listen(TCP port " << ntohs(address.sin_port)
+            << ")";
+    ::close(m_sockFD);
+    throw std::runtime_error(message.str());
+  }
+  m_port = ntohs(addr.sin_port);
+}
+
+DNS::TcpServer::~TcpServer() { ::close(m_sockFD); }
+
+DNS::TcpServer::Connection::~Connection() {
+  if (m_ssl != nullptr) {
+    // The close_notify is best effort, as the socket may not take it
+    if (SSL_is_init_finished(m_ssl)) {
+      SSL_shutdown(m_ssl);
+    }
+    SSL_free(m_ssl);
+    ERR_clear_error();
+  }
+  ::close(m_fd);
+}
+
+void DNS::TcpServer::addPollFDs(std::vector<pollfd> &pollFDs) const {
+  if (m_connections.size() < Default::TCP_MAX_CONNECTIONS) {
+    pollFDs.push_back(pollfd{m_sockFD, POLLIN, 0});
+  }
+  for (const auto &entry : m_connections) {
+    const auto &connection = *entry.second;
+    short events = 0;
+    if (connection.m_handshaking) {
+      events = connection.m_wantWrite ? POLLOUT : POLLIN;
+      pollFDs.push_back(pollfd{connection.m_fd, events, 0});
+      continue;
+    }
+    // Clients that don't read their replies don't get more of them
+    if (!connection.m_eof &&
+        connection.m_output.size() < Default::TCP_MAX_OUTPUT) {
+      events |= POLLIN;
+    }
+    if (!connection.m_output.empty() || connection.m_wantWrite) {
+      events |= POLLOUT;
+    }
+    pollFDs.push_back(pollfd{connection.m_fd, events, 0});
+  }
+}
+
+int DNS::TcpServer::process() {
+  for (auto stream : m_expired) {
+    close(stream);
+  }
+  m_expired.clear();
+  m_pollFDs.clear();
+  addPollFDs(m_pollFDs);
+  if (::poll(m_pollFDs.data(), m_pollFDs.size(), 0) <= 0) {
+    return 0;
+  }
+  // Connections are polled in the order of m_connections, which accept()
+  // changes
+  m_streams.clear();
+  for (const auto &entry : m_connections) {
+    m_streams.push_back(entry.first);
+  }
+  size_t first = m_pollFDs.size() - m_streams.size();
+  if (first > 0 && (m_pollFDs[0].revents & POLLIN) != 0) {
+    accept();
+  }
+
+  int answered = 0;
+  for (size_t i = 0; i < m_streams.size(); i++) {
+    auto revents = m_pollFDs[first + i].revents;
+    if (revents == 0) {
+      continue;
+    }
+    auto &connection = *m_connections.at(m_streams[i]);
+    if (connection.m_handshaking && !handshake(connection)) {
+      reap(connection);
+      continue;
+    }
+    // A TLS read may have to write before it goes on
+    auto readable = (revents & (POLLIN | POLLHUP | POLLERR)) != 0 ||
+                    connection.m_wantWrite;
+    if ((revents & POLLOUT) != 0) {
+      write(connection);
+    }
+    if (readable) {
+      answered += read(connection);
+    }
+    reap(connection);
+  }
+  return answered;
+}
+
+void DNS::TcpServer::accept() {
+  while (m_connections.size() < Default::TCP_MAX_CONNECTIONS) {
+    sockaddr_in peer{};
+    socklen_t len = sizeof(peer);
+    auto fd = accept4(m_sockFD, reinterpret_cast<sockaddr *>(&peer), &len,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        std::cerr << "What: " << std::strerror(errno)
+                  << " - Context: accept(TCP)" << std::endl;
+      }
+      return;
+    }
+    // Replies are coalesced here already
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    auto stream = m_nextStream++;
+    // Idle connections are closed outright: a client that doesn't read its
+    // replies never gets to send the end of its queries
+    auto idle = [this, stream]() { m_expired.push_back(stream); };
+    std::unique_ptr<Connection> connection(
+            new Connection(fd, peer, stream, std::move(idle)));
+    if (m_tls != nullptr) {
+      try {
+        connection->m_ssl = m_tls->accept(fd);
+      } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        continue;
+      }
+      connection->m_handshaking = true;
+    } else {
+      m_stats.add(Counter::TCP_CONNECTIONS);
+    }
+    // Handshakes are bounded by the idle timeout as well
+    rearm(*connection);
+    m_connections.emplace(stream, std::move(connection));
+  }
+}
+
+void DNS::TcpServer::rearm(Connection &connection) {
+  m_timers.schedule(connection.m_idle, m_timers.nowMs() + m_idleTimeoutMs);
+}
+
+bool DNS::TcpServer::handshake(Connection &connection) {
+  auto ret = SSL_do_handshake(connection.m_ssl);
+  if (ret == 1) {
+    connection.m_handshaking = false;
+    connection.m_wantWrite = false;
+    m_stats.add(Counter::TLS_HANDSHAKES);
+    if (SSL_session_reused(connection.m_ssl)) {
+      m_stats.add(Counter::TLS_RESUMED);
+    }
+    return true;
+  }
+  if (!retry(connection.m_ssl, ret, connection.m_wantWrite)) {
+    m_stats.add(Counter::TLS_HANDSHAKE_ERRORS);
+    connection.m_eof = true;
+  }
+  return false;
+}
+
+int DNS::TcpServer::read(Connection &connection) {
+  if (connection.m_eof) {
+    return 0;
+  }
+  auto buf = m_readBuf.data();
+  auto partial = connection.m_partial.size();
+  std::memcpy(buf, connection.m_partial.data(), partial);
+  // There is room for a whole TLS record (16KB at most), so none is left
+  // behind in the TLS connection, where poll() wouldn't see it
+  auto n = receive(connection, buf + partial, m_readBuf.size() - partial);
+  if (n == 0) {
+    return 0;
+  }
+  if (n < 0) {
+    // Replies to the queries read so far are still sent
+    connection.m_eof = true;
+    connection.m_partial.clear();
+    return 0;
+  }
+  rearm(connection);
+
+  // Answer every complete message, and keep the start of the next one
+  int answered = 0;
+  size_t len = partial + n;
+  size_t pos = 0;
+  while (pos + 2 <= len) {
+    size_t size = buf[pos] << 8 | buf[pos + 1];
+    if (pos + 2 + size > len) {
+      break;
+    }
+    auto message = buf + pos + 2;
+    pos += 2 + size;
+    m_stats.add(Counter::QUERIES);
+    auto waiting = false;
+    try {
+      MessageView query(message, static_cast<int>(size));
+      m_builder.begin(query);
+      // The handler may reply right away, from within
+      connection.m_waiting++;
+      waiting = true;
+      if (!m_handler(query, m_builder, connection.m_peer,
+                     connection.m_stream)) {
+        continue;
+      }
+      connection.m_waiting--;
+    } catch (std::exception &e) {
+      // A query that failed gets no reply to wait for
+      if (waiting) {
+        connection.m_waiting--;
+      }
+      m_stats.add(Counter::PARSE_ERRORS);
+      continue;
+    }
+    auto replySize = m_builder.size();
+    m_batch.push_back(static_cast<unsigned char>(replySize >> 8));
+    m_batch.push_back(static_cast<unsigned char>(replySize & 0xff));
+    m_batch.insert(m_batch.end(), m_builder.data(),
+                   m_builder.data() + replySize);
+    m_stats.add(Counter::RESPONSES);
+    answered++;
+  }
+  connection.m_partial.assign(reinterpret_cast<char *>(buf + pos), len - pos);
+  write(connection);
+  return answered;
+}
+
+ssize_t DNS::TcpServer::receive(Connection &connection, unsigned char *buf,
+                                size_t len) {
+  if (connection.m_ssl == nullptr) {
+    auto n = recv(connection.m_fd, buf, len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    }
+    return n > 0 ? n : -1;
+  }
+  connection.m_wantWrite = false;
+  auto n = SSL_read(connection.m_ssl, buf, static_cast<int>(len));
+  if (n > 0) {
+    return n;
+  }
+  return retry(connection.m_ssl, n, connection.m_wantWrite) ? 0 : -1;
+}
+
+void DNS::TcpServer::reply(uint64_t stream, const unsigned char *response,
+                           size_t len) {
+  auto it = m_connections.find(stream);
+  if (it == m_connections.end()) {
+    return;
+  }
+  auto &connection = *it->second;
+  connection.m_waiting--;
+  m_batch.push_back(static_cast<unsigned char>(len >> 8));
+  m_batch.push_back(static_cast<unsigned char>(len & 0xff));
+  m_batch.insert(m_batch.end(), response, response + len);
+  write(connection);
+  reap(connection);
+}
+
+void DNS::TcpServer::write(Connection &connection) {
+  auto &output = connection.m_output;
+  if (output.empty() && m_batch.empty()) {
+    return;
+  }
+  if (connection.m_ssl != nullptr) {
+    if ((SSL_get_shutdown(connection.m_ssl) & SSL_SENT_SHUTDOWN) != 0) {
+      // The connection failed
+      m_batch.clear();
+      return;
+    }
+    // The replies go out in as few records as they fit in
+    output.append(reinterpret_cast<char *>(m_batch.data()), m_batch.size());
+    m_batch.clear();
+    auto sent = sendTls(connection);
+    if (sent < 0) {
+      m_stats.add(Counter::SEND_ERRORS);
+      connection.m_eof = true;
+      output.clear();
+    } else if (sent > 0) {
+      rearm(connection);
+    }
+    return;
+  }
+  iovec iov[2] = {{&output[0], output.size()},
+                  {m_batch.data(), m_batch.size()}};
+  msghdr hdr{};
+  hdr.msg_iov = iov;
+  hdr.msg_iovlen = 2;
+  auto n = sendmsg(connection.m_fd, &hdr, MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      // The client is gone: drop its replies
+      m_stats.add(Counter::SEND_ERRORS);
+      connection.m_eof = true;
+      output.clear();
+      m_batch.clear();
+      return;
+    }
+    n = 0;
+  } else if (n > 0) {
+    // Clients reading their replies are not idle
+    rearm(connection);
+  }
+  // Keep what the client did not take yet
+  size_t written = n;
+  auto fromOutput = std::min(written, output.size());
+  output.erase(0, fromOutput);
+  written -= fromOutput;
+  output.append(reinterpret_cast<char *>(m_batch.data()) + written,
+                m_batch.size() - written);
+  m_batch.clear();
+}
+
+ssize_t DNS::TcpServer::sendTls(Connection &connection) {
+  auto &output = connection.m_output;
+  connection.m_wantWrite = false;
+  size_t sent = 0;
+  while (sent < output.size()) {
+    auto n = SSL_write(connection.m_ssl, &output[sent],
+                       static_cast<int>(output.size() - sent));
+    if (n <= 0) {
+      if (!retry(connection.m_ssl, n, connection.m_wantWrite)) {
+        return -1;
+      }
+      break;
+    }
+    sent += n;
+  }
+  // A write that has to be retried is retried with the same bytes
+  output.erase(0, sent);
+  return sent;
+}
+
+void DNS::TcpServer::reap(Connection &connection) {
+  if (connection.m_eof && connection.m_waiting == 0 &&
+      connection.m_output.empty()) {
+    close(connection.m_stream);
+  }
+}
+
+void DNS::TcpServer::close(uint64_t stream) {
+  m_connections.erase(stream);
+}
@@ -0,0 +1,164 @@
+#include <timer.hh>
+
+const int DNS::TimerWheel::LEVELS;
+const int DNS::TimerWheel::SLOT_BITS;
+const int DNS::TimerWheel::SLOTS;
+const int DNS::TimerWheel::WORD_BITS;
+
+DNS::Timer::~Timer() {
+  if (pending()) {
+    m_wheel->cancel(*this);
+  }
+}
+
+DNS::TimerWheel::TimerWheel(uint64_t nowMs) : m_nextMs(nowMs + 1) {}
+
+// Leaves the timers that outlive the wheel unscheduled
+DNS::TimerWheel::~TimerWheel() {
+  for (auto &level : m_slots) {
+    for (auto &slot : level) {
+      while (slot != nullptr) {
+        unlink(*slot);
+      }
+    }
+  }
+}
+
+void DNS::TimerWheel::schedule(Timer &timer, uint64_t expiresMs) {
+  if (timer.pending()) {
+    timer.m_wheel->cancel(timer);
+  }
+  timer.m_wheel = this;
+  timer.m_expiresMs = expiresMs;
+  insert(timer);
+  m_count++;
+}
+
+void DNS::TimerWheel::cancel(Timer &timer) {
+  if (timer.pending()) {
+    unlink(timer);
+    m_count--;
+  }
+}
+
+// Picks the level by how far ahead of the next tick the timer is, and the
+// slot by the bits of its expiry that level stands for, as in the classic
+// Linux timer wheel
+void DNS::TimerWheel::insert(Timer &timer) {
+  // Timers already due go to the slot of the next tick
+  auto expires = timer.m_expiresMs > m_nextMs ? timer.m_expiresMs : m_nextMs;
+  auto delta = expires - m_nextMs;
+  int level = 0;
+  while (level < LEVELS - 1 &&
+         delta >= uint64_t(1) << (SLOT_BITS * (level + 1))) {
+    level++;
+  }
+  // Beyond the range of the wheel, the timer waits in the last slot it can
+  // reach and gets cascaded again
+  auto maxDelta = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+  if (delta > maxDelta) {
+    expires = m_nextMs + maxDelta;
+  }
+  auto slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+  auto &head = m_slots[level][slot];
+  timer.m_next = head;
+  if (head != nullptr) {
+    head->m_pprev = &timer.m_next;
+  }
+  head = &timer;
+  timer.m_pprev = &head;
+  m_occupied[level][slot / WORD_BITS] |= uint64_t(1) << (slot % WORD_BITS);
+}
+
+void DNS::TimerWheel::unlink(Timer &timer) {
+  *timer.m_pprev = timer.m_next;
+  if (timer.m_next != nullptr) {
+    timer.m_next->m_pprev = timer.m_pprev;
+  }
+  timer.m_next = nullptr;
+  timer.m_pprev = nullptr;
+  // The bit of a slot emptied this way is only cleared once the wheel gets
+  // to the slot
+}
+
+int DNS::TimerWheel::nextSlot(int level, int slot) const {
+  for (int word = slot / WORD_BITS; word < SLOTS / WORD_BITS; word++) {
+    auto bits = m_occupied[level][word];
+    if (word == slot / WORD_BITS) {
+      bits &= ~uint64_t(0) << (slot % WORD_BITS);
+    }
+    if (bits != 0) {
+      return word * WORD_BITS + __builtin_ctzll(bits);
+    }
+  }
+  return -1;
+}
+
+void DNS::TimerWheel::cascade(int level) {
+  auto slot = (m_nextMs >> (SLOT_BITS * level)) & (SLOTS - 1);
+  // Cascade the level above first when this one wraps around as well
+  if (slot == 0 && level + 1 < LEVELS) {
+    cascade(level + 1);
+  }
+  m_occupied[level][slot / WORD_BITS] &= ~(uint64_t(1) << (slot % WORD_BITS));
+  Timer *list = m_slots[level][slot];
+  m_slots[level][slot] = nullptr;
+  while (list != nullptr) {
+    auto &timer = *list;
+    list = timer.m_next;
+    timer.m_next = nullptr;
+    timer.m_pprev = nullptr;
+    insert(timer);
+  }
+}
+
+int DNS::TimerWheel::advance(uint64_t nowMs) {
+  int fired = 0;
+  while (m_nextMs <= nowMs) {
+    auto tick = m_nextMs;
+    auto slot = static_cast<int>(tick & (SLOTS - 1));
+    if (slot == 0) {
+      cascade(1);
+    }
+    auto occupied = nextSlot(0, slot);
+    if (occupied != slot) {
+      // Skip the empty slots, up to the end of the rotation
+      auto skipTo = occupied < 0 ? (tick | (SLOTS - 1)) + 1
+                                 : (tick & ~uint64_t(SLOTS - 1)) + occupied;
+      m_nextMs = skipTo <= nowMs ? skipTo : nowMs + 1;
+      continue;
+    }
+
+    // Detach the slot, so that callbacks can schedule (or cancel timers still
+    // in it) safely
+    m_occupied[0][slot / WORD_BITS] &= ~(uint64_t(1) << (slot % WORD_BITS));
+    Timer *list = m_slots[0][slot];
+    m_slots[0][slot] = nullptr;
+    if (list != nullptr) {
+      list->m_pprev = &list;
+    }
+    m_nextMs = tick + 1;
+    while (list != nullptr) {
+      auto &timer = *list;
+      unlink(timer);
+      m_count--;
+      fired++;
+      timer.m_callback();
+    }
+  }
+  return fired;
+}
+
+int DNS::TimerWheel::timeoutMs(uint64_t nowMs) const {
+  if (m_count == 0) {
+    return -1;
+  }
+  auto tick = m_nextMs;
+  auto slot = static_cast<int>(tick & (SLOTS - 1));
+  // The first tick of a rotation cascades the levels above
+  auto occupied = slot == 0 ? 0 : nextSlot(0, slot);
+  auto due = occupied < 0 ? (tick | (SLOTS - 1)) + 1
+                          : (tick & ~uint64_t(SLOTS - 1)) + occupied;
+  return due <= nowMs ? 0 : static_cast<int>(due - nowMs);
+}
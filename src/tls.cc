@@ -0,0 +1,73 @@
+#include <csignal>
+#include <openssl/err.h>
+#include <sstream>
+#include <stdexcept>
+#include <tls.hh>
+
+namespace {
+// Throws the oldest OpenSSL error of the thread
+void fail(const std::string &context) {
+  char error[256] = "Unknown error";
+  auto code = ERR_get_error();
+  if (code != 0) {
+    ERR_error_string_n(code, error, sizeof(error));
+  }
+  ERR_clear_error();
+  std::stringstream message;
+  message << "What: " << error << " - Context: " << context;
+  throw std::runtime_error(message.str());
+}
+} // namespace
+
+DNS::TlsContext::TlsContext(const std::string &certificateFile,
+                            const std::string &keyFile) {
+  m_ctx = SSL_CTX_new(TLS_server_method());
+  if (m_ctx == nullptr) {
+    fail("SSL_CTX_new()");
+  }
+  try {
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, certificateFile.c_str()) !=
+        1) {
+      fail("SSL_CTX_use_certificate_chain_file(" + certificateFile + ")");
+    }
+    if (SSL_CTX_use_PrivateKey_file(m_ctx, keyFile.c_str(),
+                                    SSL_FILETYPE_PEM) != 1) {
+      fail("SSL_CTX_use_PrivateKey_file(" + keyFile + ")");
+    }
+    if (SSL_CTX_check_private_key(m_ctx) != 1) {
+      fail("SSL_CTX_check_private_key(" + keyFile + ")");
+    }
+  } catch (...) {
+    SSL_CTX_free(m_ctx);
+    throw;
+  }
+  // OpenSSL writes to its sockets with write(), which raises SIGPIPE once
+  // the client is gone rather than failing with EPIPE
+  std::signal(SIGPIPE, SIG_IGN);
+  SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+  // Clients that close without a close_notify still get the replies to the
+  // queries they sent, as over TCP
+  SSL_CTX_set_options(m_ctx, SSL_OP_NO_RENEGOTIATION |
+                                     SSL_OP_IGNORE_UNEXPECTED_EOF);
+  // Stateless tickets only: the server side session cache would be a lock
+  // shared by the workers
+  SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_OFF);
+  SSL_CTX_set_timeout(m_ctx, Default::TLS_SESSION_LIFETIME);
+  // Writes go out record by record from the connection's output, which
+  // moves as it grows, and idle connections give their buffers back
+  SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                  SSL_MODE_RELEASE_BUFFERS);
+}
+
+DNS::TlsContext::~TlsContext() { SSL_CTX_free(m_ctx); }
+
+SSL *DNS::TlsContext::accept(int fd) const {
+  auto ssl = SSL_new(m_ctx);
+  if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1) {
+    SSL_free(ssl);
+    fail("SSL_new()");
+  }
+  SSL_set_accept_state(ssl);
+  return ssl;
+}
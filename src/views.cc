@@ -0,0 +1,202 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <message.hh>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <views.hh>
+#include <wire.hh>
+
+namespace {
+in_addr parseAddress(const std::string &view, const std::string &address) {
+  in_addr parsed;
+  if (inet_pton(AF_INET, address.c_str(), &parsed) != 1) {
+    std::stringstream message;
+    message << "View: " << view << " - Invalid IPv4 address: " << address;
+    throw std::runtime_error(message.str());
+  }
+  return parsed;
+}
+
+// Parses the prefixes of every view for one address family
+// A prefix maps to the index of its view
+std::vector<std::pair<DNS::Prefix, uint32_t>>
+prefixesOf(const std::vector<DNS::ViewConfig> &views, int bytes) {
+  std::vector<std::pair<DNS::Prefix, uint32_t>> prefixes;
+  uint32_t index = 1;
+  for (const auto &view : views) {
+    if (view.m_name == DNS::Default::DEFAULT_VIEW) {
+      continue;
+    }
+    for (const auto &prefix : view.m_prefixes) {
+      auto parsed = DNS::parsePrefix(prefix);
+      if (parsed.m_bytes == bytes) {
+        prefixes.emplace_back(parsed, index);
+      }
+    }
+    index++;
+  }
+  return prefixes;
+}
+} // namespace
+
+uint64_t DNS::NameTable::hash(const unsigned char *wireName, size_t length) {
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ lower(wireName[i])) * 0x100000001b3;
+  }
+  return hash;
+}
+
+void DNS::NameTable::insert(const std::string &name, in_addr address) {
+  auto wire = toWireName(name);
+  // Keep the table at most half full
+  if ((m_count + 1) * 2 > m_entries.size()) {
+    std::vector<Entry> entries(m_entries.empty() ? 16 : m_entries.size() * 2);
+    std::swap(entries, m_entries);
+    m_count = 0;
+    for (auto &entry : entries) {
+      if (!entry.m_name.empty()) {
+        auto mask = m_entries.size() - 1;
+        auto slot = entry.m_hash & mask;
+        while (!m_entries[slot].m_name.empty()) {
+          slot = (slot + 1) & mask;
+        }
+        m_entries[slot] = std::move(entry);
+        m_count++;
+      }
+    }
+  }
+
+  auto h = hash(reinterpret_cast<const unsigned char *>(wire.data()),
+                wire.size());
+  auto mask = m_entries.size() - 1;
+  auto slot = h & mask;
+  while (!m_entries[slot].m_name.empty() && m_entries[slot].m_name != wire) {
+    slot = (slot + 1) & mask;
+  }
+  if (m_entries[slot].m_name.empty()) {
+    m_count++;
+  }
+  m_entries[slot] = Entry{wire, h, address};
+}
+
+const in_addr *DNS::NameTable::find(const unsigned char *wireName,
+                                    size_t length) const {
+  if (m_count == 0) {
+    return nullptr;
+  }
+  auto h = hash(wireName, length);
+  auto mask = m_entries.size() - 1;
+  for (auto slot = h & mask;; slot = (slot + 1) & mask) {
+    const auto &entry = m_entries[slot];
+    if (entry.m_name.empty()) {
+      return nullptr;
+    }
+    if (entry.m_hash != h || entry.m_name.size() != length) {
+      continue;
+    }
+    size_t i = 0;
+    while (i < length &&
+           static_cast<unsigned char>(entry.m_name[i]) == lower(wireName[i])) {
+      i++;
+    }
+    if (i == length) {
+      return &entry.m_address;
+    }
+  }
+}
+
+DNS::ViewConfig DNS::parseView(const std::string &view) {
+  ViewConfig config;
+  auto equals = view.find('=');
+  if (equals == std::string::npos || equals == 0) {
+    std::stringstream message;
+    message << "View: " << view << " - Expected NAME=PREFIX[,PREFIX...]"
+            << "[@ADDRESS]";
+    throw std::runtime_error(message.str());
+  }
+  config.m_name = view.substr(0, equals);
+  auto prefixes = view.substr(equals + 1);
+  auto at = prefixes.find('@');
+  if (at != std::string::npos) {
+    config.m_address = prefixes.substr(at + 1);
+    prefixes = prefixes.substr(0, at);
+  }
+  std::stringstream list(prefixes);
+  std::string prefix;
+  while (std::getline(list, prefix, ',')) {
+    config.m_prefixes.push_back(prefix);
+  }
+  return config;
+}
+
+void DNS::addRecord(std::vector<ViewConfig> &views,
+                    const std::string &record) {
+  auto colon = record.find(':');
+  auto equals = record.find('=', colon == std::string::npos ? 0 : colon);
+  if (colon == std::string::npos || colon == 0 ||
+      equals == std::string::npos) {
+    std::stringstream message;
+    message << "Record: " << record << " - Expected VIEW:NAME=ADDRESS";
+    throw std::runtime_error(message.str());
+  }
+  auto name = record.substr(0, colon);
+  for (auto &view : views) {
+    if (view.m_name == name) {
+      view.m_records.emplace_back(record.substr(colon + 1, equals - colon - 1),
+                                  record.substr(equals + 1));
+      return;
+    }
+  }
+  // No client could reach a view without prefixes: the name is a typo
+  if (name != Default::DEFAULT_VIEW) {
+    std::stringstream message;
+    message << "What: unknown view - Context: " << name;
+    throw std::runtime_error(message.str());
+  }
+  ViewConfig view;
+  view.m_name = name;
+  view.m_records.emplace_back(record.substr(colon + 1, equals - colon - 1),
+                              record.substr(equals + 1));
+  views.push_back(view);
+}
+
+DNS::Views::Views(const std::vector<ViewConfig> &views,
+                  in_addr defaultAddress, bool spoofByDefault)
+    : m_views(1), m_ipv4(4, prefixesOf(views, 4)),
+      m_ipv6(16, prefixesOf(views, 16)) {
+  m_views[0].m_name = Default::DEFAULT_VIEW;
+  m_views[0].m_spoof = spoofByDefault;
+  m_views[0].m_address = defaultAddress;
+
+  std::set<std::string> names;
+  for (const auto &config : views) {
+    if (!names.insert(config.m_name).second) {
+      std::stringstream message;
+      message << "View: " << config.m_name << " - Defined twice";
+      throw std::runtime_error(message.str());
+    }
+    auto isDefault = config.m_name == Default::DEFAULT_VIEW;
+    if (isDefault && !config.m_prefixes.empty()) {
+      std::stringstream message;
+      message << "View: " << config.m_name
+              << " - Serves every other client and takes no prefixes";
+      throw std::runtime_error(message.str());
+    }
+    if (!isDefault) {
+      m_views.emplace_back();
+    }
+    auto &view = isDefault ? m_views[0] : m_views.back();
+    view.m_name = config.m_name;
+    view.m_spoof = spoofByDefault || !config.m_address.empty();
+    view.m_address = config.m_address.empty()
+                             ? defaultAddress
+                             : parseAddress(config.m_name, config.m_address);
+    for (const auto &record : config.m_records) {
+      view.m_names.insert(record.first,
+                          parseAddress(config.m_name, record.second));
+    }
+  }
+}
@@ -0,0 +1,268 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <wire.hh>
+
+namespace {
+// NAME (pointer) + TYPE + CLASS + TTL + RDLENGTH
+const size_t RR_FIXED_SIZE = 2 + 2 + 2 + 4 + 2;
+} // namespace
+
+// Labels are copied one by one, lowercased
+std::string DNS::toWireName(const std::string &name) {
+  std::string wire;
+  size_t start = 0;
+  auto end = name.size();
+  if (end > 0 && name[end - 1] == '.') {
+    end--;
+  }
+  while (start < end) {
+    auto dot = name.find('.', start);
+    if (dot == std::string::npos || dot > end) {
+      dot = end;
+    }
+    auto length = dot - start;
+    if (length == 0 || length > DNS::Default::MAX_LABEL_LENGTH) {
+      std::stringstream message;
+      message << "Name: " << name << " - Invalid label length: " << length;
+      throw std::runtime_error(message.str());
+    }
+    wire.push_back(static_cast<char>(length));
+    for (auto i = start; i < dot; i++) {
+      wire.push_back(static_cast<char>(lower(name[i])));
+    }
+    start = dot + 1;
+  }
+  wire.push_back('\0');
+  if (wire.size() > DNS::Default::MAX_DOMAIN_NAME_SIZE) {
+    std::stringstream message;
+    message << "Name: " << name << " - Exceeds max length (255 octets)";
+    throw std::runtime_error(message.str());
+  }
+  return wire;
+}
+
+size_t DNS::skipName(const unsigned char *msg, size_t len, size_t pos) {
+  while (pos < len) {
+    auto label = msg[pos];
+    if ((label & 0xC0) == 0xC0) {
+      return pos + 2 <= len ? pos + 2 : 0;
+    }
+    if (label > Default::MAX_LABEL_LENGTH) {
+      return 0;
+    }
+    pos += label + 1;
+    if (label == 0) {
+      return pos;
+    }
+  }
+  return 0;
+}
+
+void DNS::copyQuestionKey(const unsigned char *question, size_t nameLength,
+                          unsigned char *key) {
+  for (size_t i = 0; i < nameLength; i++) {
+    key[i] = lower(question[i]);
+  }
+  std::memcpy(key + nameLength, question + nameLength, 4);
+}
+
+// Parses the header and walks the question section
+// Follows the same checks as Message, and additionally rejects compression
+// pointers in QNAME (they can't appear in a query's first name)
+DNS::MessageView::MessageView(const unsigned char *data, int len)
+    : m_data(data), m_length(len > 0 ? len : 0) {
+  if (len < DNS::Default::HDR_SIZE) {
+    std::stringstream message;
+    message << "[HEADER] Incomplete message. Current offset: 0"
+            << "; Actual total: " << len;
+    throw std::runtime_error(message.str());
+  }
+  std::memcpy(&m_hdr, data, sizeof(m_hdr));
+  m_qdcount = ntohs(m_hdr.m_qdcount);
+  if (m_qdcount > Default::MAX_VIEW_QUESTIONS) {
+    std::stringstream message;
+    message << "[QUESTION] QDCOUNT: " << m_qdcount
+            << " exceeds the maximum of " << Default::MAX_VIEW_QUESTIONS;
+    throw std::runtime_error(message.str());
+  }
+
+  uint16_t offset = DNS::Default::HDR_SIZE;
+  for (int i = 0; i < m_qdcount; i++) {
+    auto &q = m_questions[i];
+    q.m_offset = offset;
+    uint16_t nameLength = 0;
+    while (true) {
+      if (offset >= m_length) {
+        std::stringstream message;
+        message << "[QUESTION] Incomplete message. Current offset: " << offset
+                << "; Actual total: " << len;
+        throw std::runtime_error(message.str());
+      }
+      auto length = data[offset];
+      if (length > DNS::Default::MAX_LABEL_LENGTH) {
+        std::stringstream message;
+        message << "[QUESTION] Unsupported label length: "
+                << static_cast<int>(length) << " at offset: " << offset;
+        throw std::runtime_error(message.str());
+      }
+      nameLength += length + 1;
+      offset += length + 1;
+      if (nameLength > DNS::Default::MAX_DOMAIN_NAME_SIZE) {
+        std::stringstream message;
+        message << "[QUESTION] QNAME exceeds max length (255 octets): "
+                << nameLength;
+        throw std::runtime_error(message.str());
+      }
+      if (length == 0) {
+        break;
+      }
+    }
+    if (offset + 4 > m_length) {
+      std::stringstream message;
+      message << "[QUESTION] Incomplete message. Current offset: "
+              << offset + 4 << "; Actual total: " << len;
+      throw std::runtime_error(message.str());
+    }
+    q.m_nameLength = nameLength;
+    q.m_qtype = read16(data + offset);
+    q.m_qclass = read16(data + offset + 2);
+    offset += 4;
+  }
+  m_questionsEnd = offset;
+}
+
+DNS::ResponseBuilder::ResponseBuilder(size_t capacity)
+    : m_buf(new unsigned char[capacity]), m_capacity(capacity) {
+  if (m_capacity < DNS::Default::HDR_SIZE) {
+    std::stringstream message;
+    message << "Capacity: " << capacity << " - Smaller than a header";
+    throw std::runtime_error(message.str());
+  }
+}
+
+DNS::ResponseBuilder::ResponseBuilder(ResponseBuilder &&other) noexcept
+    : m_buf(std::move(other.m_buf)), m_capacity(other.m_capacity),
+      m_size(other.m_size), m_questionsEnd(other.m_questionsEnd),
+      m_section(other.m_section), m_qdcount(other.m_qdcount) {
+  std::memcpy(m_offsets, other.m_offsets, sizeof(m_offsets));
+  other.m_capacity = 0;
+  other.m_size = 0;
+  other.m_questionsEnd = 0;
+  other.m_qdcount = 0;
+}
+
+DNS::ResponseBuilder &
+DNS::ResponseBuilder::operator=(ResponseBuilder &&other) noexcept {
+  m_buf = std::move(other.m_buf);
+  m_capacity = other.m_capacity;
+  m_size = other.m_size;
+  m_questionsEnd = other.m_questionsEnd;
+  m_section = other.m_section;
+  m_qdcount = other.m_qdcount;
+  std::memcpy(m_offsets, other.m_offsets, sizeof(m_offsets));
+  other.m_capacity = 0;
+  other.m_size = 0;
+  other.m_questionsEnd = 0;
+  other.m_qdcount = 0;
+  return *this;
+}
+
+void DNS::ResponseBuilder::begin(const MessageView &query) {
+  auto questionsEnd = query.questionsEnd();
+  if (questionsEnd > m_capacity) {
+    // Not even the questions fit: answer with a bare, truncated header
+    questionsEnd = DNS::Default::HDR_SIZE;
+  }
+  std::memcpy(m_buf.get(), query.data(), questionsEnd);
+  m_size = questionsEnd;
+  m_questionsEnd = questionsEnd;
+  m_section = Section::ANSWER;
+  // The questions are at the same offsets in the response as in the query
+  m_qdcount = questionsEnd == DNS::Default::HDR_SIZE ? 0 : query.qdcount();
+  for (int i = 0; i < m_qdcount; i++) {
+    m_offsets[i] = query.question(i).m_offset;
+  }
+
+  auto &hdr = header();
+  hdr.m_qr = 1;
+  hdr.m_aa = 0;
+  hdr.m_tc = 0;
+  hdr.m_ra = 0;
+  hdr.m_z = 0;
+  hdr.m_ad = 0;
+  hdr.m_rcode = 0;
+  hdr.m_ancount = 0;
+  hdr.m_nscount = 0;
+  hdr.m_arcount = 0;
+  if (questionsEnd == DNS::Default::HDR_SIZE) {
+    hdr.m_qdcount = 0;
+    hdr.m_tc = query.qdcount() > 0;
+  }
+}
+
+bool DNS::ResponseBuilder::add(Section section, int question, uint16_t type,
+                               uint16_t cls, uint32_t ttl, const void *rdata,
+                               uint16_t rdLength) {
+  if (question < 0 || question >= m_qdcount) {
+    throw std::out_of_range("No such question in the response");
+  }
+  if (!reserve(section, RR_FIXED_SIZE + rdLength)) {
+    return false;
+  }
+  auto buf = m_buf.get();
+  auto rr = buf + m_size;
+  write16(rr, 0xc000 | m_offsets[question]);
+  write16(rr + 2, type);
+  write16(rr + 4, cls);
+  write32(rr + 6, ttl);
+  write16(rr + 10, rdLength);
+  std::memcpy(rr + RR_FIXED_SIZE, rdata, rdLength);
+  m_size += RR_FIXED_SIZE + rdLength;
+  count(section, 1);
+  return true;
+}
+
+bool DNS::ResponseBuilder::addRaw(Section section, const void *records,
+                                  size_t len, uint16_t count) {
+  if (!reserve(section, len)) {
+    return false;
+  }
+  std::memcpy(m_buf.get() + m_size, records, len);
+  m_size += len;
+  this->count(section, count);
+  return true;
+}
+
+void DNS::ResponseBuilder::truncate() {
+  m_size = m_questionsEnd;
+  m_section = Section::ANSWER;
+  auto &hdr = header();
+  hdr.m_tc = 1;
+  hdr.m_ancount = 0;
+  hdr.m_nscount = 0;
+  hdr.m_arcount = 0;
+}
+
+// Checks that len more bytes fit, and that sections are appended in order
+bool DNS::ResponseBuilder::reserve(Section section, size_t len) {
+  if (section < m_section) {
+    throw std::logic_error("Records must be added section by section");
+  }
+  m_section = section;
+  if (m_size + len > m_capacity) {
+    header().m_tc = 1;
+    return false;
+  }
+  return true;
+}
+
+void DNS::ResponseBuilder::count(Section section, uint16_t count) {
+  auto &hdr = header();
+  auto &field = section == Section::ANSWER      ? hdr.m_ancount
+                : section == Section::AUTHORITY ? hdr.m_nscount
+                                                : hdr.m_arcount;
+  field = htons(ntohs(field) + count);
+}
@@ -0,0 +1,68 @@
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <wire.hh>
+#include <zone.hh>
+
+namespace {
+void append16(std::string &buf, uint16_t value) {
+  buf.push_back(static_cast<char>(value >> 8));
+  buf.push_back(static_cast<char>(value & 0xff));
+}
+
+void append32(std::string &buf, uint32_t value) {
+  append16(buf, value >> 16);
+  append16(buf, value & 0xffff);
+}
+} // namespace
+
+DNS::Zone::Zone(const std::string &soa) {
+  std::stringstream fields(soa);
+  std::string zone, mname, rname;
+  uint32_t numbers[5];
+  fields >> zone >> mname >> rname;
+  for (auto &number : numbers) {
+    fields >> number;
+  }
+  std::string rest;
+  if (!fields || (fields >> rest)) {
+    std::stringstream message;
+    message << "SOA: " << soa << " - Expected ZONE MNAME RNAME SERIAL "
+            << "REFRESH RETRY EXPIRE MINIMUM";
+    throw std::runtime_error(message.str());
+  }
+  m_apex = toWireName(zone);
+  m_primary = toWireName(mname);
+
+  std::string rdata = m_primary + toWireName(rname);
+  for (auto number : numbers) {
+    append32(rdata, number);
+  }
+  auto minimum = numbers[4];
+  m_soaRecord = m_apex;
+  append16(m_soaRecord, Type::SOA);
+  append16(m_soaRecord, CLASS_IN);
+  append32(m_soaRecord, minimum);
+  append16(m_soaRecord, static_cast<uint16_t>(rdata.size()));
+  m_soaRecord += rdata;
+}
+
+// Walks the labels of the name until what is left is as long as the apex
+// The name must be valid (as MessageView guarantees), so the walk ends on
+// its last label at the latest
+bool DNS::Zone::contains(const unsigned char *wireName, size_t length) const {
+  size_t offset = 0;
+  while (length - offset > m_apex.size()) {
+    offset += wireName[offset] + 1;
+  }
+  if (length - offset != m_apex.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < m_apex.size(); i++) {
+    if (lower(wireName[offset + i]) !=
+        static_cast<unsigned char>(m_apex[i])) {
+      return false;
+    }
+  }
+  return true;
+}
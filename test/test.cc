@@ -1,15 +1,37 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
+#include <functional>
 #include <iterator>
+#include <map>
+#include <memory>
 #include <netinet/in.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
 #include <sstream>
 #include <string>
 #define CATCH_CONFIG_MAIN
 
+#include <affinity.hh>
+#include <atomic>
 #include <catch.hh>
 #include <client.hh>
+#include <format.hh>
+#include <housekeeper.hh>
+#include <wire.hh>
 #include <iostream>
+#include <metrics.hh>
+#include <pcap.hh>
+#include <pipeline.hh>
+#include <poll.h>
 #include <pthread.h>
+#include <querylog.hh>
 #include <stdexcept>
+#include <timer.hh>
 #include <vector>
 
 TEST_CASE("DNS daemon should be initialized with a valid IPv4 address") {
@@ -92,8 +114,14 @@ void *daemonRunner(void *arg) {
   return nullptr;
 }
 
-DNS::Message *queryDaemon(std::string address,
-                          std::vector<std::string> domainLabels) {
+void *daemonServer(void *arg) {
+  DNS::Daemon *daemon = reinterpret_cast<DNS::Daemon *>(arg);
+  daemon->serve();
+  return nullptr;
+}
+
+std::unique_ptr<DNS::Reply>
+queryDaemon(std::string address, std::vector<std::string> domainLabels) {
 
   DNS::Daemon daemon(address);
   // Using pthreads over std::thread due to incompatibility with Catch2
@@ -278,4 +306,2022 @@ TEST_CASE("Test for invalid message octet lengths") {
 
     REQUIRE_THROWS(DNS::query(srvAddr, domainLabels, 1, 1));
   }
-}
\ No newline at end of file
+}
+TEST_CASE("Messages are allocated from the worker arena") {
+  // Query for www.meter.com (A, IN)
+  unsigned char query[] = {0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00,
+                           0x00, 0x00, 0x00, 0x00, 0x03, 'w',  'w',  'w',
+                           0x05, 'm',  'e',  't',  'e',  'r',  0x03, 'c',
+                           'o',  'm',  0x00, 0x00, 0x01, 0x00, 0x01};
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+
+  SECTION("Parsed labels are backed by the arena") {
+    DNS::Arena arena;
+    {
+      DNS::Message msg(query, sizeof(query), &arena);
+      REQUIRE(msg.m_questions.size() == 1);
+      CHECK(msg.m_questions[0].m_qname == domainLabels);
+      CHECK(msg.m_questions[0].m_qname.get_allocator().m_arena == &arena);
+
+      // Copies stay in the same arena
+      DNS::Message reply = msg;
+      CHECK(reply.m_questions[0].m_qname.get_allocator().m_arena == &arena);
+    }
+    CHECK(arena.used() > 0);
+    arena.reset();
+    CHECK(arena.used() == 0);
+  }
+
+  SECTION("Steady state serving does not grow the arena") {
+    DNS::Arena arena;
+    size_t capacity = 0;
+    for (int i = 0; i < 1000; i++) {
+      {
+        DNS::Message msg(query, sizeof(query), &arena);
+        DNS::Message reply = msg;
+        DNS::Message::ResourceRecord rr(&arena);
+        rr.m_name = reply.m_questions[0].m_qname;
+        reply.m_answers.push_back(rr);
+      }
+      if (i == 0) {
+        capacity = arena.capacity();
+      }
+      arena.reset();
+    }
+    CHECK(arena.capacity() == capacity);
+  }
+
+  SECTION("Allocations larger than a block are served") {
+    DNS::Arena arena(64);
+    auto ptr = arena.allocate(1024, 8);
+    REQUIRE(ptr != nullptr);
+    CHECK(reinterpret_cast<uintptr_t>(ptr) % 8 == 0);
+    CHECK(arena.used() >= 1024);
+    arena.reset();
+    CHECK(arena.used() == 0);
+  }
+}
+
+TEST_CASE("Response rate limiting by client prefix") {
+  DNS::RateLimiter::Options options;
+  options.m_rate = 10;
+  options.m_slip = 2;
+  options.m_tableSize = 16;
+  DNS::RateLimiter rrl(options);
+  REQUIRE(rrl.enabled());
+
+  sockaddr_in client{};
+  client.sin_family = AF_INET;
+  inet_pton(AF_INET, "10.1.2.3", &client.sin_addr);
+  sockaddr_in neighbour = client;
+  inet_pton(AF_INET, "10.1.2.200", &neighbour.sin_addr);
+  sockaddr_in other = client;
+  inet_pton(AF_INET, "10.1.3.3", &other.sin_addr);
+  auto answer = DNS::RateLimiter::Class::ANSWER;
+  uint64_t now = 1000;
+
+  SECTION("A prefix is limited once its burst is spent") {
+    for (int i = 0; i < 10; i++) {
+      CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) ==
+            DNS::RateLimiter::Action::PASS);
+    }
+    // Same /24, so the bucket is shared
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&neighbour), answer, now) ==
+          DNS::RateLimiter::Action::DROP);
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) ==
+          DNS::RateLimiter::Action::SLIP);
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) ==
+          DNS::RateLimiter::Action::DROP);
+
+    // Other prefixes and other response classes are unaffected
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&other), answer, now) ==
+          DNS::RateLimiter::Action::PASS);
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client),
+                    DNS::RateLimiter::Class::NXDOMAIN,
+                    now) == DNS::RateLimiter::Action::PASS);
+  }
+
+  SECTION("Buckets refill over time") {
+    for (int i = 0; i < 10; i++) {
+      rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now);
+    }
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) !=
+          DNS::RateLimiter::Action::PASS);
+    // 10 responses per second = 1 response per 100ms
+    now += 100;
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) ==
+          DNS::RateLimiter::Action::PASS);
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client), answer, now) !=
+          DNS::RateLimiter::Action::PASS);
+  }
+
+  SECTION("IPv6 clients are grouped by /56") {
+    sockaddr_in6 client6{};
+    client6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8:0:100::1", &client6.sin6_addr);
+    sockaddr_in6 neighbour6 = client6;
+    inet_pton(AF_INET6, "2001:db8:0:1ff::1", &neighbour6.sin6_addr);
+    for (int i = 0; i < 10; i++) {
+      CHECK(rrl.check(reinterpret_cast<sockaddr *>(&client6), answer, now) ==
+            DNS::RateLimiter::Action::PASS);
+    }
+    CHECK(rrl.check(reinterpret_cast<sockaddr *>(&neighbour6), answer, now) !=
+          DNS::RateLimiter::Action::PASS);
+  }
+
+  SECTION("Disabled by default") {
+    DNS::RateLimiter disabled{DNS::RateLimiter::Options()};
+    CHECK_FALSE(disabled.enabled());
+    CHECK(disabled.check(reinterpret_cast<sockaddr *>(&client), answer, now) ==
+          DNS::RateLimiter::Action::PASS);
+  }
+}
+
+TEST_CASE("Log-linear latency histograms") {
+  SECTION("Buckets are contiguous and monotonic") {
+    bool contiguous = true;
+    for (uint64_t value = 0; value < 100000; value++) {
+      auto index = DNS::Histogram::index(value);
+      contiguous = contiguous && index < DNS::Histogram::BUCKETS &&
+                   DNS::Histogram::lowerBound(index) <= value &&
+                   DNS::Histogram::lowerBound(index + 1) > value;
+    }
+    CHECK(contiguous);
+    CHECK(DNS::Histogram::index(~uint64_t(0)) == DNS::Histogram::BUCKETS - 1);
+  }
+
+  SECTION("Percentiles are merged across workers") {
+    std::unique_ptr<DNS::WorkerStats> first(new DNS::WorkerStats());
+    std::unique_ptr<DNS::WorkerStats> second(new DNS::WorkerStats());
+    auto parse = static_cast<int>(DNS::Stage::PARSE);
+    for (int i = 0; i < 990; i++) {
+      first->m_latency[parse].record(1000);
+    }
+    for (int i = 0; i < 10; i++) {
+      second->m_latency[parse].record(1000000);
+    }
+    DNS::Stats stats;
+    stats.merge(*first);
+    stats.merge(*second);
+    const auto &latency = stats.latency(DNS::Stage::PARSE);
+    auto nsPerTick = DNS::Clock::nsPerTick();
+    CHECK(latency.count() == 1000);
+    CHECK(latency.percentileNs(0.5) == Approx(1000 * nsPerTick).epsilon(0.05));
+    CHECK(latency.percentileNs(0.999) ==
+          Approx(1000000 * nsPerTick).epsilon(0.05));
+    CHECK(stats.latency(DNS::Stage::SEND).count() == 0);
+  }
+}
+
+TEST_CASE("Worker placement") {
+  SECTION("CPU lists") {
+    CHECK(DNS::parseCpuList("3") == std::vector<int>{3});
+    CHECK(DNS::parseCpuList("0,2,4-6") == std::vector<int>{0, 2, 4, 5, 6});
+    CHECK_THROWS_AS(DNS::parseCpuList(""), std::runtime_error);
+    CHECK_THROWS_AS(DNS::parseCpuList("1,,2"), std::runtime_error);
+    CHECK_THROWS_AS(DNS::parseCpuList("4-2"), std::runtime_error);
+    CHECK_THROWS_AS(DNS::parseCpuList("a"), std::runtime_error);
+    CHECK_THROWS_AS(DNS::parseCpuList("-1"), std::runtime_error);
+  }
+
+  SECTION("Pinned workers serve queries") {
+    DNS::Config config;
+    config.m_cpus = {0};
+    DNS::Daemon daemon("9.9.9.9", config);
+    pthread_t thread_id;
+    pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+    sockaddr_in srvAddr{
+        AF_INET,
+        htons(DNS::Default::PORT),
+        htonl(DNS::Default::ADDRESS),
+    };
+    std::vector<std::string> domainLabels{"www", "meter", "com"};
+    auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+    daemon.stop();
+    pthread_join(thread_id, nullptr);
+
+    CHECK(reply->m_answers.size() == 1);
+    CHECK(daemon.stats()[DNS::Counter::RESPONSES] == 1);
+  }
+
+  SECTION("Housekeeping runs periodic tasks") {
+    std::atomic<int> runs{0};
+    DNS::Housekeeper housekeeper;
+    housekeeper.every(std::chrono::milliseconds(1), [&]() { runs++; });
+    housekeeper.start();
+    while (runs < 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    housekeeper.stop();
+    CHECK(runs >= 3);
+  }
+}
+
+TEST_CASE("Busy polling workers spin before sleeping") {
+  DNS::Config config;
+  config.m_busyPollUs = 1000;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  for (int i = 0; i < 2; i++) {
+    // Let the worker run out of budget and go to sleep
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+    CHECK(reply->m_answers.size() == 1);
+  }
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+
+  auto stats = daemon.stats();
+  CHECK(stats[DNS::Counter::RESPONSES] == 2);
+  CHECK(stats[DNS::Counter::BUSY_POLL_SLEEPS] >= 2);
+  CHECK(stats[DNS::Counter::BUSY_POLL_SPIN_US] >= 2000);
+}
+
+TEST_CASE("Kernel receive timestamps measure the queue delay") {
+  DNS::Config config;
+  config.m_maxQueueDelayMs = 1000;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+
+  auto stats = daemon.stats();
+  CHECK(reply->m_answers.size() == 1);
+  CHECK(stats[DNS::Counter::STALE_DROPPED] == 0);
+  CHECK(stats.latency(DNS::Stage::QUEUE).count() == 1);
+  CHECK(stats.latency(DNS::Stage::QUEUE).percentileNs(0.5) < 1e9);
+}
+
+TEST_CASE("Kernel drops are read from every receive") {
+  DNS::Config config;
+  config.m_rcvbuf = 4096;
+  config.m_sndbuf = 4096;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+
+  CHECK(reply->m_answers.size() == 1);
+  CHECK(daemon.stats()[DNS::Counter::KERNEL_DROPS] == 0);
+}
+
+TEST_CASE("Pipelined asynchronous resolver") {
+  DNS::Daemon daemon("9.9.9.9");
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  DNS::Resolver resolver(srvAddr);
+
+  SECTION("Many queries in flight complete through callbacks") {
+    int answered = 0;
+    for (int i = 0; i < 200; i++) {
+      std::vector<std::string> domainLabels{"host" + std::to_string(i),
+                                            "meter", "com"};
+      resolver.resolve(domainLabels, 1, 1,
+                       [&answered, domainLabels](DNS::Resolver::Result r) {
+                         REQUIRE(r.m_error == 0);
+                         CHECK(r.m_reply->m_questions[0].m_qname ==
+                               domainLabels);
+                         answered++;
+                       });
+    }
+    CHECK(resolver.inflight() == 200);
+    resolver.drain();
+    CHECK(answered == 200);
+  }
+
+  SECTION("Futures") {
+    std::vector<std::string> domainLabels{"www", "meter", "com"};
+    auto first = resolver.resolve(domainLabels, 1, 1);
+    auto second = resolver.resolve(domainLabels, 1, 1);
+    resolver.drain();
+    CHECK(first.get()->m_answers.size() == 1);
+    CHECK(second.get()->m_answers.size() == 1);
+  }
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Resolver retransmits and gives up on silent servers") {
+  // Nothing listens on this port
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(5353),
+      htonl(INADDR_LOOPBACK),
+  };
+  DNS::Resolver::Options options;
+  options.m_attempts = 3;
+  options.m_initialTimeoutMs = 10;
+  DNS::Resolver resolver(srvAddr, options);
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  auto reply = resolver.resolve(domainLabels, 1, 1);
+  auto start = std::chrono::steady_clock::now();
+  resolver.drain();
+  // 10ms + 20ms + 40ms
+  CHECK(std::chrono::steady_clock::now() - start >=
+        std::chrono::milliseconds(70));
+  CHECK_THROWS_AS(reply.get(), std::runtime_error);
+}
+
+TEST_CASE("Responses are built in place from a message view") {
+  // Query for www.meter.com (A, IN) with RD and AD set
+  unsigned char query[] = {0x12, 0x34, 0x01, 0x20, 0x00, 0x01, 0x00, 0x00,
+                           0x00, 0x00, 0x00, 0x00, 0x03, 'w',  'w',  'w',
+                           0x05, 'm',  'e',  't',  'e',  'r',  0x03, 'c',
+                           'o',  'm',  0x00, 0x00, 0x01, 0x00, 0x01};
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  uint32_t address = htonl(0x09090909);
+
+  SECTION("Views point into the query") {
+    DNS::MessageView view(query, sizeof(query));
+    REQUIRE(view.qdcount() == 1);
+    CHECK(view.questionsEnd() == sizeof(query));
+    CHECK(view.question(0).m_offset == DNS::Default::HDR_SIZE);
+    CHECK(view.question(0).m_nameLength == 15);
+    CHECK(view.question(0).m_qtype == 1);
+    CHECK(view.question(0).m_qclass == 1);
+    CHECK(view.name(0) == query + DNS::Default::HDR_SIZE);
+  }
+
+  SECTION("Malformed queries are rejected") {
+    CHECK_THROWS_AS(DNS::MessageView(query, 8), std::runtime_error);
+    CHECK_THROWS_AS(DNS::MessageView(query, sizeof(query) - 1),
+                    std::runtime_error);
+    unsigned char pointer[sizeof(query)];
+    std::memcpy(pointer, query, sizeof(query));
+    pointer[DNS::Default::HDR_SIZE] = 0xc0;
+    CHECK_THROWS_AS(DNS::MessageView(pointer, sizeof(pointer)),
+                    std::runtime_error);
+  }
+
+  SECTION("Answers point back at the question") {
+    DNS::MessageView view(query, sizeof(query));
+    DNS::ResponseBuilder builder;
+    builder.begin(view);
+    REQUIRE(builder.add(DNS::ResponseBuilder::Section::ANSWER, 0, 1, 1, 180,
+                        &address, 4));
+    CHECK(builder.size() == sizeof(query) + 16);
+    CHECK(builder.data()[sizeof(query)] == 0xc0);
+    CHECK(builder.data()[sizeof(query) + 1] == DNS::Default::HDR_SIZE);
+    CHECK_THROWS_AS(builder.add(DNS::ResponseBuilder::Section::ANSWER, 1, 1,
+                                1, 180, &address, 4),
+                    std::out_of_range);
+
+    DNS::Reply reply(builder.data(), static_cast<int>(builder.size()));
+    CHECK(reply.m_hdr.m_id == view.m_hdr.m_id);
+    CHECK(reply.m_hdr.m_qr == 1);
+    CHECK(reply.m_hdr.m_rd == 1);
+    CHECK(reply.m_hdr.m_ad == 0);
+    REQUIRE(reply.m_answers.size() == 1);
+    CHECK(reply.m_answers[0].m_name == domainLabels);
+    CHECK(ntohl(reply.m_answers[0].m_ttl) == 180);
+    CHECK(std::memcmp(reply.m_answers[0].m_rdata, &address, 4) == 0);
+  }
+
+  SECTION("Records that do not fit truncate the response") {
+    DNS::MessageView view(query, sizeof(query));
+    DNS::ResponseBuilder builder(sizeof(query) + 20);
+    builder.begin(view);
+    CHECK(builder.add(DNS::ResponseBuilder::Section::ANSWER, 0, 1, 1, 180,
+                      &address, 4));
+    CHECK(!builder.add(DNS::ResponseBuilder::Section::ANSWER, 0, 1, 1, 180,
+                       &address, 4));
+    CHECK(builder.header().m_tc == 1);
+    CHECK(ntohs(builder.header().m_ancount) == 1);
+
+    builder.truncate();
+    CHECK(builder.size() == sizeof(query));
+    CHECK(builder.header().m_ancount == 0);
+
+    // Reuse clears the flags again
+    builder.begin(view);
+    CHECK(builder.header().m_tc == 0);
+  }
+
+  SECTION("Builders are moved, not copied") {
+    DNS::MessageView view(query, sizeof(query));
+    DNS::ResponseBuilder builder;
+    builder.begin(view);
+    auto data = builder.data();
+    DNS::ResponseBuilder moved(std::move(builder));
+    CHECK(moved.data() == data);
+    CHECK(moved.size() == sizeof(query));
+    CHECK(builder.size() == 0);
+    CHECK(moved.add(DNS::ResponseBuilder::Section::ANSWER, 0, 1, 1, 180,
+                    &address, 4));
+  }
+}
+
+TEST_CASE("Binary query log") {
+  SECTION("Rings drop instead of blocking when full") {
+    DNS::SpscRing<int> ring(4);
+    for (int i = 0; i < 4; i++) {
+      REQUIRE(ring.push(i));
+    }
+    CHECK(!ring.push(4));
+    REQUIRE(ring.front() != nullptr);
+    CHECK(*ring.front() == 0);
+    ring.pop();
+    CHECK(ring.push(4));
+    for (int i = 1; i <= 4; i++) {
+      REQUIRE(ring.front() != nullptr);
+      CHECK(*ring.front() == i);
+      ring.pop();
+    }
+    CHECK(ring.front() == nullptr);
+    CHECK_THROWS_AS(DNS::SpscRing<int>(3), std::runtime_error);
+  }
+
+  SECTION("Queries are logged to rotated files") {
+    std::string path = "/tmp/dnsd-test-querylog";
+    std::remove((path + ".1").c_str());
+    std::remove((path + ".2").c_str());
+
+    DNS::Config config;
+    config.m_queryLog.m_path = path;
+    config.m_queryLog.m_fileSize =
+            sizeof(DNS::QueryLogHeader) + 10 * sizeof(DNS::QueryLogRecord);
+    config.m_queryLog.m_files = 2;
+    {
+      DNS::Daemon daemon("9.9.9.9", config);
+      pthread_t thread_id;
+      pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+      sockaddr_in srvAddr{
+          AF_INET,
+          htons(DNS::Default::PORT),
+          htonl(DNS::Default::ADDRESS),
+      };
+      DNS::Resolver resolver(srvAddr);
+      for (int i = 0; i < 25; i++) {
+        std::vector<std::string> domainLabels{"host" + std::to_string(i),
+                                              "meter", "com"};
+        resolver.resolve(domainLabels, 28, 1);
+      }
+      resolver.drain();
+      daemon.stop();
+      pthread_join(thread_id, nullptr);
+      CHECK(daemon.stats()[DNS::Counter::QUERY_LOG_DROPPED] == 0);
+    }
+
+    // The first file was rotated out of existence
+    auto current = DNS::QueryLog::read(path);
+    auto previous = DNS::QueryLog::read(path + ".1");
+    CHECK_THROWS_AS(DNS::QueryLog::read(path + ".2"), std::runtime_error);
+    REQUIRE(previous.size() == 10);
+    REQUIRE(current.size() == 5);
+
+    const auto &record = current.back();
+    CHECK(record.m_family == AF_INET);
+    CHECK(record.m_qtype == 28);
+    CHECK(record.m_rcode == 0);
+    CHECK(record.m_flags == 0);
+    CHECK(record.m_timeNs > previous.front().m_timeNs);
+    in_addr loopback{htonl(INADDR_LOOPBACK)};
+    CHECK(std::memcmp(record.m_address, &loopback, sizeof(loopback)) == 0);
+    // host24.meter.com in wire format
+    REQUIRE(record.m_nameLength == 18);
+    CHECK(std::memcmp(record.m_name, "\x06host24\x05meter\x03" "com", 18) ==
+          0);
+    std::remove(path.c_str());
+    std::remove((path + ".1").c_str());
+  }
+}
+
+std::string scrape(uint16_t port, const std::string &request) {
+  auto sockFD = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{AF_INET, htons(port), {htonl(INADDR_LOOPBACK)}};
+  REQUIRE(connect(sockFD, reinterpret_cast<sockaddr *>(&addr),
+                  sizeof(addr)) == 0);
+  REQUIRE(send(sockFD, request.data(), request.size(), 0) ==
+          static_cast<ssize_t>(request.size()));
+  std::string response;
+  char buf[4096];
+  ssize_t n;
+  while ((n = recv(sockFD, buf, sizeof(buf), 0)) > 0) {
+    response.append(buf, n);
+  }
+  close(sockFD);
+  return response;
+}
+
+TEST_CASE("Prometheus metrics endpoint") {
+  DNS::Config config;
+  config.m_stageTiming = true;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  std::vector<std::string> domainLabels{"www", "meter", "com"};
+  DNS::query(srvAddr, domainLabels, 1, 1);
+  // The worker records the stages of the query after sending the reply
+  for (int i = 0;
+       i < 1000 && daemon.stats().latency(DNS::Stage::PARSE).count() == 0;
+       i++) {
+    usleep(1000);
+  }
+
+  DNS::MetricsServer metrics(0, [&]() { return daemon.stats(); });
+  DNS::Housekeeper housekeeper;
+  housekeeper.watch(metrics.fd(), [&]() { metrics.serve(); });
+  housekeeper.start();
+
+  SECTION("Counters and histograms are scraped") {
+    auto response = scrape(metrics.port(), "GET /metrics HTTP/1.1\r\n"
+                                           "Host: localhost\r\n\r\n");
+    CHECK(response.find("HTTP/1.1 200 OK\r\n") == 0);
+    CHECK(response.find("\ndnsd_queries_total 1\n") != std::string::npos);
+    CHECK(response.find("\ndnsd_kernel_drops_total 0\n") !=
+          std::string::npos);
+    CHECK(response.find("# TYPE dnsd_latency_seconds histogram\n") !=
+          std::string::npos);
+    CHECK(response.find("dnsd_latency_seconds_count{stage=\"parse\"} 1\n") !=
+          std::string::npos);
+    CHECK(response.find("dnsd_latency_seconds_bucket{stage=\"parse\","
+                        "le=\"+Inf\"} 1\n") != std::string::npos);
+    // The rate limiter's check is timed on its own
+    CHECK(response.find("dnsd_latency_seconds_count{stage=\"rrl\"} 1\n") !=
+          std::string::npos);
+  }
+
+  SECTION("Other requests are refused") {
+    CHECK(scrape(metrics.port(), "GET / HTTP/1.1\r\n\r\n")
+                  .find("HTTP/1.1 404") == 0);
+    CHECK(scrape(metrics.port(), "POST /metrics HTTP/1.1\r\n\r\n")
+                  .find("HTTP/1.1 405") == 0);
+  }
+
+  SECTION("Slow scrapers are cut off once the request deadline passed") {
+    auto sockFD = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{AF_INET, htons(metrics.port()), {htonl(INADDR_LOOPBACK)}};
+    REQUIRE(connect(sockFD, reinterpret_cast<sockaddr *>(&addr),
+                    sizeof(addr)) == 0);
+    // A byte every 100ms never lets a single receive time out
+    auto start = std::chrono::steady_clock::now();
+    auto closed = false;
+    for (int i = 0; i < 30 && !closed; i++) {
+      send(sockFD, "G", 1, MSG_NOSIGNAL);
+      pollfd pfd{sockFD, POLLIN, 0};
+      closed = poll(&pfd, 1, 100) > 0;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    close(sockFD);
+    CHECK(closed);
+    CHECK(elapsed < std::chrono::milliseconds(
+                            2 * DNS::Default::METRICS_TIMEOUT_MS));
+    // Housekeeping goes on
+    CHECK(scrape(metrics.port(), "GET /metrics HTTP/1.1\r\n\r\n")
+                  .find("HTTP/1.1 200") == 0);
+  }
+
+  housekeeper.stop();
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Split-horizon views") {
+  SECTION("Longest prefix match") {
+    auto prefix = [](const char *p) { return DNS::parsePrefix(p); };
+    DNS::LpmTable ipv4(4, {{prefix("10.0.0.0/8"), 1},
+                           {prefix("10.1.0.0/16"), 2},
+                           {prefix("10.1.2.0/23"), 3},
+                           {prefix("10.1.2.3"), 4},
+                           {prefix("192.168.7.9/20"), 5}});
+    auto lookup = [&](const char *address) {
+      in_addr addr;
+      inet_pton(AF_INET, address, &addr);
+      return ipv4.lookup(reinterpret_cast<const uint8_t *>(&addr));
+    };
+    CHECK(lookup("10.200.0.1") == 1);
+    CHECK(lookup("10.1.200.1") == 2);
+    CHECK(lookup("10.1.3.255") == 3);
+    CHECK(lookup("10.1.4.0") == 2);
+    CHECK(lookup("10.1.2.3") == 4);
+    CHECK(lookup("10.1.2.4") == 3);
+    CHECK(lookup("192.168.15.255") == 5);
+    CHECK(lookup("192.168.16.0") == DNS::LpmTable::NONE);
+    CHECK(lookup("11.0.0.0") == DNS::LpmTable::NONE);
+
+    DNS::LpmTable ipv6(16, {{prefix("2001:db8::/32"), 1},
+                            {prefix("2001:db8:1:2::/64"), 2}});
+    auto lookup6 = [&](const char *address) {
+      in6_addr addr;
+      inet_pton(AF_INET6, address, &addr);
+      return ipv6.lookup(addr.s6_addr);
+    };
+    CHECK(lookup6("2001:db8:ffff::1") == 1);
+    CHECK(lookup6("2001:db8:1:2:3:4:5:6") == 2);
+    CHECK(lookup6("2001:db8:1:3::1") == 1);
+    CHECK(lookup6("2001:db9::1") == DNS::LpmTable::NONE);
+
+    CHECK_THROWS_AS(prefix("10.0.0.0/33"), std::runtime_error);
+    CHECK_THROWS_AS(prefix("10.0.0/8"), std::runtime_error);
+    CHECK_THROWS_AS(DNS::LpmTable(4, {{prefix("::/0"), 1}}),
+                    std::runtime_error);
+  }
+
+  SECTION("Names are looked up case-insensitively in wire format") {
+    DNS::NameTable names;
+    in_addr address{htonl(0x0a000001)};
+    for (int i = 0; i < 100; i++) {
+      names.insert("host" + std::to_string(i) + ".Meter.com.", address);
+    }
+    CHECK(names.size() == 100);
+    const unsigned char wire[] = "\x06HOST42\x05meter\x03" "com";
+    auto found = names.find(wire, sizeof(wire));
+    REQUIRE(found != nullptr);
+    CHECK(found->s_addr == address.s_addr);
+    const unsigned char missing[] = "\x07host100\x05meter\x03" "com";
+    CHECK(names.find(missing, sizeof(missing)) == nullptr);
+    CHECK_THROWS_AS(names.insert("a..b", address), std::runtime_error);
+  }
+
+  SECTION("Clients are answered from their view") {
+    DNS::Config config;
+    config.m_views.push_back(DNS::parseView("internal=127.0.0.0/8@7.7.7.7"));
+    config.m_views.push_back(DNS::parseView("partner=192.0.2.0/24,2001:db8::/32"));
+    DNS::addRecord(config.m_views, "internal:www.meter.com=10.0.0.1");
+    DNS::addRecord(config.m_views, "default:www.meter.com=203.0.113.1");
+    DNS::Daemon daemon("9.9.9.9", config);
+    pthread_t thread_id;
+    pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+    sockaddr_in srvAddr{
+        AF_INET,
+        htons(DNS::Default::PORT),
+        htonl(DNS::Default::ADDRESS),
+    };
+    std::vector<std::string> listed{"www", "meter", "com"};
+    std::vector<std::string> unlisted{"mail", "meter", "com"};
+    auto first = DNS::query(srvAddr, listed, 1, 1);
+    auto second = DNS::query(srvAddr, unlisted, 1, 1);
+    daemon.stop();
+    pthread_join(thread_id, nullptr);
+
+    REQUIRE(first->m_answers.size() == 1);
+    REQUIRE(second->m_answers.size() == 1);
+    in_addr expected{htonl(0x0a000001)};
+    CHECK(std::memcmp(first->m_answers[0].m_rdata, &expected, 4) == 0);
+    expected.s_addr = htonl(0x07070707);
+    CHECK(std::memcmp(second->m_answers[0].m_rdata, &expected, 4) == 0);
+
+    CHECK_THROWS_AS(DNS::parseView("internal"), std::runtime_error);
+    // Records of views no client can reach are typos
+    REQUIRE_THROWS_MATCHES(
+        DNS::addRecord(config.m_views, "intrenal:www.meter.com=10.0.0.2"),
+        std::runtime_error,
+        Catch::Matchers::Message("What: unknown view - Context: intrenal"));
+    config.m_views.push_back(DNS::parseView("default=10.0.0.0/8"));
+    CHECK_THROWS_AS(DNS::Daemon("9.9.9.9", config), std::runtime_error);
+  }
+}
+
+std::string wireQuery(const std::string &name, uint16_t qtype) {
+  std::string query("\x12\x34\x01\x00\x00\x01\x00\x00\x00\x00\x00\x00", 12);
+  query += DNS::toWireName(name);
+  query.push_back(static_cast<char>(qtype >> 8));
+  query.push_back(static_cast<char>(qtype & 0xff));
+  query.push_back(0);
+  query.push_back(1);
+  return query;
+}
+
+TEST_CASE("Authoritative negative answers") {
+  DNS::Config config;
+  config.m_soa = "Meter.com. ns1.meter.com hostmaster.meter.com 2024010101 "
+                 "3600 600 86400 300";
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  DNS::Daemon daemon("9.9.9.9", config);
+  DNS::Zone zone(config.m_soa);
+  DNS::ResponseBuilder builder;
+  auto respond = [&](const std::string &name, uint16_t qtype) {
+    auto query = wireQuery(name, qtype);
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    builder.begin(view);
+    daemon.answer(view, builder);
+    return query.size();
+  };
+  auto hasSoa = [&](size_t querySize) {
+    const auto &soa = zone.soaRecord();
+    return builder.size() == querySize + soa.size() &&
+           std::memcmp(builder.data() + querySize, soa.data(), soa.size()) ==
+                   0;
+  };
+
+  SECTION("Known names are answered authoritatively") {
+    respond("WWW.meter.com", DNS::Type::A);
+    CHECK(builder.header().m_aa == 1);
+    CHECK(builder.header().m_rcode == DNS::Rcode::NOERROR);
+    CHECK(ntohs(builder.header().m_ancount) == 1);
+    CHECK(builder.header().m_nscount == 0);
+  }
+
+  SECTION("Other types of known names get NODATA") {
+    auto size = respond("www.meter.com", DNS::Type::AAAA);
+    CHECK(builder.header().m_aa == 1);
+    CHECK(builder.header().m_rcode == DNS::Rcode::NOERROR);
+    CHECK(builder.header().m_ancount == 0);
+    CHECK(ntohs(builder.header().m_nscount) == 1);
+    CHECK(hasSoa(size));
+  }
+
+  SECTION("Unknown names get NXDOMAIN") {
+    auto size = respond("mail.meter.com", DNS::Type::A);
+    CHECK(builder.header().m_aa == 1);
+    CHECK(builder.header().m_rcode == DNS::Rcode::NXDOMAIN);
+    CHECK(ntohs(builder.header().m_nscount) == 1);
+    CHECK(hasSoa(size));
+
+    // The SOA record is owned by the apex, with MINIMUM as its TTL
+    DNS::Reply reply(builder.data(), static_cast<int>(builder.size()));
+    CHECK(reply.m_hdr.m_rcode == DNS::Rcode::NXDOMAIN);
+    const auto &soa = zone.soaRecord();
+    CHECK(soa.compare(0, 11, std::string("\x05meter\x03" "com", 11)) == 0);
+    CHECK(soa.compare(11, 8, std::string("\x00\x06\x00\x01\x00\x00\x01\x2c",
+                                          8)) == 0);
+  }
+
+  SECTION("Names outside the zone are refused") {
+    auto size = respond("www.meter.org", DNS::Type::A);
+    CHECK(builder.header().m_aa == 0);
+    CHECK(builder.header().m_rcode == DNS::Rcode::REFUSED);
+    CHECK(builder.size() == size);
+    respond("xmeter.com", DNS::Type::A);
+    CHECK(builder.header().m_rcode == DNS::Rcode::REFUSED);
+
+    // Along with the questions inside the zone that come before them
+    auto query = wireQuery("www.meter.com", DNS::Type::A);
+    query += wireQuery("www.meter.org", DNS::Type::A).substr(12);
+    query[5] = 2;
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    builder.begin(view);
+    daemon.answer(view, builder);
+    CHECK(builder.header().m_rcode == DNS::Rcode::REFUSED);
+    CHECK(builder.header().m_ancount == 0);
+    CHECK(builder.size() == query.size());
+  }
+
+  SECTION("Invalid SOAs are rejected") {
+    CHECK_THROWS_AS(DNS::Zone("meter.com ns1.meter.com"), std::runtime_error);
+    CHECK_THROWS_AS(DNS::Zone("meter.com a b 1 2 3 4 5 6"),
+                    std::runtime_error);
+  }
+}
+
+TEST_CASE("Answers by QTYPE") {
+  DNS::Config config;
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  DNS::ResponseBuilder builder;
+  auto respond = [&](const DNS::Daemon &daemon, const std::string &query) {
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    builder.begin(view);
+    daemon.answer(view, builder);
+    return std::unique_ptr<DNS::Reply>(
+            new DNS::Reply(builder.data(), static_cast<int>(builder.size())));
+  };
+
+  SECTION("Spoofing daemons synthesize records from the address") {
+    DNS::Daemon daemon("9.9.9.9", config);
+    // The name is its own mail exchanger, by a pointer to the question
+    auto reply = respond(daemon, wireQuery("mail.meter.com", DNS::Type::MX));
+    REQUIRE(reply->m_answers.size() == 1);
+    const auto &mx = reply->m_answers[0];
+    CHECK(ntohs(mx.m_type) == DNS::Type::MX);
+    REQUIRE(ntohs(mx.m_rdLength) == 4);
+    CHECK(std::memcmp(mx.m_rdata, "\x00\x0a\xc0\x0c", 4) == 0);
+
+    // Types without data of their own get NODATA, AAAA included: an IPv6
+    // address can't be made up from the IPv4 one
+    for (auto qtype : {DNS::Type::AAAA, DNS::Type::CNAME, DNS::Type::TXT,
+                       DNS::Type::PTR, DNS::Type::SOA}) {
+      reply = respond(daemon, wireQuery("www.meter.com", qtype));
+      CHECK(reply->m_hdr.m_rcode == DNS::Rcode::NOERROR);
+      CHECK(reply->m_answers.empty());
+    }
+
+    // So do classes other than IN
+    auto chaos = wireQuery("www.meter.com", DNS::Type::A);
+    chaos[chaos.size() - 1] = 3;
+    reply = respond(daemon, chaos);
+    CHECK(reply->m_answers.empty());
+  }
+
+  SECTION("Authoritative daemons serve the apex") {
+    config.m_soa = "meter.com. ns1.meter.com hostmaster.meter.com 2024010101 "
+                   "3600 600 86400 300";
+    DNS::Daemon daemon("9.9.9.9", config);
+    auto reply = respond(daemon, wireQuery("meter.com", DNS::Type::SOA));
+    CHECK(reply->m_hdr.m_aa == 1);
+    REQUIRE(reply->m_answers.size() == 1);
+    CHECK(ntohs(reply->m_answers[0].m_type) == DNS::Type::SOA);
+    CHECK(reply->m_hdr.m_nscount == 0);
+
+    reply = respond(daemon, wireQuery("meter.com", DNS::Type::NS));
+    REQUIRE(reply->m_answers.size() == 1);
+    const auto &ns = reply->m_answers[0];
+    CHECK(ntohs(ns.m_type) == DNS::Type::NS);
+    auto primary = DNS::toWireName("ns1.meter.com");
+    REQUIRE(ntohs(ns.m_rdLength) == primary.size());
+    CHECK(std::memcmp(ns.m_rdata, primary.data(), primary.size()) == 0);
+
+    // The apex has no address, but exists
+    reply = respond(daemon, wireQuery("meter.com", DNS::Type::A));
+    CHECK(reply->m_hdr.m_rcode == DNS::Rcode::NOERROR);
+    CHECK(reply->m_answers.empty());
+    CHECK(ntohs(builder.header().m_nscount) == 1);
+
+    // Only spoofing daemons make records up
+    reply = respond(daemon, wireQuery("www.meter.com", DNS::Type::MX));
+    CHECK(reply->m_answers.empty());
+  }
+}
+
+TEST_CASE("UDP replies fit in 512 bytes") {
+  DNS::Daemon daemon("9.9.9.9");
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  // Wait for the daemon to serve
+  std::vector<std::string> known{"www", "meter", "com"};
+  REQUIRE(DNS::query(srvAddr, known, 1, 1)->m_answers.size() == 1);
+
+  // Eight questions of 56 bytes and their answers take 588 bytes, which
+  // only fit a client that advertised a larger size with EDNS
+  auto query = wireQuery(std::string(40, 'a') + ".meter.com", DNS::Type::A);
+  auto question = query.substr(DNS::Default::HDR_SIZE);
+  for (int i = 1; i < 8; i++) {
+    question[1] = static_cast<char>('b' + i);
+    query += question;
+  }
+  query[5] = 8;
+  auto sockFD = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval timeout{2, 0};
+  setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  sendto(sockFD, query.data(), query.size(), 0,
+         reinterpret_cast<sockaddr *>(&srvAddr), sizeof(srvAddr));
+  unsigned char buf[2048];
+  auto n = recv(sockFD, buf, sizeof(buf), 0);
+  close(sockFD);
+  REQUIRE(n > static_cast<ssize_t>(query.size()));
+  CHECK(n <= DNS::Default::MAX_UDP_SIZE);
+  DNS::Reply reply(buf, static_cast<int>(n));
+  CHECK(reply.m_hdr.m_tc == 1);
+  CHECK(reply.m_questions.size() == 8);
+  CHECK(reply.m_answers.size() == 3);
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+// Answers a query as the stand-in upstream server does: names under "nx" get
+// NXDOMAIN with a SOA (MINIMUM 30), every other name an A record of
+// 192.0.2.1 with a TTL of 60, or of 1 under "brief"
+std::string upstreamResponse(const std::string &query) {
+  DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                        static_cast<int>(query.size()));
+  std::string response(query, 0, view.questionsEnd());
+  auto &hdr = *reinterpret_cast<DNS::Message::Header *>(&response[0]);
+  hdr.m_qr = 1;
+  hdr.m_ra = 1;
+  if (response.compare(12, 3, "\x02nx") == 0) {
+    hdr.m_rcode = DNS::Rcode::NXDOMAIN;
+    hdr.m_nscount = htons(1);
+    response.append("\x00\x00\x06\x00\x01\x00\x00\x0e\x10\x00\x16"
+                    "\x00\x00\x00\x00\x00\x01\x00\x00\x0e\x10\x00\x00\x02\x58"
+                    "\x00\x01\x51\x80\x00\x00\x00\x1e",
+                    33);
+  } else {
+    hdr.m_ancount = htons(1);
+    response.append("\xc0\x0c\x00\x01\x00\x01\x00\x00\x00\x3c\x00\x04"
+                    "\xc0\x00\x02\x01",
+                    16);
+    if (response.compare(12, 6, "\x05" "brief") == 0) {
+      response[response.size() - 7] = 1;
+    }
+  }
+  return response;
+}
+
+// Stand-in upstream server on a loopback port of its own
+// Names under "silent" are never answered, nor is any name once silenced.
+class UpstreamStub {
+public:
+  UpstreamStub() {
+    m_sockFD = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{AF_INET, 0, htonl(INADDR_LOOPBACK)};
+    bind(m_sockFD, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(m_sockFD, reinterpret_cast<sockaddr *>(&addr), &len);
+    m_port = ntohs(addr.sin_port);
+    pthread_create(&m_thread, nullptr, serve, this);
+  }
+  ~UpstreamStub() {
+    shutdown(m_sockFD, SHUT_RD);
+    pthread_join(m_thread, nullptr);
+    close(m_sockFD);
+  }
+
+  uint16_t port() const { return m_port; }
+  int queries() const { return m_queries; }
+  void silence() { m_silent = true; }
+
+private:
+  static void *serve(void *arg) {
+    auto stub = reinterpret_cast<UpstreamStub *>(arg);
+    char buf[512];
+    while (true) {
+      sockaddr_in client{};
+      socklen_t len = sizeof(client);
+      auto n = recvfrom(stub->m_sockFD, buf, sizeof(buf), 0,
+                        reinterpret_cast<sockaddr *>(&client), &len);
+      if (n <= 0) {
+        return nullptr;
+      }
+      stub->m_queries++;
+      std::string query(buf, n);
+      if (stub->m_silent || query.compare(12, 7, "\x06silent") == 0) {
+        continue;
+      }
+      auto response = upstreamResponse(query);
+      sendto(stub->m_sockFD, response.data(), response.size(), 0,
+             reinterpret_cast<sockaddr *>(&client), len);
+    }
+  }
+
+  int m_sockFD;
+  uint16_t m_port;
+  pthread_t m_thread;
+  std::atomic<int> m_queries{0};
+  std::atomic<bool> m_silent{false};
+};
+
+TEST_CASE("Upstream responses are cached by question") {
+  DNS::AnswerCache cache(1 << 20);
+  std::unique_ptr<DNS::WorkerStats> stats(new DNS::WorkerStats());
+  DNS::ResponseBuilder builder;
+  auto cached = [&](const std::string &query, uint64_t nowMs) {
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    builder.begin(view);
+    return cache.lookup(view, builder, nowMs, *stats);
+  };
+  auto insert = [&](const std::string &response, uint64_t nowMs) {
+    return cache.insert(
+            reinterpret_cast<const unsigned char *>(response.data()),
+            response.size(), nowMs, *stats);
+  };
+
+  SECTION("TTLs count down until the response expires") {
+    auto response = upstreamResponse(wireQuery("www.example.com", 1));
+    REQUIRE(insert(response, 1000));
+    auto query = wireQuery("www.example.com", 1);
+    query[13] = 'W';
+    REQUIRE(cached(query, 11500));
+    DNS::Reply reply(builder.data(), static_cast<int>(builder.size()));
+    REQUIRE(reply.m_answers.size() == 1);
+    CHECK(ntohl(reply.m_answers[0].m_ttl) == 50);
+    CHECK(reply.m_hdr.m_ra == 1);
+    // The question is spelled as the client did
+    CHECK(builder.data()[13] == 'W');
+    CHECK_FALSE(cached(wireQuery("www.example.com", 28), 11500));
+    CHECK_FALSE(cached(query, 61000));
+    CHECK(stats->get(DNS::Counter::CACHE_HITS) == 1);
+    CHECK(stats->get(DNS::Counter::CACHE_MISSES) == 2);
+  }
+
+  SECTION("Only the name of the question ignores case") {
+    // QTYPEs 65 ('A') and 97 ('a') differ by the case bit
+    REQUIRE(insert(upstreamResponse(wireQuery("www.example.com", 65)), 0));
+    CHECK_FALSE(cached(wireQuery("www.example.com", 97), 1000));
+    CHECK(cached(wireQuery("WWW.example.com", 65), 1000));
+  }
+
+  SECTION("Negative answers are cached for the SOA MINIMUM") {
+    auto query = wireQuery("nx.example.com", 1);
+    auto response = upstreamResponse(query);
+    REQUIRE(insert(response, 0));
+    REQUIRE(cached(query, 29999));
+    CHECK(builder.header().m_rcode == DNS::Rcode::NXDOMAIN);
+    CHECK(ntohs(builder.header().m_nscount) == 1);
+    CHECK(builder.size() == response.size());
+    CHECK_FALSE(cached(query, 30000));
+  }
+
+  SECTION("A single lookup refreshes entries close to their expiry") {
+    auto query = wireQuery("www.example.com", 1);
+    REQUIRE(insert(upstreamResponse(query), 0));
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    auto prefetch = [&](uint64_t nowMs) {
+      auto refresh = false;
+      builder.begin(view);
+      REQUIRE(cache.lookup(view, builder, nowMs, *stats, &refresh));
+      return refresh;
+    };
+    CHECK_FALSE(prefetch(50000));
+    // 10% of the 60s TTL left
+    CHECK(prefetch(54001));
+    CHECK_FALSE(prefetch(55000));
+    // Until the refreshed response replaces the entry
+    REQUIRE(insert(upstreamResponse(query), 55000));
+    CHECK_FALSE(prefetch(60000));
+    CHECK(prefetch(110000));
+  }
+
+  SECTION("Expired responses are served stale within the window") {
+    auto query = wireQuery("www.example.com", 1);
+    REQUIRE(insert(upstreamResponse(query), 0));
+    DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                          static_cast<int>(query.size()));
+    CHECK_FALSE(cached(query, 61000));
+    builder.begin(view);
+    REQUIRE(cache.lookupStale(view, builder, 61000, *stats));
+    DNS::Reply reply(builder.data(), static_cast<int>(builder.size()));
+    REQUIRE(reply.m_answers.size() == 1);
+    CHECK(ntohl(reply.m_answers[0].m_ttl) == DNS::Default::CACHE_STALE_TTL);
+    builder.begin(view);
+    CHECK_FALSE(cache.lookupStale(
+            view, builder, 60000 + DNS::Default::CACHE_STALE_SECONDS * 1000ull,
+            *stats));
+    CHECK(stats->get(DNS::Counter::STALE_ANSWERS) == 1);
+
+    // Without a window, only fresh responses are
+    DNS::AnswerCache fresh(1 << 20, DNS::Default::CACHE_PREFETCH_PERCENT, 0);
+    auto response = upstreamResponse(query);
+    REQUIRE(fresh.insert(
+            reinterpret_cast<const unsigned char *>(response.data()),
+            response.size(), 0, *stats));
+    builder.begin(view);
+    CHECK(fresh.lookupStale(view, builder, 59000, *stats));
+    CHECK_FALSE(fresh.lookupStale(view, builder, 60000, *stats));
+  }
+
+  SECTION("Failures and truncated responses are not cached") {
+    auto response = upstreamResponse(wireQuery("www.example.com", 1));
+    auto &hdr = *reinterpret_cast<DNS::Message::Header *>(&response[0]);
+    hdr.m_tc = 1;
+    CHECK_FALSE(insert(response, 0));
+    hdr.m_tc = 0;
+    hdr.m_rcode = DNS::Rcode::SERVFAIL;
+    CHECK_FALSE(insert(response, 0));
+    CHECK(cache.size() == 0);
+  }
+
+  SECTION("Entries accessed again survive a scan of one-hit entries") {
+    auto hot = wireQuery("hot.example.com", 1);
+    auto cold = wireQuery("cold.example.com", 1);
+    REQUIRE(insert(upstreamResponse(hot), 0));
+    REQUIRE(insert(upstreamResponse(cold), 0));
+    REQUIRE(cached(hot, 1));
+    // Several times the capacity of the cache
+    for (int i = 0; i < 50000; i++) {
+      auto name = std::to_string(i) + ".scan.example.com";
+      REQUIRE(insert(upstreamResponse(wireQuery(name, 1)), 0));
+    }
+    CHECK(cached(hot, 2));
+    CHECK_FALSE(cached(cold, 2));
+    CHECK(stats->get(DNS::Counter::CACHE_EVICTIONS) > 40000);
+    CHECK(cache.size() < 50000);
+  }
+}
+
+TEST_CASE("Unknown names are forwarded to upstream servers") {
+  UpstreamStub upstream;
+  DNS::Config config;
+  config.m_upstreams.push_back("127.0.0.1:" + std::to_string(upstream.port()));
+  config.m_upstreamRetries.m_attempts = 2;
+  config.m_upstreamRetries.m_initialTimeoutMs = 20;
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+
+  SECTION("Forwarded answers are cached") {
+    std::vector<std::string> domainLabels{"www", "example", "com"};
+    auto first = DNS::query(srvAddr, domainLabels, 1, 1);
+    auto second = DNS::query(srvAddr, domainLabels, 1, 1);
+    REQUIRE(first->m_answers.size() == 1);
+    REQUIRE(second->m_answers.size() == 1);
+    in_addr expected{htonl(0xc0000201)};
+    CHECK(std::memcmp(first->m_answers[0].m_rdata, &expected, 4) == 0);
+    CHECK(std::memcmp(second->m_answers[0].m_rdata, &expected, 4) == 0);
+    CHECK(ntohl(first->m_answers[0].m_ttl) == 60);
+    CHECK(ntohl(second->m_answers[0].m_ttl) >= 59);
+    CHECK(upstream.queries() == 1);
+    CHECK(daemon.stats()[DNS::Counter::FORWARDED] == 1);
+    CHECK(daemon.stats()[DNS::Counter::CACHE_HITS] == 1);
+  }
+
+  SECTION("Known names are answered locally") {
+    std::vector<std::string> domainLabels{"www", "meter", "com"};
+    auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+    REQUIRE(reply->m_answers.size() == 1);
+    in_addr expected{htonl(0x0a000001)};
+    CHECK(std::memcmp(reply->m_answers[0].m_rdata, &expected, 4) == 0);
+    CHECK(upstream.queries() == 0);
+  }
+
+  SECTION("Silent upstreams get SERVFAIL") {
+    std::vector<std::string> domainLabels{"silent", "example", "com"};
+    auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+    CHECK(reply->m_hdr.m_rcode == DNS::Rcode::SERVFAIL);
+    CHECK(reply->m_answers.empty());
+    CHECK(upstream.queries() == 2);
+    CHECK(daemon.stats()[DNS::Counter::UPSTREAM_ERRORS] == 1);
+  }
+
+  SECTION("Identical queries in flight share the upstream query") {
+    // Wait for the daemon to serve
+    std::vector<std::string> known{"www", "meter", "com"};
+    REQUIRE(DNS::query(srvAddr, known, 1, 1)->m_answers.size() == 1);
+    auto sockFD = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    for (int i = 0; i < 3; i++) {
+      auto query = wireQuery("silent.example.com", 1);
+      query[1] = static_cast<char>(i);
+      if (i == 1) {
+        query.replace(13, 6, "SILENT");
+      }
+      sendto(sockFD, query.data(), query.size(), 0,
+             reinterpret_cast<sockaddr *>(&srvAddr), sizeof(srvAddr));
+    }
+    std::vector<int> ids;
+    for (int i = 0; i < 3; i++) {
+      unsigned char buf[512];
+      auto n = recv(sockFD, buf, sizeof(buf), 0);
+      REQUIRE(n > 12);
+      DNS::Reply reply(buf, static_cast<int>(n));
+      CHECK(reply.m_hdr.m_rcode == DNS::Rcode::SERVFAIL);
+      // Each client gets its own ID and spelling of the question
+      ids.push_back(ntohs(reply.m_hdr.m_id) & 0xff);
+      CHECK(reply.m_questions[0].m_qname[0] ==
+            (ids.back() == 1 ? "SILENT" : "silent"));
+    }
+    close(sockFD);
+    std::sort(ids.begin(), ids.end());
+    CHECK(ids == std::vector<int>{0, 1, 2});
+    CHECK(upstream.queries() == 2);
+    CHECK(daemon.stats()[DNS::Counter::FORWARDED] == 1);
+    CHECK(daemon.stats()[DNS::Counter::COALESCED] == 2);
+    CHECK(daemon.stats()[DNS::Counter::UPSTREAM_ERRORS] == 3);
+  }
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Expired answers are served when upstreams are slow") {
+  UpstreamStub upstream;
+  DNS::Config config;
+  config.m_upstreams.push_back("127.0.0.1:" + std::to_string(upstream.port()));
+  // Queries fail after 1.5s, long after the deadline
+  config.m_upstreamRetries.m_attempts = 2;
+  config.m_upstreamRetries.m_initialTimeoutMs = 500;
+  config.m_staleDeadlineMs = 300;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+
+  std::vector<std::string> brief{"brief", "example", "com"};
+  REQUIRE(DNS::query(srvAddr, brief, 1, 1)->m_answers.size() == 1);
+  // Past the TTL of 1s, and upstream goes quiet
+  usleep(1100000);
+  upstream.silence();
+
+  auto sockFD = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval timeout{3, 0};
+  setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  auto exchange = [&](const std::string &name) {
+    auto query = wireQuery(name, DNS::Type::A);
+    sendto(sockFD, query.data(), query.size(), 0,
+           reinterpret_cast<sockaddr *>(&srvAddr), sizeof(srvAddr));
+    unsigned char buf[512];
+    auto n = recv(sockFD, buf, sizeof(buf), 0);
+    REQUIRE(n > 12);
+    return std::unique_ptr<DNS::Reply>(
+            new DNS::Reply(buf, static_cast<int>(n)));
+  };
+  auto elapsedMs = [](std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+  };
+
+  // Answered stale at the deadline
+  auto start = std::chrono::steady_clock::now();
+  auto reply = exchange("brief.example.com");
+  CHECK(elapsedMs(start) >= 250);
+  CHECK(elapsedMs(start) < 1000);
+  CHECK(reply->m_hdr.m_rcode == DNS::Rcode::NOERROR);
+  REQUIRE(reply->m_answers.size() == 1);
+  CHECK(ntohl(reply->m_answers[0].m_ttl) == DNS::Default::CACHE_STALE_TTL);
+  CHECK(daemon.stats()[DNS::Counter::STALE_ANSWERS] == 1);
+
+  // Then right away, while the query is still in flight
+  start = std::chrono::steady_clock::now();
+  reply = exchange("brief.example.com");
+  CHECK(elapsedMs(start) < 250);
+  REQUIRE(reply->m_answers.size() == 1);
+  CHECK(daemon.stats()[DNS::Counter::STALE_ANSWERS] == 2);
+
+  // Names with no stale copy fail
+  reply = exchange("www.example.com");
+  CHECK(reply->m_hdr.m_rcode == DNS::Rcode::SERVFAIL);
+  CHECK(reply->m_answers.empty());
+  CHECK(daemon.stats()[DNS::Counter::STALE_ANSWERS] == 2);
+  close(sockFD);
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Cached answers are refreshed before they expire") {
+  UpstreamStub upstream;
+  DNS::Config config;
+  config.m_upstreams.push_back("127.0.0.1:" + std::to_string(upstream.port()));
+  // Any TTL spent is close enough to the expiry
+  config.m_prefetchPercent = 100;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+
+  std::vector<std::string> domainLabels{"www", "example", "com"};
+  REQUIRE(DNS::query(srvAddr, domainLabels, 1, 1)->m_answers.size() == 1);
+  usleep(50000);
+  // Answered from the cache, while the question goes upstream again
+  auto reply = DNS::query(srvAddr, domainLabels, 1, 1);
+  CHECK(reply->m_answers.size() == 1);
+  for (int i = 0; i < 1000 && upstream.queries() < 2; i++) {
+    usleep(1000);
+  }
+  usleep(50000);
+  CHECK(upstream.queries() == 2);
+  CHECK(daemon.stats()[DNS::Counter::CACHE_HITS] == 1);
+  CHECK(daemon.stats()[DNS::Counter::FORWARDED] == 1);
+  CHECK(daemon.stats()[DNS::Counter::PREFETCHES] == 1);
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Forwarded replies are rate limited") {
+  UpstreamStub upstream;
+  DNS::Config config;
+  config.m_upstreams.push_back("127.0.0.1:" + std::to_string(upstream.port()));
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  // Enough for the query that waits for the daemon, and a forwarded one
+  config.m_rrl.m_rate = 1;
+  config.m_rrl.m_burst = 2;
+  config.m_rrl.m_slip = 2;
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(DNS::Default::ADDRESS),
+  };
+  std::vector<std::string> known{"www", "meter", "com"};
+  REQUIRE(DNS::query(srvAddr, known, 1, 1)->m_answers.size() == 1);
+
+  // Names missing from the cache, so that every reply is relayed
+  auto sockFD = socket(AF_INET, SOCK_DGRAM, 0);
+  for (auto name : {"a.example.com", "b.example.com", "c.example.com",
+                    "d.example.com"}) {
+    auto query = wireQuery(name, DNS::Type::A);
+    sendto(sockFD, query.data(), query.size(), 0,
+           reinterpret_cast<sockaddr *>(&srvAddr), sizeof(srvAddr));
+  }
+  // One passes, then drops alternate with slips
+  int answered = 0;
+  int slipped = 0;
+  timeval timeout{1, 0};
+  setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  unsigned char buf[512];
+  ssize_t n;
+  while ((n = recv(sockFD, buf, sizeof(buf), 0)) > 0) {
+    DNS::Reply reply(buf, static_cast<int>(n));
+    if (reply.m_hdr.m_tc == 1) {
+      CHECK(reply.m_answers.empty());
+      slipped++;
+    } else {
+      CHECK(reply.m_answers.size() == 1);
+      answered++;
+    }
+  }
+  close(sockFD);
+  CHECK(answered == 1);
+  CHECK(slipped == 1);
+  CHECK(upstream.queries() == 4);
+  CHECK(daemon.stats()[DNS::Counter::RRL_DROPPED] == 2);
+  CHECK(daemon.stats()[DNS::Counter::RRL_SLIPPED] == 1);
+
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+// Reads a length-prefixed message off a TCP connection
+std::string readTcpMessage(int sockFD) {
+  std::string message;
+  size_t expected = 2;
+  char buf[512];
+  while (message.size() < expected) {
+    auto n = recv(sockFD, buf, std::min(sizeof(buf), expected - message.size()),
+                  0);
+    if (n <= 0) {
+      return std::string();
+    }
+    message.append(buf, n);
+    if (message.size() == 2) {
+      expected += static_cast<uint8_t>(message[0]) << 8 |
+                  static_cast<uint8_t>(message[1]);
+    }
+  }
+  return message.substr(2);
+}
+
+TEST_CASE("Pipelined queries over TCP") {
+  UpstreamStub upstream;
+  DNS::Config config;
+  config.m_upstreams.push_back("127.0.0.1:" + std::to_string(upstream.port()));
+  config.m_upstreamRetries.m_attempts = 2;
+  config.m_upstreamRetries.m_initialTimeoutMs = 20;
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(INADDR_LOOPBACK),
+  };
+  // Wait for the daemon to serve
+  std::vector<std::string> known{"www", "meter", "com"};
+  REQUIRE(DNS::query(srvAddr, known, 1, 1)->m_answers.size() == 1);
+
+  auto sockFD = socket(AF_INET, SOCK_STREAM, 0);
+  timeval timeout{2, 0};
+  setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  REQUIRE(connect(sockFD, reinterpret_cast<sockaddr *>(&srvAddr),
+                  sizeof(srvAddr)) == 0);
+
+  SECTION("Replies come as soon as they are ready, in any order") {
+    // A query upstreams don't answer, a local one and a forwarded one, sent
+    // back to back with the last one split across writes
+    std::string queries;
+    std::vector<std::string> names{"silent.example.com", "www.meter.com",
+                                   "www.example.com"};
+    for (size_t i = 0; i < names.size(); i++) {
+      auto query = wireQuery(names[i], 1);
+      query[1] = static_cast<char>(i);
+      queries.push_back(static_cast<char>(query.size() >> 8));
+      queries.push_back(static_cast<char>(query.size() & 0xff));
+      queries += query;
+    }
+    REQUIRE(send(sockFD, queries.data(), queries.size() - 5, 0) ==
+            static_cast<ssize_t>(queries.size() - 5));
+    auto local = readTcpMessage(sockFD);
+    REQUIRE(local.size() > 12);
+    DNS::Reply localReply(reinterpret_cast<const unsigned char *>(local.data()),
+                          static_cast<int>(local.size()));
+    CHECK((ntohs(localReply.m_hdr.m_id) & 0xff) == 1);
+    CHECK(localReply.m_answers.size() == 1);
+
+    REQUIRE(send(sockFD, queries.data() + queries.size() - 5, 5, 0) == 5);
+    std::vector<int> ids;
+    std::vector<int> rcodes;
+    for (int i = 0; i < 2; i++) {
+      auto message = readTcpMessage(sockFD);
+      REQUIRE(message.size() > 12);
+      DNS::Reply reply(reinterpret_cast<const unsigned char *>(message.data()),
+                       static_cast<int>(message.size()));
+      ids.push_back(ntohs(reply.m_hdr.m_id) & 0xff);
+      rcodes.push_back(reply.m_hdr.m_rcode);
+    }
+    // The forwarded query is answered before the one that times out
+    CHECK(ids == std::vector<int>{2, 0});
+    CHECK(rcodes ==
+          std::vector<int>{DNS::Rcode::NOERROR, DNS::Rcode::SERVFAIL});
+    CHECK(daemon.stats()[DNS::Counter::TCP_CONNECTIONS] == 1);
+  }
+
+  SECTION("Replies to a client that is done sending are still written") {
+    auto query = wireQuery("www.example.com", 1);
+    std::string message(1, static_cast<char>(query.size() >> 8));
+    message.push_back(static_cast<char>(query.size() & 0xff));
+    message += query;
+    REQUIRE(send(sockFD, message.data(), message.size(), 0) ==
+            static_cast<ssize_t>(message.size()));
+    shutdown(sockFD, SHUT_WR);
+    auto reply = readTcpMessage(sockFD);
+    CHECK(reply.size() > 12);
+    // Then the connection is closed
+    char buf[1];
+    CHECK(recv(sockFD, buf, sizeof(buf), 0) == 0);
+  }
+
+  close(sockFD);
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+}
+
+TEST_CASE("Idle TCP connections are closed") {
+  std::unique_ptr<DNS::WorkerStats> stats(new DNS::WorkerStats());
+  auto nowMs = []() {
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count());
+  };
+  DNS::TimerWheel timers(nowMs());
+  // Large replies, to fill the socket buffers quickly
+  std::vector<unsigned char> rdata(4000, 'x');
+  auto handler = [&](const DNS::MessageView &, DNS::ResponseBuilder &builder,
+                     const sockaddr_in &, uint64_t) {
+    builder.add(DNS::ResponseBuilder::Section::ANSWER, 0, DNS::Type::TXT,
+                DNS::CLASS_IN, 60, rdata.data(),
+                static_cast<uint16_t>(rdata.size()));
+    return true;
+  };
+  sockaddr_in address{AF_INET, 0, {htonl(INADDR_LOOPBACK)}};
+  DNS::TcpServer server(address, handler, *stats, timers, nullptr, 200);
+  // Serves until the connections are closed, or for 5s
+  auto serve = [&](std::function<void()> client) {
+    auto start = nowMs();
+    while (nowMs() - start < 5000) {
+      timers.advance(nowMs());
+      server.process();
+      if (server.connections() == 0 && nowMs() - start > 10) {
+        break;
+      }
+      client();
+      usleep(1000);
+    }
+    return nowMs() - start;
+  };
+
+  auto sockFD = socket(AF_INET, SOCK_STREAM, 0);
+  address.sin_port = htons(server.port());
+  REQUIRE(connect(sockFD, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) == 0);
+
+  SECTION("Connections without traffic") {
+    CHECK(serve([]() {}) < 1000);
+    CHECK(server.connections() == 0);
+  }
+
+  SECTION("Clients that send queries and never read the replies") {
+    std::string queries;
+    for (int i = 0; i < 100; i++) {
+      auto query = wireQuery("www.meter.com", DNS::Type::TXT);
+      queries.push_back(0);
+      queries.push_back(static_cast<char>(query.size()));
+      queries += query;
+    }
+    size_t sent = 0;
+    auto flood = [&]() {
+      auto n = send(sockFD, queries.data(), queries.size(),
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+      sent += n > 0 ? n : 0;
+    };
+    // The server stops reading once the replies back up, and gives up on
+    // the client once they stop draining
+    CHECK(serve(flood) < 3000);
+    CHECK(server.connections() == 0);
+    CHECK(sent > queries.size());
+  }
+
+  close(sockFD);
+}
+
+// Writes a self-signed certificate for localhost and its key
+void writeCertificate(const std::string &certificatePath,
+                      const std::string &keyPath) {
+  auto key = EVP_EC_gen("P-256");
+  auto certificate = X509_new();
+  ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+  X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+  X509_gmtime_adj(X509_getm_notAfter(certificate), 86400);
+  X509_set_pubkey(certificate, key);
+  auto name = X509_get_subject_name(certificate);
+  X509_NAME_add_entry_by_txt(
+          name, "CN", MBSTRING_ASC,
+          reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(certificate, name);
+  X509_sign(certificate, key, EVP_sha256());
+  auto file = std::fopen(certificatePath.c_str(), "w");
+  PEM_write_X509(file, certificate);
+  std::fclose(file);
+  file = std::fopen(keyPath.c_str(), "w");
+  PEM_write_PrivateKey(file, key, nullptr, nullptr, 0, nullptr, nullptr);
+  std::fclose(file);
+  X509_free(certificate);
+  EVP_PKEY_free(key);
+}
+
+// Reads a length-prefixed message from a TLS connection
+std::string readTlsMessage(SSL *ssl) {
+  std::string message;
+  size_t expected = 2;
+  char buf[512];
+  while (message.size() < expected) {
+    auto n = SSL_read(ssl, buf,
+                      static_cast<int>(std::min(sizeof(buf),
+                                                expected - message.size())));
+    if (n <= 0) {
+      return std::string();
+    }
+    message.append(buf, n);
+    if (message.size() == 2) {
+      expected += static_cast<uint8_t>(message[0]) << 8 |
+                  static_cast<uint8_t>(message[1]);
+    }
+  }
+  return message.substr(2);
+}
+
+TEST_CASE("DNS over TLS") {
+  std::string certificatePath = "/tmp/dnsd-test-tls.crt";
+  std::string keyPath = "/tmp/dnsd-test-tls.key";
+  writeCertificate(certificatePath, keyPath);
+  DNS::Config config;
+  config.m_tlsCertificate = certificatePath;
+  config.m_tlsKey = "/tmp/dnsd-test-missing.key";
+  CHECK_THROWS_AS(DNS::Daemon("9.9.9.9", config), std::runtime_error);
+  config.m_tlsKey = keyPath;
+  DNS::addRecord(config.m_views, "default:www.meter.com=10.0.0.1");
+  DNS::Daemon daemon("9.9.9.9", config);
+  pthread_t thread_id;
+  pthread_create(&thread_id, nullptr, daemonServer, &daemon);
+  sockaddr_in srvAddr{
+      AF_INET,
+      htons(DNS::Default::PORT),
+      htonl(INADDR_LOOPBACK),
+  };
+  // Wait for the daemon to serve
+  std::vector<std::string> known{"www", "meter", "com"};
+  REQUIRE(DNS::query(srvAddr, known, 1, 1)->m_answers.size() == 1);
+
+  sockaddr_in tlsAddr = srvAddr;
+  tlsAddr.sin_port = htons(DNS::Default::TLS_PORT);
+  auto connectTcp = [&tlsAddr]() {
+    auto sockFD = socket(AF_INET, SOCK_STREAM, 0);
+    timeval timeout{2, 0};
+    setsockopt(sockFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    REQUIRE(connect(sockFD, reinterpret_cast<sockaddr *>(&tlsAddr),
+                    sizeof(tlsAddr)) == 0);
+    return sockFD;
+  };
+  // Clients trust the daemon's certificate only
+  auto ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_load_verify_locations(ctx, certificatePath.c_str(), nullptr);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+
+  SECTION("Pipelined queries, and sessions resumed from tickets") {
+    SSL_SESSION *session = nullptr;
+    for (int connection = 0; connection < 2; connection++) {
+      auto sockFD = connectTcp();
+      auto ssl = SSL_new(ctx);
+      SSL_set_fd(ssl, sockFD);
+      if (session != nullptr) {
+        SSL_set_session(ssl, session);
+      }
+      REQUIRE(SSL_connect(ssl) == 1);
+      CHECK(SSL_session_reused(ssl) == (connection == 1));
+
+      std::string queries;
+      std::vector<std::string> names{"www.meter.com", "www.example.com"};
+      for (size_t i = 0; i < names.size(); i++) {
+        auto query = wireQuery(names[i], 1);
+        query[1] = static_cast<char>(i);
+        queries.push_back(static_cast<char>(query.size() >> 8));
+        queries.push_back(static_cast<char>(query.size() & 0xff));
+        queries += query;
+      }
+      auto size = static_cast<int>(queries.size());
+      REQUIRE(SSL_write(ssl, queries.data(), size) == size);
+      for (size_t i = 0; i < names.size(); i++) {
+        auto message = readTlsMessage(ssl);
+        REQUIRE(message.size() > 12);
+        DNS::Reply reply(
+                reinterpret_cast<const unsigned char *>(message.data()),
+                static_cast<int>(message.size()));
+        CHECK((ntohs(reply.m_hdr.m_id) & 0xff) == i);
+        CHECK(reply.m_answers.size() == 1);
+      }
+      // The tickets came along with the replies
+      if (session == nullptr) {
+        session = SSL_get1_session(ssl);
+        CHECK(SSL_SESSION_is_resumable(session) == 1);
+      }
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+      close(sockFD);
+    }
+    SSL_SESSION_free(session);
+    auto stats = daemon.stats();
+    CHECK(stats[DNS::Counter::TLS_HANDSHAKES] == 2);
+    CHECK(stats[DNS::Counter::TLS_RESUMED] == 1);
+    CHECK(stats[DNS::Counter::TLS_HANDSHAKE_ERRORS] == 0);
+  }
+
+  SECTION("Clients that don't speak TLS are turned away") {
+    auto sockFD = connectTcp();
+    auto query = wireQuery("www.meter.com", 1);
+    std::string message(1, static_cast<char>(query.size() >> 8));
+    message.push_back(static_cast<char>(query.size() & 0xff));
+    message += query;
+    REQUIRE(send(sockFD, message.data(), message.size(), 0) ==
+            static_cast<ssize_t>(message.size()));
+    // The daemon alerts and closes the connection
+    char buf[512];
+    while (recv(sockFD, buf, sizeof(buf), 0) > 0) {
+    }
+    close(sockFD);
+    CHECK(daemon.stats()[DNS::Counter::TLS_HANDSHAKE_ERRORS] == 1);
+    CHECK(daemon.stats()[DNS::Counter::TLS_HANDSHAKES] == 0);
+  }
+
+  SSL_CTX_free(ctx);
+  daemon.stop();
+  pthread_join(thread_id, nullptr);
+  std::remove(certificatePath.c_str());
+  std::remove(keyPath.c_str());
+}
+
+namespace {
+std::string be16(uint16_t value) {
+  return std::string{static_cast<char>(value >> 8),
+                     static_cast<char>(value & 0xff)};
+}
+
+// UDP (or another protocol's) datagram to the port, in an IPv4 or IPv6 packet
+std::string ipPacket(bool ipv6, uint16_t port, const std::string &payload,
+                     uint8_t protocol = IPPROTO_UDP) {
+  auto udp = be16(5353) + be16(port) + be16(8 + payload.size()) + be16(0) +
+             payload;
+  if (ipv6) {
+    std::string header(40, '\0');
+    header[0] = 0x60;
+    header.replace(4, 2, be16(udp.size()));
+    header[6] = static_cast<char>(protocol);
+    return header + udp;
+  }
+  std::string header(20, '\0');
+  header[0] = 0x45;
+  header.replace(2, 2, be16(20 + udp.size()));
+  header[9] = static_cast<char>(protocol);
+  return header + udp;
+}
+
+std::string ethernetFrame(uint16_t etherType, const std::string &packet,
+                          bool vlan = false) {
+  std::string frame(12, '\x02');
+  if (vlan) {
+    frame += be16(0x8100) + be16(42);
+  }
+  return frame + be16(etherType) + packet;
+}
+
+// Writes a pcap file of the frames, in host order
+void writePcap(const std::string &path, uint32_t linkType,
+               const std::vector<std::string> &frames) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  uint32_t header[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, linkType};
+  file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (const auto &frame : frames) {
+    uint32_t length = static_cast<uint32_t>(frame.size());
+    uint32_t record[4] = {0, 0, length, length};
+    file.write(reinterpret_cast<const char *>(record), sizeof(record));
+    file.write(frame.data(), frame.size());
+  }
+}
+} // namespace
+
+TEST_CASE("Queries are read from pcap files") {
+  std::string path = "/tmp/dnsd-test.pcap";
+
+  SECTION("UDP payloads to the port are kept, other packets are counted") {
+    writePcap(path, 1,
+              {ethernetFrame(0x0800, ipPacket(false, 53, "first")),
+               ethernetFrame(0x0800, ipPacket(false, 53, "tagged"), true),
+               ethernetFrame(0x86dd, ipPacket(true, 53, "ipv6")),
+               ethernetFrame(0x0800, ipPacket(false, 53, "tcp", IPPROTO_TCP)),
+               ethernetFrame(0x0800, ipPacket(false, 5353, "other")),
+               ethernetFrame(0x0806, std::string(28, '\0')),
+               ethernetFrame(0x0800, ipPacket(false, 53, "cut"))
+                       .substr(0, 30)});
+    auto capture = DNS::loadCapture(path, 53);
+    REQUIRE(capture.m_payloads.size() == 3);
+    std::string data(capture.m_data.begin(), capture.m_data.end());
+    CHECK(data == "firsttaggedipv6");
+    CHECK(capture.m_payloads[1].m_offset == 5);
+    CHECK(capture.m_payloads[1].m_length == 6);
+    CHECK(capture.m_skipped ==
+          std::map<std::string, uint64_t>{{"not udp", 1},
+                                          {"other port", 1},
+                                          {"not ip", 1},
+                                          {"truncated", 1}});
+  }
+
+  SECTION("Raw IP captures") {
+    writePcap(path, 101,
+              {ipPacket(true, 53, "ipv6"), ipPacket(false, 53, "ipv4")});
+    auto capture = DNS::loadCapture(path, 53);
+    CHECK(std::string(capture.m_data.begin(), capture.m_data.end()) ==
+          "ipv6ipv4");
+  }
+
+  SECTION("A truncated file keeps the packets read before the cut") {
+    writePcap(path, 1,
+              {ethernetFrame(0x0800, ipPacket(false, 53, "first")),
+               ethernetFrame(0x0800, ipPacket(false, 53, "second"))});
+    truncate(path.c_str(), 24 + 16 + 47 + 16 + 10);
+    auto capture = DNS::loadCapture(path, 53);
+    REQUIRE(capture.m_payloads.size() == 1);
+    CHECK(capture.m_payloads[0].m_length == 5);
+
+    truncate(path.c_str(), 20);
+    CHECK_THROWS_AS(DNS::loadCapture(path, 53), std::runtime_error);
+  }
+
+  SECTION("Files that are not pcap are rejected") {
+    writePcap(path, 1, {});
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.write("\x0a\x0d\x0d\x0a", 4);
+    file.close();
+    CHECK_THROWS_AS(DNS::loadCapture(path, 53), std::runtime_error);
+    CHECK_THROWS_AS(DNS::loadCapture("/tmp/dnsd-test-missing.pcap", 53),
+                    std::runtime_error);
+  }
+
+  std::remove(path.c_str());
+}
+
+TEST_CASE("Hierarchical timer wheel") {
+  DNS::TimerWheel wheel(1000);
+
+  SECTION("Timers fire once due, across every level") {
+    std::vector<uint64_t> fired;
+    std::vector<std::unique_ptr<DNS::Timer>> timers;
+    std::vector<uint64_t> delays{1, 255, 256, 300, 70000, 20000000,
+                                 5000000000};
+    for (auto delay : delays) {
+      timers.emplace_back(new DNS::Timer(
+              [&fired, &wheel]() { fired.push_back(wheel.nowMs()); }));
+      wheel.schedule(*timers.back(), 1000 + delay);
+    }
+    CHECK(wheel.size() == delays.size());
+    CHECK(wheel.timeoutMs(1000) == 1);
+    for (size_t i = 0; i < delays.size(); i++) {
+      auto due = 1000 + delays[i];
+      wheel.advance(due - 1);
+      CHECK(fired.size() == i);
+      wheel.advance(due);
+      REQUIRE(fired.size() == i + 1);
+      CHECK(fired.back() == due);
+      CHECK_FALSE(timers[i]->pending());
+    }
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.timeoutMs(wheel.nowMs()) == -1);
+  }
+
+  SECTION("Timers are cancelled, rescheduled and destroyed in O(1)") {
+    int fired = 0;
+    DNS::Timer timer([&fired]() { fired++; });
+    wheel.schedule(timer, 1500);
+    wheel.cancel(timer);
+    CHECK_FALSE(timer.pending());
+    wheel.schedule(timer, 1100);
+    wheel.schedule(timer, 1200);
+    CHECK(wheel.size() == 1);
+    CHECK(wheel.advance(1199) == 0);
+    CHECK(wheel.advance(1200) == 1);
+    CHECK(fired == 1);
+    {
+      DNS::Timer scoped([&fired]() { fired++; });
+      wheel.schedule(scoped, 1300);
+    }
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.advance(2000) == 0);
+  }
+
+  SECTION("Callbacks reschedule themselves") {
+    int fired = 0;
+    std::unique_ptr<DNS::Timer> periodic;
+    periodic.reset(new DNS::Timer([&]() {
+      fired++;
+      wheel.schedule(*periodic, wheel.nowMs() + 100);
+    }));
+    wheel.schedule(*periodic, 1100);
+    wheel.advance(2050);
+    CHECK(fired == 10);
+    CHECK(wheel.timeoutMs(2050) == 50);
+  }
+
+  SECTION("Many pending timers") {
+    const int count = 200000;
+    std::vector<std::unique_ptr<DNS::Timer>> timers;
+    int fired = 0;
+    int early = 0;
+    uint64_t seed = 1;
+    for (int i = 0; i < count; i++) {
+      timers.emplace_back(new DNS::Timer([&, i]() {
+        fired++;
+        early += wheel.nowMs() < timers[i]->expiresMs();
+      }));
+      seed = seed * 6364136223846793005 + 1442695040888963407;
+      wheel.schedule(*timers.back(), 1000 + (seed >> 33) % 100000);
+    }
+    for (int i = 0; i < count; i += 2) {
+      wheel.cancel(*timers[i]);
+    }
+    for (uint64_t now = 1000; now <= 101000; now += 777) {
+      wheel.advance(now);
+    }
+    wheel.advance(101000);
+    CHECK(fired == count / 2);
+    CHECK(early == 0);
+    CHECK(wheel.size() == 0);
+  }
+}
+
+namespace {
+// Records the hooks it runs, and ends the requests it is told to
+struct TraceStage : DNS::PipelineStage {
+  TraceStage(char name, bool end) : m_name(name), m_end(end) {}
+  bool process(std::string &trace) {
+    trace.push_back(m_name);
+    return !m_end;
+  }
+  void complete(std::string &trace) {
+    trace.push_back(static_cast<char>(std::toupper(m_name)));
+  }
+  char m_name;
+  bool m_end;
+};
+
+// Only completes requests
+struct CompleteStage : DNS::PipelineStage {
+  void complete(std::string &trace) { trace.push_back('!'); }
+};
+} // namespace
+
+TEST_CASE("Pipelines of stages") {
+  std::string trace;
+  SECTION("Stages process the request in order, then complete it") {
+    auto pipeline = DNS::makePipeline(TraceStage('a', false), CompleteStage(),
+                                      TraceStage('b', false));
+    pipeline.run(trace);
+    CHECK(trace == "abA!B");
+  }
+
+  SECTION("A stage ends the request for the stages that follow") {
+    auto pipeline = DNS::makePipeline(TraceStage('a', true),
+                                      TraceStage('b', false), CompleteStage());
+    pipeline.run(trace);
+    CHECK(trace == "aAB!");
+  }
+}
+
+TEST_CASE("Presentation format") {
+  auto query = wireQuery("www.meter.com", DNS::Type::MX);
+  DNS::MessageView view(reinterpret_cast<const unsigned char *>(query.data()),
+                        static_cast<int>(query.size()));
+  DNS::ResponseBuilder builder;
+  builder.begin(view);
+  unsigned char mx[4] = {0, 10, 0xc0, DNS::Default::HDR_SIZE};
+  REQUIRE(builder.add(DNS::ResponseBuilder::Section::ANSWER, 0,
+                      DNS::Type::MX, DNS::CLASS_IN, 180, mx, sizeof(mx)));
+  auto text = [](const DNS::Formatter &formatter) {
+    return std::string(formatter.data(), formatter.size());
+  };
+
+  SECTION("Messages are printed the way dig prints them") {
+    DNS::Formatter formatter;
+    formatter.format(builder.data(), builder.size());
+    auto output = text(formatter);
+    CHECK(output.find("opcode: QUERY, status: NOERROR, id: 4660") !=
+          std::string::npos);
+    CHECK(output.find("flags: qr rd; QUERY: 1, ANSWER: 1") !=
+          std::string::npos);
+    CHECK(output.find(";www.meter.com.\t\tIN\tMX\n") != std::string::npos);
+    CHECK(output.find("www.meter.com.\t180\tIN\tMX\t10 www.meter.com.\n") !=
+          std::string::npos);
+    CHECK(!formatter.overflowed());
+
+    // Parsed records have no message to follow the pointers of their data
+    // into, which is then printed in the generic format
+    DNS::Reply reply(builder.data(), static_cast<int>(builder.size()));
+    formatter.clear();
+    formatter.format(reply.m_answers[0]);
+    CHECK(text(formatter) == "www.meter.com.\t180\tIN\tMX\t\\# 4 000AC00C\n");
+  }
+
+  SECTION("Messages are printed as JSON") {
+    DNS::Formatter formatter(DNS::Formatter::Style::JSON);
+    formatter.format(builder.data(), builder.size());
+    CHECK(text(formatter) ==
+          "{\"id\":4660,\"opcode\":\"QUERY\",\"status\":\"NOERROR\","
+          "\"flags\":[\"qr\",\"rd\"],\"question\":[{\"name\":"
+          "\"www.meter.com.\",\"class\":\"IN\",\"type\":\"MX\"}],"
+          "\"answer\":[{\"name\":\"www.meter.com.\",\"ttl\":180,"
+          "\"class\":\"IN\",\"type\":\"MX\",\"data\":\"10 www.meter.com.\"}]}");
+  }
+
+  SECTION("Special characters in labels are escaped") {
+    auto odd = wireQuery("www.meter.com", 99);
+    odd[13] = ' ';
+    odd[15] = '"';
+    DNS::Formatter formatter;
+    formatter.format(reinterpret_cast<const unsigned char *>(odd.data()),
+                     odd.size());
+    CHECK(text(formatter).find(";\\032w\\\".meter.com.\t\tIN\tTYPE99\n") !=
+          std::string::npos);
+
+    DNS::Formatter json(DNS::Formatter::Style::JSON);
+    json.format(reinterpret_cast<const unsigned char *>(odd.data()),
+                odd.size());
+    CHECK(text(json).find("\"name\":\"\\\\032w\\\\\\\".meter.com.\"") !=
+          std::string::npos);
+  }
+
+  SECTION("Malformed messages are reported where they stop parsing") {
+    DNS::Formatter formatter;
+    formatter.format(builder.data(), builder.size() - 1);
+    auto output = text(formatter);
+    CHECK(output.find(";www.meter.com.\t\tIN\tMX\n") != std::string::npos);
+    CHECK(output.find("10 www.meter.com.") == std::string::npos);
+    CHECK(output.find(";; MALFORMED at offset 31") != std::string::npos);
+  }
+
+  SECTION("Output that does not fit the buffer is cut short") {
+    char buf[32];
+    DNS::Formatter formatter(buf, sizeof(buf));
+    formatter.format(builder.data(), builder.size());
+    CHECK(formatter.overflowed());
+    CHECK(formatter.size() <= sizeof(buf));
+    CHECK(text(formatter).substr(formatter.size() - 3) == "...");
+  }
+}